@@ -2,170 +2,374 @@
 
 #include <fmt/core.h>
 #include <graaflib/graph.h>
-#include <graaflib/io/dot.h>
 #include <graaflib/algorithm/graph_traversal/depth_first_search.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <fcntl.h>
+#include <unistd.h>
+#include <unordered_set>
 
-graaf::vertex_id_t LibcCallgraph::add_vertex(const std::string& vertex, bool has_func_call) {
-    if (vertex_id_map.find(vertex) != vertex_id_map.end()) {
+
+namespace {
+
+struct NamePool {
+    std::pmr::monotonic_buffer_resource arena;
+    std::unordered_set<std::string_view> names;
+};
+
+NamePool& name_pool() {
+    static NamePool pool;
+    return pool;
+}
+
+} // namespace
+
+std::string_view VertexNames::intern(std::string_view name) {
+    NamePool& pool = name_pool();
+    auto it = pool.names.find(name);
+    if (it != pool.names.end()) {
+        return *it;
+    }
+    char* data = static_cast<char*>(pool.arena.allocate(name.size() + 1, 1));
+    std::copy(name.begin(), name.end(), data);
+    data[name.size()] = '\0';
+    return *pool.names.emplace(data, name.size()).first;
+}
+
+std::string_view VertexNames::find(std::string_view name) {
+    const NamePool& pool = name_pool();
+    auto it = pool.names.find(name);
+    return it == pool.names.end() ? std::string_view() : *it;
+}
+
+std::size_t VertexNames::size() {
+    return name_pool().names.size();
+}
+
+void VertexNames::clear() {
+    NamePool& pool = name_pool();
+    pool.names.clear();
+    pool.arena.release();
+}
+
+const LibcCallgraph::Storage& LibcCallgraph::view() const {
+    static const Storage empty;
+    return storage ? *storage : empty;
+}
+
+LibcCallgraph::Storage& LibcCallgraph::mutable_storage() {
+    if (!storage) {
+        storage = std::make_shared<Storage>();
+    } else if (storage.use_count() > 1) {
+        // Shared with a snapshot, which must not see the change
+        storage = std::make_shared<Storage>(*storage);
+    }
+    return *storage;
+}
+
+const LibcCallgraph::VertexInfo* LibcCallgraph::find(std::string_view vertex) const {
+    if (!storage) {
+        return nullptr;
+    }
+    // By address first, the names the graphs hand out are interned. Any other is looked up in the pool.
+    auto it = storage->vertices.find(vertex);
+    if (it == storage->vertices.end()) {
+        std::string_view interned = VertexNames::find(vertex);
+        if (interned.data() == nullptr || interned.data() == vertex.data()) {
+            return nullptr;
+        }
+        it = storage->vertices.find(interned);
+    }
+    return it == storage->vertices.end() ? nullptr : &it->second;
+}
+
+graaf::vertex_id_t LibcCallgraph::add_vertex(std::string_view vertex, bool has_func_call) {
+    if (const VertexInfo* info = find(vertex)) {
         //fmt::print("[add_vertex] Vertex {} already exists in the graph \n", vertex);
-        return vertex_id_map[vertex];
+        return info->id;
     }
 
-    graaf::vertex_id_t vertex_id = graph.add_vertex(vertex);
-    vertex_id_map[vertex] = vertex_id;
-    func_call_map[vertex] = has_func_call;
+    Storage& s = mutable_storage();
+    std::string_view name = VertexNames::intern(vertex);
+    graaf::vertex_id_t vertex_id = s.graph.add_vertex(name);
+    s.vertices.emplace(name, VertexInfo{vertex_id, has_func_call});
     return vertex_id;
 }
 
-void LibcCallgraph::add_edge(const std::string& vertex_lhs, const std::string& vertex_rhs, const std::string& edge){
-    if (vertex_id_map.find(vertex_lhs) == vertex_id_map.end()) {
+void LibcCallgraph::add_edge(std::string_view vertex_lhs, std::string_view vertex_rhs, const std::string& edge){
+    const VertexInfo* lhs = find(vertex_lhs);
+    if (!lhs) {
         //fmt::print("[add_edge] Vertex {} not found in the graph\n", vertex_lhs);
         return;
     }
 
-    if (vertex_id_map.find(vertex_rhs) == vertex_id_map.end()) {
+    const VertexInfo* rhs = find(vertex_rhs);
+    if (!rhs) {
         //fmt::print("[add_edge] Vertex {} not found in the graph\n", vertex_rhs);
         return;
     }
 
-    graph.add_edge(vertex_id_map[vertex_lhs], vertex_id_map[vertex_rhs], edge);
+    graaf::vertex_id_t lhs_id = lhs->id, rhs_id = rhs->id;
+    add_label(mutable_storage(), lhs_id, rhs_id, edge);
+}
+
+void LibcCallgraph::add_label(Storage& s, graaf::vertex_id_t lhs_id, graaf::vertex_id_t rhs_id, std::string label) {
+    // Control edges are merged over, one back to the same vertex is no transition at all
+    if (lhs_id == rhs_id && label == "control") {
+        return;
+    }
+    if (!s.graph.has_edge(lhs_id, rhs_id)) {
+        s.graph.add_edge(lhs_id, rhs_id, EdgeLabels{std::move(label)});
+        return;
+    }
+    EdgeLabels& labels = s.graph.get_edge(lhs_id, rhs_id);
+    if (std::find(labels.begin(), labels.end(), label) == labels.end()) {
+        labels.push_back(std::move(label));
+    }
 }
-void LibcCallgraph::remove_edge(const std::string& vertex_lhs, const std::string& vertex_rhs){
-    if (vertex_id_map.find(vertex_lhs) == vertex_id_map.end()) {
+void LibcCallgraph::remove_edge(std::string_view vertex_lhs, std::string_view vertex_rhs){
+    const VertexInfo* lhs = find(vertex_lhs);
+    if (!lhs) {
         //fmt::print("[remove_edge] Vertex {} not found in the graph\n", vertex_lhs);
         return;
     }
 
-    if (vertex_id_map.find(vertex_rhs) == vertex_id_map.end()) {
+    const VertexInfo* rhs = find(vertex_rhs);
+    if (!rhs) {
         //fmt::print("[remove_edge] Vertex {} not found in the graph\n", vertex_rhs);
         return;
     }
 
-    graph.remove_edge(vertex_id_map[vertex_lhs], vertex_id_map[vertex_rhs]);
+    graaf::vertex_id_t lhs_id = lhs->id, rhs_id = rhs->id;
+    mutable_storage().graph.remove_edge(lhs_id, rhs_id);
 }
 
-void LibcCallgraph::remove_vertex(const std::string& vertex) {
-    if (vertex_id_map.find(vertex) == vertex_id_map.end()) {
+void LibcCallgraph::remove_vertex(std::string_view vertex) {
+    const VertexInfo* info = find(vertex);
+    if (!info) {
         //fmt::print("Vertex {} not found in the graph\n", vertex);
         return;
     }
 
-    graph.remove_vertex(vertex_id_map[vertex]);
-    vertex_id_map.erase(vertex);
-    func_call_map.erase(vertex);
+    graaf::vertex_id_t vertex_id = info->id;
+    Storage& s = mutable_storage();
+    std::string_view name = s.graph.get_vertex(vertex_id);
+    s.graph.remove_vertex(vertex_id);
+    s.vertices.erase(name);
 }
 
-void LibcCallgraph::combine_vertex(const std::string& vertex_lhs, const std::string& vertex_rhs) {
-    if (vertex_id_map.find(vertex_lhs) == vertex_id_map.end()) {
+void LibcCallgraph::combine_vertex(std::string_view vertex_lhs, std::string_view vertex_rhs) {
+    const VertexInfo* lhs = find(vertex_lhs);
+    if (!lhs) {
         //fmt::print("[combine_vertex {} {}] Vertex {} not found in the graph\n", vertex_lhs, vertex_rhs, vertex_lhs);
         return;
     }
 
-    if (vertex_id_map.find(vertex_rhs) == vertex_id_map.end()) {
+    const VertexInfo* rhs = find(vertex_rhs);
+    if (!rhs) {
         //fmt::print("[combine_vertex {} {}] Vertex {} not found in the graph\n", vertex_lhs, vertex_rhs, vertex_rhs);
         return;
     }
 
-    // Since combine_vertex does not exist, we need to manually combine edges
-    for (const auto& edge : graph.get_edges()) {
-        if (edge.first.first == vertex_id_map[vertex_rhs]) {
-            graph.add_edge(vertex_id_map[vertex_lhs], edge.first.second, edge.second);
+    graaf::vertex_id_t lhs_id = lhs->id, rhs_id = rhs->id;
+    Storage& s = mutable_storage();
+
+    // Control self loops are never kept, there is nothing to merge
+    if (lhs_id == rhs_id) {
+        return;
+    }
+
+    // Since combine_vertex does not exist, we need to manually combine edges. They are collected first, adding
+    // edges while iterating over the edge map may rehash it. The control edges from lhs to rhs are merged over, the
+    // other labels on them are left as a loop on lhs.
+    std::vector<std::pair<graaf::edge_id_t, std::string>> moved;
+    for (const auto& edge : s.graph.get_edges()) {
+        if (edge.first.first == rhs_id) {
+            graaf::vertex_id_t target = (edge.first.second == rhs_id) ? lhs_id : edge.first.second;
+            for (const auto& label : edge.second) {
+                moved.emplace_back(graaf::edge_id_t{lhs_id, target}, label);
+            }
             //fmt::print("[combine_vertex {} {}] Adding edge - lhs: {} -> {}\n", vertex_lhs, vertex_rhs, vertex_lhs, graph.get_vertex(edge.first.second));
-        }
-        if (edge.first.second == vertex_id_map[vertex_rhs]) {
-            if (edge.first.first == vertex_id_map[vertex_lhs]) {
-                continue;
+        } else if (edge.first.second == rhs_id) {
+            for (const auto& label : edge.second) {
+                moved.emplace_back(graaf::edge_id_t{edge.first.first, lhs_id}, label);
             }
-            graph.add_edge(edge.first.first, vertex_id_map[vertex_lhs], edge.second);
             //fmt::print("[combine_vertex {} {}] Adding edge - first: {} -> {}\n", vertex_lhs, vertex_rhs, graph.get_vertex(edge.first.first), vertex_lhs);
         }
     }
-    graph.remove_vertex(vertex_id_map[vertex_rhs]);
-    vertex_id_map.erase(vertex_rhs);
-    func_call_map.erase(vertex_rhs);
+    for (auto& edge : moved) {
+        add_label(s, edge.first.first, edge.first.second, std::move(edge.second));
+    }
+    std::string_view rhs_name = s.graph.get_vertex(rhs_id);
+    s.graph.remove_vertex(rhs_id);
+    s.vertices.erase(rhs_name);
     //fmt::print("[combine_vertex {} {}] Removing vertex: {}\n",vertex_lhs, vertex_rhs, vertex_rhs);
 }
 
 void LibcCallgraph::print(){
     //fmt::print("Graph:\n");
-    for (auto& vertex : graph.get_vertices()) {
+    for (auto& vertex : view().graph.get_vertices()) {
         //fmt::print("Vertex: {}\n", vertex.second);
-        for (auto& edge : graph.get_edges()) {
+        for (auto& edge : view().graph.get_edges()) {
             //fmt::print("    Edge: {} -> {}\n", edge.first.first, edge.first.second);
         }
     }
 }
 
-void LibcCallgraph::dump_todot(const std::string& filename, std::string entry, std::string exit){ 
-    const std::filesystem::path path = filename;
-  const auto vertex_writer{[this, entry, exit](graaf::vertex_id_t vertex_id,
-                                               const std::string& vertex) -> std::string {
-
-    if (vertex == entry) {
-        return fmt::format("label=\"{}\",fillcolor=lightgreen, style=filled",
-                       vertex);
-    } else if (vertex == exit) {
-        return fmt::format("label=\"{}\",fillcolor=darkorchid1, style=filled",
-                       vertex);
-    } else if (func_call_map[vertex]) {
-        return fmt::format("label=\"{}\",fillcolor=lightcoral, style=filled",
-                       vertex);
-    } else {
-        return fmt::format("label=\"{}\",fillcolor=lightcyan, style=filled",
-                       vertex);
-    }
-  }};
-
-  const auto edge_writer{[](const graaf::edge_id_t& /*edge_id*/,
-                            const auto& edge) -> std::string {
-        if (edge == "control") {
-            return fmt::format("label=\"\", style=dashed, color=gray, fontcolor=gray");
-        } else {
-        return fmt::format("label=\"{}\", style=solid, color=red, fontcolor=red",
-                       edge);
+namespace {
+
+/* Bytes of DOT output buffered before each write to the file */
+constexpr std::size_t DOT_WRITE_BUFFER = 1 << 20;
+
+/**
+ * DOT output appended to a buffer and written to the file descriptor in large writes, with no formatting in between
+ */
+class DotWriter {
+public:
+    explicit DotWriter(const std::string& filename)
+        : fd(::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) {
+        buffer.reserve(DOT_WRITE_BUFFER);
+    }
+    ~DotWriter() {
+        if (fd >= 0) {
+            flush();
+            ::close(fd);
+        }
+    }
+
+    bool ok() const { return fd >= 0; }
+
+    DotWriter& operator<<(std::string_view text) {
+        if (buffer.size() + text.size() > DOT_WRITE_BUFFER) {
+            flush();
+        }
+        buffer.append(text);
+        return *this;
+    }
+
+    DotWriter& operator<<(std::size_t value) {
+        char digits[20];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        return *this << std::string_view(digits, result.ptr - digits);
+    }
+
+private:
+    void flush() {
+        const char* data = buffer.data();
+        std::size_t left = buffer.size();
+        while (left > 0) {
+            ssize_t written = ::write(fd, data, left);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                break;
+            }
+            data += written;
+            left -= written;
+        }
+        buffer.clear();
+    }
+
+    int fd;
+    std::string buffer;
+};
+
+} // namespace
+
+void LibcCallgraph::dump_todot(const std::string& filename, std::string_view entry, std::string_view exit) const {
+    DotWriter out(filename);
+    if (!out.ok()) {
+        //fmt::print("[dump_todot] Failed to open {}\n", filename);
+        return;
+    }
+
+    // Vertices calling a function, by ID, so that the name of a vertex is never looked up while writing it
+    const Storage& s = view();
+    std::vector<bool> func_call;
+    for (const auto& vertex : s.vertices) {
+        if (vertex.second.has_func_call) {
+            if (vertex.second.id >= func_call.size()) {
+                func_call.resize(vertex.second.id + 1);
+            }
+            func_call[vertex.second.id] = true;
+        }
+    }
+    const VertexInfo* entry_info = find(entry);
+    const VertexInfo* exit_info = find(exit);
+
+    out << "digraph {\n";
+    for (const auto& vertex : s.graph.get_vertices()) {
+        const char* fillcolor = "lightcyan";
+        if (entry_info && vertex.first == entry_info->id) {
+            fillcolor = "lightgreen";
+        } else if (exit_info && vertex.first == exit_info->id) {
+            fillcolor = "darkorchid1";
+        } else if (vertex.first < func_call.size() && func_call[vertex.first]) {
+            fillcolor = "lightcoral";
+        }
+        out << "\t" << vertex.first << " [label=\"" << vertex.second << "\",fillcolor=" << fillcolor
+            << ", style=filled];\n";
+    }
+    for (const auto& edge : s.graph.get_edges()) {
+        for (const auto& label : edge.second) {
+            out << "\t" << edge.first.first << " -> " << edge.first.second;
+            if (label == "control") {
+                out << " [label=\"\", style=dashed, color=gray, fontcolor=gray];\n";
+            } else {
+                out << " [label=\"" << label << "\", style=solid, color=red, fontcolor=red];\n";
+            }
         }
-    }};
-        
-    graaf::io::to_dot(graph, path, vertex_writer, edge_writer);
+    }
+    out << "}\n";
 }
 
 
-std::vector<std::string> LibcCallgraph::get_outgoing_edges (const std::string& vertex) {
+std::vector<std::string> LibcCallgraph::get_outgoing_edges (std::string_view vertex) {
     std::vector<std::string> outgoing_edges;
-    if (vertex_id_map.find(vertex) == vertex_id_map.end()) {
+    const VertexInfo* info = find(vertex);
+    if (!info) {
         //fmt::print("[get_outgoing_edges] Vertex {} not found in the graph\n", vertex);
         return outgoing_edges;
     }
 
-    for (const auto& edge : graph.get_neighbors(vertex_id_map[vertex])) {
-        outgoing_edges.push_back(graph.get_edge(vertex_id_map[vertex], edge));
+    const auto& graph = view().graph;
+    for (const auto& edge : graph.get_neighbors(info->id)) {
+        const EdgeLabels& labels = graph.get_edge(info->id, edge);
+        outgoing_edges.insert(outgoing_edges.end(), labels.begin(), labels.end());
     }
     return outgoing_edges;
 }
 
-std::vector<std::string> LibcCallgraph::get_neighbors(const std::string& vertex) {
-    std::vector<std::string> neighbors;
-    if (vertex_id_map.find(vertex) == vertex_id_map.end()) {
+std::vector<std::string_view> LibcCallgraph::get_neighbors(std::string_view vertex) {
+    std::vector<std::string_view> neighbors;
+    const VertexInfo* info = find(vertex);
+    if (!info) {
         //fmt::print("[get_neighbors] Vertex {} not found in the graph\n", vertex);
         return neighbors;
     }
 
-    for (const auto& neighbor : graph.get_neighbors(vertex_id_map[vertex])) {
-        neighbors.push_back(graph.get_vertex(neighbor));
+    const auto& graph = view().graph;
+    for (const auto& neighbor : graph.get_neighbors(info->id)) {
+        neighbors.insert(neighbors.end(), graph.get_edge(info->id, neighbor).size(), graph.get_vertex(neighbor));
     }
     return neighbors;
 }
 
-std::vector<std::string>  LibcCallgraph::get_control_edge_neighbors(const std::string& vertex) const {
-    std::vector<std::string> neighbors;
-    if (vertex_id_map.find(vertex) == vertex_id_map.end()) {
+std::vector<std::string_view>  LibcCallgraph::get_control_edge_neighbors(std::string_view vertex) const {
+    std::vector<std::string_view> neighbors;
+    const VertexInfo* info = find(vertex);
+    if (!info) {
         //fmt::print("[get_control_edge_neighbors] Vertex {} not found in the graph\n", vertex);
         return neighbors;
     }
 
-    for (const auto& neighbor : graph.get_neighbors(vertex_id_map.at(vertex))) {
-        if (graph.get_edge(vertex_id_map.at(vertex), neighbor) == "control") {
+    const auto& graph = view().graph;
+    for (const auto& neighbor : graph.get_neighbors(info->id)) {
+        const EdgeLabels& labels = graph.get_edge(info->id, neighbor);
+        if (std::find(labels.begin(), labels.end(), "control") != labels.end()) {
             neighbors.push_back(graph.get_vertex(neighbor));
         }
     }
@@ -173,16 +377,22 @@ std::vector<std::string>  LibcCallgraph::get_control_edge_neighbors(const std::s
 }
 
 
-std::vector<std::string>  LibcCallgraph::get_user_edge_neighbors(const std::string& vertex) const {
-    std::vector<std::string> neighbors;
-    if (vertex_id_map.find(vertex) == vertex_id_map.end()) {
+std::vector<std::string_view>  LibcCallgraph::get_user_edge_neighbors(std::string_view vertex) const {
+    std::vector<std::string_view> neighbors;
+    const VertexInfo* info = find(vertex);
+    if (!info) {
         //fmt::print("[get_control_edge_neighbors] Vertex {} not found in the graph\n", vertex);
         return neighbors;
     }
 
-    for (const auto& neighbor : graph.get_neighbors(vertex_id_map.at(vertex))) {
-        std::string neighbor2 =  graph.get_edge(vertex_id_map.at(vertex), neighbor);
-        if (neighbor2.find("user:") == 0) {
+    const auto& graph = view().graph;
+    for (const auto& neighbor : graph.get_neighbors(info->id)) {
+        // A call looping back to the vertex is left as it is, merging it would never end
+        if (neighbor == info->id) {
+            continue;
+        }
+        const EdgeLabels& labels = graph.get_edge(info->id, neighbor);
+        if (std::any_of(labels.begin(), labels.end(), [](const std::string& label) { return label.find("user:") == 0; })) {
             neighbors.push_back(graph.get_vertex(neighbor));
         }
     }
@@ -190,24 +400,38 @@ std::vector<std::string>  LibcCallgraph::get_user_edge_neighbors(const std::stri
 }
 
 
-std::vector<std::string>  LibcCallgraph::get_vertices() const{
-    std::vector<std::string> vertices;
-    for (const auto& vertex : graph.get_vertices()) {
+std::vector<std::string_view>  LibcCallgraph::get_vertices() const{
+    std::vector<std::string_view> vertices;
+    for (const auto& vertex : view().graph.get_vertices()) {
         vertices.push_back(vertex.second);
     }
     std::reverse(vertices.begin(), vertices.end());
     return vertices;
 }
 
+std::size_t LibcCallgraph::num_vertices() const {
+    return view().graph.get_vertices().size();
+}
+
+std::size_t LibcCallgraph::num_edges() const {
+    std::size_t count = 0;
+    for (const auto& edge : view().graph.get_edges()) {
+        count += edge.second.size();
+    }
+    return count;
+}
 
 
-void  LibcCallgraph::insert_graph(const LibcCallgraph& other, const std::string& entry, const std::string& exit){
-    for (const auto& vertex : other.graph.get_vertices()) {
-        add_vertex(vertex.second, other.func_call_map.at(vertex.second));
+void  LibcCallgraph::insert_graph(const LibcCallgraph& other, std::string_view entry, std::string_view exit){
+    const auto& graph = other.view().graph;
+    for (const auto& vertex : graph.get_vertices()) {
+        add_vertex(vertex.second, other.find(vertex.second)->has_func_call);
     }
 
-    for (const auto& edge : other.graph.get_edges()) {
-        add_edge(other.graph.get_vertex(edge.first.first), other.graph.get_vertex(edge.first.second), edge.second);
+    for (const auto& edge : graph.get_edges()) {
+        for (const auto& label : edge.second) {
+            add_edge(graph.get_vertex(edge.first.first), graph.get_vertex(edge.first.second), label);
+        }
     }
 
 }
\ No newline at end of file
@@ -0,0 +1,321 @@
+#include "GraphSnapshot.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+/* File magic and version of the snapshot format */
+#define SNAPSHOT_MAGIC      "LCGS"
+#define SNAPSHOT_VERSION    1
+
+namespace {
+
+void put_varint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+/**
+ * Bounds checked varint decoder, any read past the end or oversized value clears ok and reads as 0 from there on
+ */
+struct SnapshotReader {
+    const uint8_t* pos;
+    const uint8_t* end;
+    bool ok = true;
+
+    uint32_t varint() {
+        uint64_t value = 0;
+        for (unsigned shift = 0; ok && shift < 35; shift += 7) {
+            if (pos == end) {
+                break;
+            }
+            uint8_t byte = *pos++;
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                if (value > UINT32_MAX) {
+                    break;
+                }
+                return static_cast<uint32_t>(value);
+            }
+        }
+        ok = false;
+        return 0;
+    }
+
+    /* Count of the items that follow, each at least `min_bytes` long, so that a corrupted count can't allocate */
+    uint32_t count(std::size_t min_bytes = 1) {
+        uint32_t value = varint();
+        if (static_cast<std::size_t>(end - pos) < value * min_bytes) {
+            ok = false;
+            return 0;
+        }
+        return value;
+    }
+
+    /* Index below `limit`, or `none` encoded as 0 when biased */
+    uint32_t index(uint32_t limit, bool biased = false) {
+        uint32_t value = varint();
+        if (biased) {
+            if (value == 0) {
+                return GraphSnapshot::NONE;
+            }
+            value--;
+        }
+        if (value >= limit) {
+            ok = false;
+            return 0;
+        }
+        return value;
+    }
+};
+
+} // namespace
+
+uint32_t GraphSnapshot::intern(std::string_view str) {
+    auto it = string_ids.find(str);
+    if (it != string_ids.end()) {
+        return it->second;
+    }
+    uint32_t id = strings.size();
+    strings.emplace_back(str);
+    string_ids.emplace(strings.back(), id);
+    return id;
+}
+
+const std::string& GraphSnapshot::str(uint32_t id) const {
+    static const std::string none;
+    return id < strings.size() ? strings[id] : none;
+}
+
+GraphSnapshot::Graph& GraphSnapshot::add_graph(const std::string& name, const LibcCallgraph& graph,
+                                               const std::string& entry, const std::string& exit,
+                                               const std::map<std::string, std::vector<std::string>>& calls) {
+    Graph& out = graphs.emplace_back();
+    out.name = intern(name);
+    out.entry = entry.empty() ? NONE : intern(entry);
+    out.exit = exit.empty() ? NONE : intern(exit);
+
+    // Vertices in the order they were added to the graph, so that a loaded graph iterates in the same order
+    const LibcCallgraph::Storage& s = graph.view();
+    std::vector<const decltype(s.vertices)::value_type*> vertices;
+    vertices.reserve(s.vertices.size());
+    for (const auto& vertex : s.vertices) {
+        vertices.push_back(&vertex);
+    }
+    std::sort(vertices.begin(), vertices.end(), [](auto a, auto b) { return a->second.id < b->second.id; });
+
+    // Graph IDs to vertex indices in the snapshot
+    std::vector<uint32_t> index(vertices.empty() ? 0 : vertices.back()->second.id + 1, NONE);
+    for (uint32_t v = 0; v < vertices.size(); v++) {
+        index[vertices[v]->second.id] = v;
+    }
+
+    out.vertex_names.reserve(vertices.size());
+    out.func_call.reserve(vertices.size());
+    out.call_offsets.reserve(vertices.size() + 1);
+    for (uint32_t v = 0; v < vertices.size(); v++) {
+        std::string_view name = vertices[v]->first;
+        out.vertex_names.push_back(intern(name));
+        out.func_call.push_back(vertices[v]->second.has_func_call);
+        auto vertex_calls = calls.empty() ? calls.end() : calls.find(std::string(name));
+        if (vertex_calls != calls.end()) {
+            for (const auto& call : vertex_calls->second) {
+                out.calls.push_back(intern(call));
+            }
+        }
+        out.call_offsets.push_back(out.calls.size());
+    }
+
+    // Bucket the edges by source vertex, then order each bucket by target
+    const auto& edges = s.graph.get_edges();
+    std::vector<uint32_t> degree(vertices.size() + 1, 0);
+    std::size_t num_labels = 0;
+    for (const auto& edge : edges) {
+        degree[index[edge.first.first] + 1] += edge.second.size();
+        num_labels += edge.second.size();
+    }
+    out.edge_offsets.resize(vertices.size() + 1);
+    for (uint32_t v = 0; v < vertices.size(); v++) {
+        out.edge_offsets[v + 1] = out.edge_offsets[v] + degree[v + 1];
+    }
+    std::vector<std::pair<uint32_t, uint32_t>> sorted(num_labels);
+    std::vector<uint32_t> fill(out.edge_offsets.begin(), out.edge_offsets.end() - 1);
+    for (const auto& edge : edges) {
+        for (const auto& label : edge.second) {
+            sorted[fill[index[edge.first.first]]++] = {index[edge.first.second], intern(label)};
+        }
+    }
+    out.edge_targets.reserve(num_labels);
+    out.edge_labels.reserve(num_labels);
+    for (uint32_t v = 0; v < vertices.size(); v++) {
+        std::sort(sorted.begin() + out.edge_offsets[v], sorted.begin() + out.edge_offsets[v + 1]);
+        for (uint32_t e = out.edge_offsets[v]; e < out.edge_offsets[v + 1]; e++) {
+            out.edge_targets.push_back(sorted[e].first);
+            out.edge_labels.push_back(sorted[e].second);
+        }
+    }
+    return out;
+}
+
+const GraphSnapshot::Graph* GraphSnapshot::find_graph(std::string_view name) const {
+    for (const Graph& graph : graphs) {
+        if (str(graph.name) == name) {
+            return &graph;
+        }
+    }
+    return nullptr;
+}
+
+LibcCallgraph GraphSnapshot::to_graph(const Graph& graph) const {
+    LibcCallgraph out;
+    if (graph.num_vertices() == 0) {
+        return out;
+    }
+    LibcCallgraph::Storage& s = out.mutable_storage();
+    std::vector<graaf::vertex_id_t> ids(graph.num_vertices());
+    for (uint32_t v = 0; v < graph.num_vertices(); v++) {
+        std::string_view name = VertexNames::intern(str(graph.vertex_names[v]));
+        ids[v] = s.graph.add_vertex(name);
+        s.vertices.emplace(name, LibcCallgraph::VertexInfo{ids[v], graph.func_call[v]});
+    }
+    for (uint32_t v = 0; v < graph.num_vertices(); v++) {
+        for (uint32_t e = graph.edge_offsets[v]; e < graph.edge_offsets[v + 1]; e++) {
+            LibcCallgraph::add_label(s, ids[v], ids[graph.edge_targets[e]], str(graph.edge_labels[e]));
+        }
+    }
+    return out;
+}
+
+std::map<std::string, std::vector<std::string>> GraphSnapshot::to_calls(const Graph& graph) const {
+    std::map<std::string, std::vector<std::string>> out;
+    for (uint32_t v = 0; v < graph.num_vertices(); v++) {
+        if (graph.call_offsets[v] == graph.call_offsets[v + 1]) {
+            continue;
+        }
+        auto& vertex_calls = out[str(graph.vertex_names[v])];
+        for (uint32_t c = graph.call_offsets[v]; c < graph.call_offsets[v + 1]; c++) {
+            vertex_calls.push_back(str(graph.calls[c]));
+        }
+    }
+    return out;
+}
+
+bool GraphSnapshot::write(const std::string& filename) const {
+    std::string out = SNAPSHOT_MAGIC;
+    put_varint(out, SNAPSHOT_VERSION);
+    put_varint(out, stage.size());
+    out.append(stage);
+
+    put_varint(out, strings.size());
+    for (const std::string& str : strings) {
+        put_varint(out, str.size());
+        out.append(str);
+    }
+
+    put_varint(out, graphs.size());
+    for (const Graph& graph : graphs) {
+        put_varint(out, graph.name);
+        put_varint(out, graph.entry == NONE ? 0 : graph.entry + 1ULL);
+        put_varint(out, graph.exit == NONE ? 0 : graph.exit + 1ULL);
+        put_varint(out, graph.num_vertices());
+        for (uint32_t v = 0; v < graph.num_vertices(); v++) {
+            put_varint(out, (static_cast<uint64_t>(graph.vertex_names[v]) << 1) | graph.func_call[v]);
+            put_varint(out, graph.call_offsets[v + 1] - graph.call_offsets[v]);
+            for (uint32_t c = graph.call_offsets[v]; c < graph.call_offsets[v + 1]; c++) {
+                put_varint(out, graph.calls[c]);
+            }
+        }
+        for (uint32_t v = 0; v < graph.num_vertices(); v++) {
+            put_varint(out, graph.edge_offsets[v + 1] - graph.edge_offsets[v]);
+            for (uint32_t e = graph.edge_offsets[v]; e < graph.edge_offsets[v + 1]; e++) {
+                put_varint(out, graph.edge_targets[e]);
+                put_varint(out, graph.edge_labels[e]);
+            }
+        }
+    }
+
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    bool written = fwrite(out.data(), 1, out.size(), file) == out.size();
+    return (fclose(file) == 0) && written;
+}
+
+bool GraphSnapshot::read(const std::string& filename) {
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    std::vector<uint8_t> data;
+    uint8_t chunk[1 << 16];
+    for (std::size_t len; (len = fread(chunk, 1, sizeof(chunk), file)) > 0;) {
+        data.insert(data.end(), chunk, chunk + len);
+    }
+    fclose(file);
+
+    *this = GraphSnapshot();
+    if (data.size() < 4 || memcmp(data.data(), SNAPSHOT_MAGIC, 4) != 0) {
+        return false;
+    }
+    SnapshotReader in{data.data() + 4, data.data() + data.size()};
+    if (in.varint() != SNAPSHOT_VERSION) {
+        return false;
+    }
+    uint32_t stage_len = in.count();
+    stage.assign(reinterpret_cast<const char*>(in.pos), in.ok ? stage_len : 0);
+    in.pos += in.ok ? stage_len : 0;
+
+    uint32_t num_strings = in.count();
+    strings.reserve(num_strings);
+    for (uint32_t i = 0; in.ok && i < num_strings; i++) {
+        uint32_t len = in.count();
+        if (!in.ok) {
+            break;
+        }
+        strings.emplace_back(reinterpret_cast<const char*>(in.pos), len);
+        in.pos += len;
+        string_ids.emplace(strings.back(), i);
+    }
+
+    uint32_t num_graphs = in.count(4);
+    for (uint32_t i = 0; in.ok && i < num_graphs; i++) {
+        Graph& graph = graphs.emplace_back();
+        graph.name = in.index(strings.size());
+        graph.entry = in.index(strings.size(), true);
+        graph.exit = in.index(strings.size(), true);
+        uint32_t num_vertices = in.count(3);
+        graph.vertex_names.reserve(num_vertices);
+        graph.func_call.reserve(num_vertices);
+        for (uint32_t v = 0; in.ok && v < num_vertices; v++) {
+            uint32_t name = in.varint();
+            if ((name >> 1) >= strings.size()) {
+                in.ok = false;
+                break;
+            }
+            graph.vertex_names.push_back(name >> 1);
+            graph.func_call.push_back(name & 1);
+            uint32_t num_calls = in.count();
+            for (uint32_t c = 0; in.ok && c < num_calls; c++) {
+                graph.calls.push_back(in.index(strings.size()));
+            }
+            graph.call_offsets.push_back(graph.calls.size());
+        }
+        for (uint32_t v = 0; in.ok && v < num_vertices; v++) {
+            uint32_t degree = in.count(2);
+            for (uint32_t e = 0; in.ok && e < degree; e++) {
+                graph.edge_targets.push_back(in.index(num_vertices));
+                graph.edge_labels.push_back(in.index(strings.size()));
+            }
+            graph.edge_offsets.push_back(graph.edge_targets.size());
+        }
+    }
+    if (!in.ok || in.pos != in.end) {
+        *this = GraphSnapshot();
+        return false;
+    }
+    return true;
+}
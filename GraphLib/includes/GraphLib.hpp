@@ -3,32 +3,97 @@
 
 #include <fmt/core.h>
 #include <graaflib/graph.h>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
+/**
+ * Names of the vertices of all the graphs, each one stored once. The graphs key their vertices by the address of
+ * the interned name, so a name handed out by a graph (or interned by the caller) is looked up without being hashed.
+ * The names are kept until clear(), only to be called once no graph holds any of them. Not thread safe.
+ */
+struct VertexNames {
+    static std::string_view intern(std::string_view name);
+    static std::string_view find(std::string_view name);   // The interned name, or a null view if not interned
+    static std::size_t size();
+    static void clear();
+};
+
+/**
+ * Graph of named vertices with labelled edges. Copies are snapshots: they share the storage of the graph they were
+ * taken from, which is only duplicated by the first change made through either of them. Not safe to copy and change
+ * concurrently from different threads.
+ *
+ * An edge keeps every label it was added with, the edge lists (get_outgoing_edges, get_neighbors) hold one entry per
+ * label. A control edge from a vertex to itself is never kept. The vertex names it returns are the interned ones, see
+ * VertexNames.
+ */
 struct LibcCallgraph {
-    graaf::directed_graph<std::string, std::string> graph;
-    std::unordered_map<std::string, graaf::vertex_id_t> vertex_id_map;
-    std::unordered_map<std::string, bool > func_call_map;
+    graaf::vertex_id_t add_vertex(std::string_view vertex, bool has_func_call=false);
+    void add_edge(std::string_view vertex_lhs, std::string_view vertex_rhs, const std::string& edge);
+    void remove_edge(std::string_view vertex_lhs, std::string_view vertex_rhs);
+    void remove_vertex(std::string_view vertex);
+    void combine_vertex(std::string_view vertex_lhs, std::string_view vertex_rhs);
 
-    graaf::vertex_id_t add_vertex(const std::string& vertex, bool has_func_call=false);
-    void add_edge(const std::string& vertex_lhs, const std::string& vertex_rhs, const std::string& edge);
-    void remove_edge(const std::string& vertex_lhs, const std::string& vertex_rhs);
-    void remove_vertex(const std::string& vertex);
-    void combine_vertex(const std::string& vertex_lhs, const std::string& vertex_rhs);
+    std::vector<std::string> get_outgoing_edges(std::string_view vertex);
+    std::vector<std::string_view> get_neighbors(std::string_view vertex);
 
-    std::vector<std::string> get_outgoing_edges(const std::string& vertex);
-    std::vector<std::string> get_neighbors(const std::string& vertex);
+    std::vector<std::string_view> get_control_edge_neighbors(std::string_view vertex) const;
+    std::vector<std::string_view> get_user_edge_neighbors(std::string_view vertex) const;
 
-    std::vector<std::string> get_control_edge_neighbors(const std::string& vertex) const;
-    std::vector<std::string> get_user_edge_neighbors(const std::string& vertex) const;
+    std::vector<std::string_view> get_vertices() const;
 
-    std::vector<std::string> get_vertices() const;
+    std::size_t num_vertices() const;
+    std::size_t num_edges() const;
 
-    void insert_graph(const LibcCallgraph& other, const std::string& entry, const std::string& exit);
+    void insert_graph(const LibcCallgraph& other, std::string_view entry, std::string_view exit);
 
     void print();
 
-    void dump_todot(const std::string& filename, std::string entry="", std::string exit="");
+    void dump_todot(const std::string& filename, std::string_view entry="", std::string_view exit="") const;
+
+private:
+    friend struct GraphSnapshot;
+
+    using EdgeLabels = std::vector<std::string>;
+
+    struct VertexInfo {
+        graaf::vertex_id_t id;
+        bool has_func_call;
+    };
+
+    /* Interned names are equal if they are the same, hashed and compared by address (and length, for a prefix) */
+    struct InternedHash {
+        std::size_t operator()(std::string_view name) const { return std::hash<const char*>{}(name.data()); }
+    };
+    struct InternedEqual {
+        bool operator()(std::string_view a, std::string_view b) const {
+            return a.data() == b.data() && a.size() == b.size();
+        }
+    };
+
+    /**
+     * Vertex names are looked up far more often than anything else, the index is keyed by interned name and bump
+     * allocated from an arena owned by the storage, released with it in one go
+     */
+    struct Storage {
+        std::pmr::monotonic_buffer_resource arena;
+        graaf::directed_graph<std::string_view, EdgeLabels> graph;
+        std::pmr::unordered_map<std::string_view, VertexInfo, InternedHash, InternedEqual> vertices{&arena};
+
+        Storage() = default;
+        Storage(const Storage& other) : graph(other.graph), vertices(other.vertices, &arena) {}
+    };
+
+    const Storage& view() const;
+    Storage& mutable_storage();
+    const VertexInfo* find(std::string_view vertex) const;
+    static void add_label(Storage& s, graaf::vertex_id_t lhs_id, graaf::vertex_id_t rhs_id, std::string label);
+
+    std::shared_ptr<Storage> storage;   // Allocated by the first change, empty graphs share none
 };
 
 
@@ -0,0 +1,70 @@
+#ifndef __GRAPHSNAPSHOT_HPP__INCLUDED__
+#define __GRAPHSNAPSHOT_HPP__INCLUDED__
+
+#include "GraphLib.hpp"
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Graphs of one stage of the pass, as a compressed sparse row of each graph over a table of interned strings.
+ *
+ * File layout, every number is an unsigned LEB128 varint and every name an index in the string table:
+ *   "LCGS" version stage
+ *   string count { length bytes }...
+ *   graph count {
+ *       name entry+1 exit+1 (0 for none) vertex count
+ *       { name<<1 | has_func_call, call count { call }... }...   per vertex
+ *       { out degree { target vertex, label }... }...           per vertex, targets ascending
+ *   }...
+ */
+struct GraphSnapshot {
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    struct Graph {
+        uint32_t name = NONE;
+        uint32_t entry = NONE;
+        uint32_t exit = NONE;
+        std::vector<uint32_t> vertex_names;
+        std::vector<bool> func_call;
+        std::vector<uint32_t> call_offsets = {0};   // Calls of vertex v are calls[call_offsets[v], call_offsets[v + 1])
+        std::vector<uint32_t> calls;
+        std::vector<uint32_t> edge_offsets = {0};   // Edges of vertex v are edge_*[edge_offsets[v], edge_offsets[v + 1])
+        std::vector<uint32_t> edge_targets;
+        std::vector<uint32_t> edge_labels;
+
+        std::size_t num_vertices() const { return vertex_names.size(); }
+        std::size_t num_edges() const { return edge_targets.size(); }
+    };
+
+    std::string stage;
+    std::vector<std::string> strings;
+    std::vector<Graph> graphs;
+
+    uint32_t intern(std::string_view str);
+    const std::string& str(uint32_t id) const;
+
+    Graph& add_graph(const std::string& name, const LibcCallgraph& graph, const std::string& entry="",
+                     const std::string& exit="", const std::map<std::string, std::vector<std::string>>& calls={});
+    const Graph* find_graph(std::string_view name) const;
+
+    LibcCallgraph to_graph(const Graph& graph) const;
+    std::map<std::string, std::vector<std::string>> to_calls(const Graph& graph) const;
+
+    bool write(const std::string& filename) const;
+    bool read(const std::string& filename);
+
+private:
+    struct StringHash {
+        using is_transparent = void;
+        std::size_t operator()(std::string_view str) const { return std::hash<std::string_view>{}(str); }
+    };
+
+    std::unordered_map<std::string, uint32_t, StringHash, std::equal_to<>> string_ids;
+};
+
+#endif // __GRAPHSNAPSHOT_HPP__INCLUDED__
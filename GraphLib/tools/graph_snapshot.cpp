@@ -0,0 +1,278 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "GraphSnapshot.hpp"
+
+/* ------------------------------------------------------------------------- */
+/* -------------------------------- STATS ---------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+struct GraphStats {
+    std::size_t vertices = 0;
+    std::size_t edges = 0;
+    std::size_t control = 0;        // Edges labelled "control"
+    std::size_t libc = 0;           // Edges labelled "libc:<name>"
+    std::size_t user = 0;           // Edges labelled "user:<function>"
+    std::size_t funcCalls = 0;      // Vertices with a function call
+    std::size_t maxDegree = 0;
+
+    void add(const GraphStats &other) {
+        vertices += other.vertices;
+        edges += other.edges;
+        control += other.control;
+        libc += other.libc;
+        user += other.user;
+        funcCalls += other.funcCalls;
+        maxDegree = std::max(maxDegree, other.maxDegree);
+    }
+};
+
+static GraphStats graphStats(const GraphSnapshot &snapshot, const GraphSnapshot::Graph &graph) {
+    // Kind of each label, by string index, so that each string is looked at once
+    std::vector<char> kind(snapshot.strings.size(), 0);
+    for (uint32_t label : graph.edge_labels) {
+        if (kind[label] == 0) {
+            const std::string &str = snapshot.str(label);
+            kind[label] = (str == "control") ? 'c' : (str.rfind("libc:", 0) == 0) ? 'l' : (str.rfind("user:", 0) == 0) ? 'u' : '?';
+        }
+    }
+
+    GraphStats stats;
+    stats.vertices = graph.num_vertices();
+    stats.edges = graph.num_edges();
+    for (uint32_t label : graph.edge_labels) {
+        stats.control += kind[label] == 'c';
+        stats.libc += kind[label] == 'l';
+        stats.user += kind[label] == 'u';
+    }
+    for (uint32_t v = 0; v < graph.num_vertices(); v++) {
+        stats.funcCalls += graph.func_call[v];
+        stats.maxDegree = std::max<std::size_t>(stats.maxDegree, graph.edge_offsets[v + 1] - graph.edge_offsets[v]);
+    }
+    return stats;
+}
+
+static void printStatsRow(const std::string &name, const GraphStats &stats) {
+    printf("%-40s %10zu %10zu %10zu %10zu %10zu %10zu %8zu\n", name.c_str(), stats.vertices, stats.edges, stats.control,
+           stats.libc, stats.user, stats.funcCalls, stats.maxDegree);
+}
+
+static int printStats(const GraphSnapshot &snapshot) {
+    printf("Stage: %s, %zu graphs, %zu strings\n", snapshot.stage.c_str(), snapshot.graphs.size(),
+           snapshot.strings.size());
+    printf("%-40s %10s %10s %10s %10s %10s %10s %8s\n", "Graph", "Vertices", "Edges", "Control", "Libc", "User",
+           "FuncCalls", "MaxOut");
+    GraphStats total;
+    for (const auto &graph : snapshot.graphs) {
+        GraphStats stats = graphStats(snapshot, graph);
+        printStatsRow(snapshot.str(graph.name), stats);
+        total.add(stats);
+    }
+    printStatsRow("Total", total);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* -------------------------------- DIFF ----------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+/**
+ * Edge by the string indices of its source, target and label, in the string table of the old snapshot
+ */
+struct EdgeKey {
+    uint32_t source, target, label;
+    bool operator==(const EdgeKey &other) const {
+        return source == other.source && target == other.target && label == other.label;
+    }
+};
+
+struct EdgeKeyHash {
+    std::size_t operator()(const EdgeKey &key) const {
+        uint64_t hash = key.source * 0x9e3779b97f4a7c15ULL;
+        hash ^= (hash >> 29) + key.target * 0xbf58476d1ce4e5b9ULL;
+        hash ^= (hash >> 31) + key.label * 0x94d049bb133111ebULL;
+        return hash ^ (hash >> 32);
+    }
+};
+
+/**
+ * Strings of both snapshots in a single index space: the string indices of the old snapshot, followed by the
+ * strings only found in the new one
+ */
+class StringMapping {
+public:
+    StringMapping(const GraphSnapshot &oldSnapshot, const GraphSnapshot &newSnapshot) : oldSnapshot(oldSnapshot) {
+        std::unordered_map<std::string_view, uint32_t> oldIds;
+        for (uint32_t i = 0; i < oldSnapshot.strings.size(); i++) {
+            oldIds.emplace(oldSnapshot.strings[i], i);
+        }
+        newIds.reserve(newSnapshot.strings.size());
+        for (const std::string &str : newSnapshot.strings) {
+            auto it = oldIds.find(str);
+            if (it != oldIds.end()) {
+                newIds.push_back(it->second);
+            } else {
+                newIds.push_back(oldSnapshot.strings.size() + newOnly.size());
+                newOnly.push_back(&str);
+            }
+        }
+    }
+
+    uint32_t fromNew(uint32_t id) const { return id == GraphSnapshot::NONE ? id : newIds[id]; }
+
+    const std::string &str(uint32_t id) const {
+        static const std::string none = "(none)";
+        if (id == GraphSnapshot::NONE) {
+            return none;
+        }
+        return (id < oldSnapshot.strings.size()) ? oldSnapshot.strings[id] : *newOnly[id - oldSnapshot.strings.size()];
+    }
+
+private:
+    const GraphSnapshot &oldSnapshot;
+    std::vector<uint32_t> newIds;
+    std::vector<const std::string *> newOnly;
+};
+
+static std::unordered_set<uint32_t> vertexSet(const GraphSnapshot::Graph *graph, const StringMapping *mapping) {
+    std::unordered_set<uint32_t> vertices;
+    if (graph) {
+        for (uint32_t name : graph->vertex_names) {
+            vertices.insert(mapping ? mapping->fromNew(name) : name);
+        }
+    }
+    return vertices;
+}
+
+static std::unordered_set<EdgeKey, EdgeKeyHash> edgeSet(const GraphSnapshot::Graph *graph, const StringMapping *mapping) {
+    std::unordered_set<EdgeKey, EdgeKeyHash> edges;
+    if (!graph) {
+        return edges;
+    }
+    auto map = [mapping](uint32_t id) { return mapping ? mapping->fromNew(id) : id; };
+    edges.reserve(graph->num_edges());
+    for (uint32_t v = 0; v < graph->num_vertices(); v++) {
+        for (uint32_t e = graph->edge_offsets[v]; e < graph->edge_offsets[v + 1]; e++) {
+            edges.insert({map(graph->vertex_names[v]), map(graph->vertex_names[graph->edge_targets[e]]),
+                          map(graph->edge_labels[e])});
+        }
+    }
+    return edges;
+}
+
+/**
+ * Print the differences of a graph found in either snapshot, returns the number of differences
+ */
+static std::size_t diffGraph(const std::string &name, const GraphSnapshot::Graph *oldGraph,
+                             const GraphSnapshot::Graph *newGraph, const StringMapping &mapping) {
+    std::size_t differences = 0;
+    if (!oldGraph || !newGraph) {
+        printf("%s %s\n", oldGraph ? "-" : "+", name.c_str());
+        differences++;
+    } else {
+        for (auto [label, oldId, newId] : {std::tuple{"entry", oldGraph->entry, newGraph->entry},
+                                           std::tuple{"exit", oldGraph->exit, newGraph->exit}}) {
+            if (oldId != mapping.fromNew(newId)) {
+                printf("~ %s: %s %s -> %s\n", name.c_str(), label, mapping.str(oldId).c_str(),
+                       mapping.str(mapping.fromNew(newId)).c_str());
+                differences++;
+            }
+        }
+    }
+
+    auto oldVertices = vertexSet(oldGraph, nullptr), newVertices = vertexSet(newGraph, &mapping);
+    for (uint32_t vertex : oldVertices) {
+        if (!newVertices.count(vertex)) {
+            printf("- %s: vertex %s\n", name.c_str(), mapping.str(vertex).c_str());
+            differences++;
+        }
+    }
+    for (uint32_t vertex : newVertices) {
+        if (!oldVertices.count(vertex)) {
+            printf("+ %s: vertex %s\n", name.c_str(), mapping.str(vertex).c_str());
+            differences++;
+        }
+    }
+
+    auto oldEdges = edgeSet(oldGraph, nullptr), newEdges = edgeSet(newGraph, &mapping);
+    for (const auto &edge : oldEdges) {
+        if (!newEdges.count(edge)) {
+            printf("- %s: edge %s -> %s (%s)\n", name.c_str(), mapping.str(edge.source).c_str(),
+                   mapping.str(edge.target).c_str(), mapping.str(edge.label).c_str());
+            differences++;
+        }
+    }
+    for (const auto &edge : newEdges) {
+        if (!oldEdges.count(edge)) {
+            printf("+ %s: edge %s -> %s (%s)\n", name.c_str(), mapping.str(edge.source).c_str(),
+                   mapping.str(edge.target).c_str(), mapping.str(edge.label).c_str());
+            differences++;
+        }
+    }
+    return differences;
+}
+
+static int printDiff(const GraphSnapshot &oldSnapshot, const GraphSnapshot &newSnapshot) {
+    StringMapping mapping(oldSnapshot, newSnapshot);
+    std::size_t differences = 0;
+    for (const auto &graph : oldSnapshot.graphs) {
+        const std::string &name = oldSnapshot.str(graph.name);
+        differences += diffGraph(name, &graph, newSnapshot.find_graph(name), mapping);
+    }
+    for (const auto &graph : newSnapshot.graphs) {
+        const std::string &name = newSnapshot.str(graph.name);
+        if (!oldSnapshot.find_graph(name)) {
+            differences += diffGraph(name, nullptr, &graph, mapping);
+        }
+    }
+    printf("%zu differences\n", differences);
+    return differences ? 1 : 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------------- DRIVER ---------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+static void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " stats <snapshot>\n"
+              << "       " << prog << " diff <old snapshot> <new snapshot>\n"
+              << "  Reads the stage snapshots written by the pass with -cg-snapshot. stats prints the size of each\n"
+              << "  graph, diff the vertices, edges, entry and exit nodes that differ, by name, and exits with 1 if\n"
+              << "  there are any.\n";
+}
+
+static bool readSnapshot(const char *filename, GraphSnapshot &snapshot) {
+    if (!snapshot.read(filename)) {
+        std::cerr << "Failed to read the snapshot " << filename << "\n";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @example ./graph_snapshot stats out-dir/dot/helloworld.c.lllibc.snap
+ * @example ./graph_snapshot diff before/helloworld.c.llfinal.snap after/helloworld.c.llfinal.snap
+ */
+int main(int argc, char **argv) {
+    if (argc == 3 && strcmp(argv[1], "stats") == 0) {
+        GraphSnapshot snapshot;
+        return readSnapshot(argv[2], snapshot) ? printStats(snapshot) : 2;
+    }
+    if (argc == 4 && strcmp(argv[1], "diff") == 0) {
+        GraphSnapshot oldSnapshot, newSnapshot;
+        if (!readSnapshot(argv[2], oldSnapshot) || !readSnapshot(argv[3], newSnapshot)) {
+            return 2;
+        }
+        return printDiff(oldSnapshot, newSnapshot);
+    }
+    usage(argv[0]);
+    return 2;
+}
@@ -1,50 +1,23 @@
-#include "llvm/IR/Module.h"
-#include "llvm/IR/PassManager.h"
-#include "llvm/Pass.h"
-
-#include "LibcCallGraphUtils.h"
-
-#include <map>
-#include <string>
-#include <vector>
-
-//------------------------------------------------------------------------------
-// New PM interface
-//------------------------------------------------------------------------------
-struct LibcSandboxing : public llvm::PassInfoMixin<LibcSandboxing> {
-private:
-    llvm::FileToMapReader fileToMapReader;
-
-    llvm::Function *DummySyscallF;
-    llvm::FunctionCallee DummySyscall;
-
-public:
-    llvm::PreservedAnalyses run(llvm::Module &M,
-                                llvm::ModuleAnalysisManager &);
-    bool runOnModule(llvm::Module &M, llvm::ModuleAnalysisManager &MAM, llvm::FunctionAnalysisManager &FAM);
-
-    static bool isRequired() { return true; }
-
-    void setupDummySyscall(llvm::Module &M);
-    void injectDummySyscall(llvm::Instruction &I, int syscallNum);
-
-    void GenerateInMemoryGraph(llvm::Module &M);
-
-    void nameBasicBlocks(llvm::Function &F);
-    void SectionAddressHandler(llvm::Module &M, unsigned char *data, unsigned long size);
-    void MemoryCleanupHandler(llvm::Module &M);
-};
+#include "LibcCallGraphGen.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/ModuleSlotTracker.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Parallel.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include "GraphSnapshot.hpp"
+#include "LibcCallGraphStats.h"
+#include "memgraph.h"
 
 using namespace llvm;
 
 #define DEBUG_TYPE "libc-sandboxing"
 
-#include "GraphLib.hpp"
-
 //------------------------------------------------------------------------------
 // Command line options
 //------------------------------------------------------------------------------
@@ -118,78 +91,110 @@ static cl::opt<bool> PrintLibcCallGraph(
     cl::desc("Print the libc call graph in DOT format"),
     cl::Hidden,
     cl::init(false));
-    
-//-----------------------------------------------------------------------------
-// Adding a new section to the binary - to store the sandbox init data
-//-----------------------------------------------------------------------------
 
-void LibcSandboxing::SectionAddressHandler(Module &M, unsigned char *data, unsigned long size) {
- LLVMContext &CTX = M.getContext();
-        IRBuilder<> Builder(CTX);
+/**
+ * @brief Command line option to print the final libc call graph of the module in DOT format
+ *
+ * @details This option allows the user to print the graph embedded in to the binary in DOT format (final.dot), it is
+ *          not written otherwise.
+ */
+static cl::opt<bool> PrintFinalGraph(
+    "cg-print-final",
+    cl::desc("Print the final libc call graph in DOT format"),
+    cl::init(false));
 
-        // Define the section name you want to add
-        const char *sectionName = "sandbox_init_data_section";
+/**
+ * @brief Command line option to write a binary snapshot of the graphs built by each stage
+ *
+ * @details This option allows the user to write the graphs of each stage to <name><stage>.snap, for the
+ *          graph_snapshot tool to compare, or for a stage to be run again on them.
+ */
+static cl::opt<bool> WriteSnapshots(
+    "cg-snapshot",
+    cl::desc("Write a binary snapshot of the graphs built by each stage"),
+    cl::init(false));
 
-        // Create a new global variable in the specified section
-        ArrayType *arrayType = ArrayType::get(Type::getInt8Ty(CTX), size);
-        GlobalVariable *newGlobal = new GlobalVariable(
-            M, arrayType, false, GlobalValue::ExternalLinkage,
-            Constant::getNullValue(arrayType), "SanboxInitData");
+/**
+ * @brief Graphs of the earlier stages are only kept for their DOT output, otherwise each stage consumes them
+ */
+static bool keepStageGraphs() { return PrintControlflowGraph; }
 
-        newGlobal->setSection(sectionName);
+/**
+ * @brief Command line option to print per stage statistics of the pass
+ *
+ * @details This option allows the user to print vertex/edge counts, merge iterations and bytes emitted by each
+ *          stage of the pass. Stage timings are reported through -time-passes and -ftime-trace.
+ */
+static cl::opt<bool> PrintStats(
+    "cg-stats",
+    cl::desc("Print per stage statistics of the libc call graph pass"),
+    cl::init(false));
 
-        // Optionally, initialize the global variable with some data
-        std::vector<Constant *> initValues;
-        for (int i = 0; i < size; ++i) {
-            initValues.push_back(ConstantInt::get(Type::getInt8Ty(CTX), data[i]));
-        }
-        Constant *initArray = ConstantArray::get(arrayType, initValues);
-        newGlobal->setInitializer(initArray);
-
-        for (auto &F : M) {
-            if (F.isDeclaration())
-                continue;
-            std::string funcName = F.getName().str();
-            if (funcName.find("main") == 0){
-                PointerType *PrintfArgTy = PointerType::getUnqual(Type::getInt8Ty(CTX));
-
-                IRBuilder<> Builder(&*F.getEntryBlock().getFirstInsertionPt());
-
-                llvm::Value *syscallNumber = Builder.getInt64(337);
-                auto bufferPtr = Builder.CreatePointerCast(newGlobal, PrintfArgTy, "bufferPtr");
-                Builder.CreateCall(
-                    DummySyscall, {syscallNumber, bufferPtr, Builder.getInt64(size)});
-            }
-        }
+/**
+ * @brief Command line option to select the policy mode embedded in to the binary
+ *
+ * @details The automaton checks the order of the libc calls, the allow-set only checks that the libc call is
+ *          reachable from the entry of the program, as a single bit test in the kernel with no per-process state.
+ *          The pushdown automaton keeps the user functions apart and tracks the calls between them on a bounded
+ *          call string in the kernel, so that a function returns to its own call site.
+ */
+enum LibcPolicyMode { PolicyAutomaton, PolicyAllowset, PolicyPushdown };
+static cl::opt<LibcPolicyMode> PolicyMode(
+    "cg-policy-mode",
+    cl::desc("Policy mode embedded in to the binary"),
+    cl::values(clEnumValN(PolicyAutomaton, "automaton", "Libc call automaton (default)"),
+               clEnumValN(PolicyAllowset, "allowset", "Set of the reachable libc calls"),
+               clEnumValN(PolicyPushdown, "pushdown", "Libc call automaton of each function, with calls and returns tracked")),
+    cl::init(PolicyAutomaton));
 
-}
+/**
+ * @brief Command line option to select how the kernel handles a libc call not allowed by the policy
+ *
+ * @details Enforce kills the process, audit reports the call on a tracepoint and resumes the process, learn also
+ *          records the call for the sandbox_ctl syscall to drain. The mode can be changed at runtime.
+ */
+enum LibcViolationMode {
+    ViolationEnforce = VIOLATION_MODE_ENFORCE,
+    ViolationAudit = VIOLATION_MODE_AUDIT,
+    ViolationLearn = VIOLATION_MODE_LEARN
+};
+static cl::opt<LibcViolationMode> ViolationMode(
+    "cg-violation-mode",
+    cl::desc("Handling of the libc calls not allowed by the policy"),
+    cl::values(clEnumValN(ViolationEnforce, "enforce", "Kill the process (default)"),
+               clEnumValN(ViolationAudit, "audit", "Report the call and continue"),
+               clEnumValN(ViolationLearn, "learn", "Report and record the call, and continue")),
+    cl::init(ViolationEnforce));
+    
+//-----------------------------------------------------------------------------
+// Adding an ELF note to the binary - to store the sandbox init data
+//-----------------------------------------------------------------------------
 
-void LibcSandboxing::MemoryCleanupHandler(Module &M) {
+void LibcSandboxing::SectionAddressHandler(Module &M, unsigned char *data, unsigned long size) {
+ LibcCGStageScope stageScope(STAGE_SECTION_ADDRESS_HANDLER);
+ LibcCGStats[STAGE_SECTION_ADDRESS_HANDLER].bytesEmitted += size;
  LLVMContext &CTX = M.getContext();
-        IRBuilder<> Builder(CTX);
-
-        for (auto &F : M) {
-            if (F.isDeclaration())
-                continue;
-            std::string funcName = F.getName().str();
-            if (funcName.find("main") == 0){
-
-                Instruction *lastInst = nullptr;
-                for (auto &BB : F) {
-                    for (auto &I : BB) {
-                        if (isa<ReturnInst>(I)) {
-                            break;
-                        }
-                        lastInst = &I;
-                    }
-                }
-                IRBuilder<> Builder(lastInst);
-
-                llvm::Value *syscallNumber = Builder.getInt64(338);
-                Builder.CreateCall( DummySyscall, {syscallNumber});
-            }
-        }
 
+        // The graph is the descriptor of the note: the kernel finds it through the PT_NOTE program header while
+        // mapping the binary and attaches it before the first instruction runs, without any relocation to apply.
+        // Constant, so that the note is loaded read-only: the kernel pins its pages and reads the graph in place
+        IntegerType *Int32Ty = Type::getInt32Ty(CTX);
+        Constant *noteName = ConstantDataArray::getString(CTX, SANDBOX_NOTE_NAME);
+        Constant *noteDesc = ConstantDataArray::get(CTX, ArrayRef<uint8_t>(data, size));
+        Constant *notePad = Constant::getNullValue(ArrayType::get(Type::getInt8Ty(CTX), alignTo(size, 8) - size));
+        StructType *noteType = StructType::get(CTX, {Int32Ty, Int32Ty, Int32Ty, noteName->getType(), noteDesc->getType(),
+                                                     notePad->getType()}, /*isPacked=*/true);
+        GlobalVariable *note = new GlobalVariable(
+            M, noteType, true, GlobalValue::InternalLinkage,
+            ConstantStruct::get(noteType, {ConstantInt::get(Int32Ty, sizeof(SANDBOX_NOTE_NAME)),
+                                           ConstantInt::get(Int32Ty, size),
+                                           ConstantInt::get(Int32Ty, SANDBOX_NOTE_TYPE),
+                                           noteName, noteDesc, notePad}),
+            "SandboxInitNote");
+
+        note->setSection(SANDBOX_NOTE_SECTION);
+        note->setAlignment(Align(8));
+        appendToCompilerUsed(M, {note});
 }
 
 
@@ -231,42 +236,136 @@ void LibcSandboxing::injectDummySyscall(Instruction &I, int syscallNum){
 // Utility functions for Basic block operations
 //------------------------------------------------------------------------------
 
+/**
+ * @brief Identities and vertex names of the basic blocks, kept beside the IR rather than set on it
+ *
+ * @details Each basic block is identified by its index in names, filled in once per function by nameBasicBlocks.
+ * The names are interned in VertexNames, the pool the graphs key their vertices by, so a name is stored once for
+ * the module and the graphs look it up by address. Dropped with the graphs by ResetGraphState, which clears the
+ * pool once no graph is left, before the module the basic blocks belong to goes away.
+ */
+struct BBNameTable {
+    DenseMap<const BasicBlock *, uint32_t> ids;
+    std::vector<StringRef> names;
+    std::unique_ptr<ModuleSlotTracker> slots;   // Numbers the unnamed values of one function at a time
+};
+static std::unique_ptr<BBNameTable> bbNameTable = std::make_unique<BBNameTable>();
+
+static StringRef getBBName(const BasicBlock &BB) {
+    auto it = bbNameTable->ids.find(&BB);
+    return (it == bbNameTable->ids.end()) ? StringRef() : bbNameTable->names[it->second];
+}
+
 void LibcSandboxing::nameBasicBlocks(llvm::Function &F){
-    std::string bbStr;
-    raw_string_ostream bbStream(bbStr);
-    std::string funcName = F.getName().str();
+    LibcCGStageScope stageScope(STAGE_NAME_BASIC_BLOCKS, F.getName());
+    LibcCGStats[STAGE_NAME_BASIC_BLOCKS].vertices += F.size();
+    BBNameTable &table = *bbNameTable;
+    SmallString<64> bbStr;
+    raw_svector_ostream bbStream(bbStr);
+
+    // Without a slot tracker, printAsOperand numbers the whole function again for every unnamed basic block
+    if (!table.slots || table.slots->getModule() != F.getParent()) {
+        table.slots = std::make_unique<ModuleSlotTracker>(F.getParent(), /*ShouldInitializeAllMetadata=*/false);
+    }
+    table.slots->incorporateFunction(F);
+    table.ids.reserve(table.ids.size() + F.size());
+    table.names.reserve(table.names.size() + F.size());
 
     for (BasicBlock &BB : F) {
-        BB.printAsOperand(bbStream, false);
-        BB.setName("["+funcName+"]"+bbStream.str()); // setting the name of the basic block to its label
         bbStr.clear();
-    }    
+        bbStream << '[' << F.getName() << ']';
+        BB.printAsOperand(bbStream, false, *table.slots); // the label of the basic block, the IR is left untouched
+        auto [it, inserted] = table.ids.try_emplace(&BB, table.names.size());
+        StringRef name = VertexNames::intern(bbStr.str());
+        if (inserted) {
+            table.names.push_back(name);
+        } else {
+            table.names[it->second] = name;
+        }
+    }
 }
 
 //-----------------------------------------------------------------------------
 // Data structures to store the basic block graphs
 //-----------------------------------------------------------------------------
 
-struct funcBBGraphMeta {
-    std::string funcName;
-
-    // Entry and exit node names
-    std::string entryNode;
-    std::string exitNode;
-
-    // Map to store the libc calls for each basic block
-    std::map <std::string, std::vector<std::string>> bbToLibcMap;
-
-    LibcCallgraph bbGraph;          // Just basic block control flow graph
-    LibcCallgraph bbExpandedGraph;  // Graph with libc calls expanded
-    LibcCallgraph libcCallGraph;    // Graph with libc calls and program abstract state 
-};
 std::map<std::string, funcBBGraphMeta> funcBBToMetaMap;
 
 std::string finalGraphEntryNode;
 std::string finalGraphExitNode;
 LibcCallgraph finalGraph;           // Final graph with libc calls and program abstract state
 
+/**
+ * @brief Drop the graphs of a previous run, so that the pass can be run on more than one module
+ */
+void ResetGraphState(){
+    funcBBToMetaMap.clear();
+    finalGraphEntryNode.clear();
+    finalGraphExitNode.clear();
+    finalGraph = LibcCallgraph();
+    bbNameTable = std::make_unique<BBNameTable>();
+    VertexNames::clear();
+}
+
+//------------------------------------------------------------------------------
+// Build the basic block graph of a function
+//------------------------------------------------------------------------------
+
+/**
+ * @brief Build the basic block control flow graph of a function along with its per basic block call listing
+ */
+void LibcSandboxing::BuildBBGraph(llvm::Function &F){
+    struct funcBBGraphMeta funcMeta;
+    std::string funcName = F.getName().str();
+
+    LibcCGStageScope buildScope(STAGE_BUILD_BB_GRAPH, funcName);
+    funcMeta.funcName = funcName;
+
+    ///// Generate the call graph - vertices/basicblocks, along with the libc call list for each BB
+    std::vector<StringRef> returnBlocks;
+    for (BasicBlock &BB : F) {
+        // DEBUG_PRINT_BB(BB);
+        StringRef bbName = getBBName(BB);
+        std::vector<std::string> libCalls = fileToMapReader.getLibraryCalls(BB);
+        auto *TI = BB.getTerminator();
+        if (BB.hasNPredecessors(0)) {
+            funcMeta.entryNode = bbName.str();
+            // DEBUG_PRINT("ENTRY\n");
+        }
+        if (isa<ReturnInst>(TI)) {
+            funcMeta.exitNode = bbName.str();
+            returnBlocks.push_back(bbName);
+            // DEBUG_PRINT("EXIT\n");
+        }
+
+        funcMeta.bbGraph.add_vertex(bbName, !libCalls.empty());
+        if (!libCalls.empty()) {
+            funcMeta.bbToLibcMap[bbName.str()] = std::move(libCalls);
+        }
+    }
+
+    ///// Generate the call graph - populate edges
+    static const std::string controlEdge = "control";
+    for (BasicBlock &BB : F) {
+        for (BasicBlock *Succ : successors(&BB)) {
+            funcMeta.bbGraph.add_edge(getBBName(BB), getBBName(*Succ), controlEdge);
+        }
+    }
+
+    // Several return blocks (as left by simplifycfg) lead to a single exit node, the one the returns go from
+    if (returnBlocks.size() > 1) {
+        funcMeta.exitNode = '[' + funcName + "]<return>";
+        funcMeta.bbGraph.add_vertex(funcMeta.exitNode);
+        for (StringRef returnBlock : returnBlocks) {
+            funcMeta.bbGraph.add_edge(returnBlock, funcMeta.exitNode, controlEdge);
+        }
+    }
+
+    LibcCGStats[STAGE_BUILD_BB_GRAPH].vertices += funcMeta.bbGraph.num_vertices();
+    LibcCGStats[STAGE_BUILD_BB_GRAPH].edges += funcMeta.bbGraph.num_edges();
+    funcBBToMetaMap[funcName] = std::move(funcMeta);
+}
+
 //------------------------------------------------------------------------------
 // Expand the basic block graph to include function calls
 //------------------------------------------------------------------------------
@@ -275,21 +374,22 @@ LibcCallgraph finalGraph;           // Final graph with libc calls and program a
  * @brief Expand the basic block graph to include function calls
  */
 void ExpandBBGraph(){
+    LibcCGStageScope stageScope(STAGE_EXPAND_BB_GRAPH);
+    LibcCGStageStats &stats = LibcCGStats[STAGE_EXPAND_BB_GRAPH];
     for (auto &entry : funcBBToMetaMap) {
         auto &funcMeta = entry.second;
         const auto &funcName = entry.first;
-        const auto &bbGraph = funcMeta.bbGraph;
         auto &bbExpandedGraph = funcMeta.bbExpandedGraph;
         // DEBUG_PRINT(BOLD_RED << "===================================================== " RESET << "\n");
         // DEBUG_PRINT(BOLD_GREEN << "Function: " << BOLD_WHITE << funcName << RESET << "\n");
         // DEBUG_PRINT(BOLD_RED << "===================================================== " RESET << "\n");
-        bbExpandedGraph = bbGraph;
+        bbExpandedGraph = keepStageGraphs() ? funcMeta.bbGraph : std::move(funcMeta.bbGraph);
 
         // Expand the edges
         int counter=1;
         bool hadLibcCalls = false;
         std::string tempBBName, prevVertex, finalVertex, firstVertex;
-        std::vector<std::string> neighbors;
+        std::vector<std::string_view> neighbors;
         for (const auto &bbEntry : funcMeta.bbToLibcMap) {
             const auto &bbName = bbEntry.first;
             
@@ -307,7 +407,8 @@ void ExpandBBGraph(){
             const auto &libCalls = bbEntry.second;
             std::string vertexName;
             for (const auto &libCall : libCalls) {
-                vertexName = bbName + ((libCall.find("user:") == 0) ? "-user_" : "-libc_") + std::to_string(counter++);
+                vertexName.assign(bbName).append((libCall.find("user:") == 0) ? "-user_" : "-libc_");
+                vertexName.append(std::to_string(counter++));
                 bbExpandedGraph.add_vertex(vertexName);
 
                 bbExpandedGraph.add_edge(prevVertex, vertexName, libCall);
@@ -336,10 +437,9 @@ void ExpandBBGraph(){
             // }
         }
 
-        // std::string outputFilename = OuputFilepathPrefix +'/'+ OuputFilenamePrefix + funcName + "-expanded.dot";
-        // funcMeta.bbExpandedGraph.dump_todot(outputFilename);
+        stats.vertices += bbExpandedGraph.num_vertices();
+        stats.edges += bbExpandedGraph.num_edges();
 
-        // DEBUG_PRINT(BOLD_GREEN << "Output filename: " << BOLD_WHITE << outputFilename << RESET << "\n");
         // DEBUG_PRINT(BOLD_GREEN << "\tEntry Node: " << BOLD_WHITE << funcMeta.entryNode << RESET << "\n");
         // DEBUG_PRINT(BOLD_GREEN << "\tExit Node: " << BOLD_WHITE << funcMeta.exitNode << RESET << "\n");        
     }
@@ -353,6 +453,8 @@ void ExpandBBGraph(){
  * @brief Convert the basic block graph to a libc call graph
  */
 void ConvertBBGraphToLibcCallGraph(){
+    LibcCGStageScope stageScope(STAGE_CONVERT_TO_LIBC_GRAPH);
+    LibcCGStageStats &stats = LibcCGStats[STAGE_CONVERT_TO_LIBC_GRAPH];
     for (auto &entry : funcBBToMetaMap) {
         auto &funcMeta = entry.second;
         const auto &funcName = entry.first;
@@ -362,17 +464,17 @@ void ConvertBBGraphToLibcCallGraph(){
         // DEBUG_PRINT(BOLD_GREEN << "Function: " << BOLD_WHITE << funcName << RESET << "\n");
         // DEBUG_PRINT(BOLD_RED << "===================================================== " RESET << "\n");
 
-        libcCallGraph = bbExpandedGraph;
+        libcCallGraph = keepStageGraphs() ? bbExpandedGraph : std::move(bbExpandedGraph);
 
         bool noMergeFound = false;
-        int count = 0;
 
         while (!noMergeFound) {
             // DEBUG_PRINT(BOLD_YELLOW << "__________________________________________________\n");
-            // DEBUG_PRINT(BOLD_YELLOW << "Iteration: " << BOLD_WHITE << count++ << RESET << "\n");
+            // DEBUG_PRINT(BOLD_YELLOW << "Iteration: " << BOLD_WHITE << stats.mergeIterations << RESET << "\n");
+            stats.mergeIterations++;
             noMergeFound = true;
             for (const auto &vertex : libcCallGraph.get_vertices()) {
-                const std::vector<std::string> neighbors = libcCallGraph.get_control_edge_neighbors(vertex);
+                const std::vector<std::string_view> neighbors = libcCallGraph.get_control_edge_neighbors(vertex);
                 // DEBUG_PRINT(BOLD_YELLOW << "Checking neighbors for : "<< BOLD_WHITE << vertex << " (" << neighbors.size() << ")" << RESET);
                 // for (const auto &neighbor : neighbors) {
                 //     DEBUG_PRINT(BOLD_YELLOW << " -> " << BOLD_WHITE << neighbor << RESET);
@@ -384,6 +486,10 @@ void ConvertBBGraphToLibcCallGraph(){
 
                         // DEBUG_PRINT(BOLD_YELLOW << "Merging: " << BOLD_WHITE << vertex << BOLD_YELLOW << " -> " << BOLD_WHITE << neighbor << RESET << "\n");
                         libcCallGraph.combine_vertex(vertex, neighbor);
+                        stats.merges++;
+                        if (funcMeta.entryNode == neighbor) {
+                            funcMeta.entryNode = vertex;
+                        }
                         if (funcMeta.exitNode == neighbor) {
                             funcMeta.exitNode = vertex;
                         }
@@ -393,24 +499,150 @@ void ConvertBBGraphToLibcCallGraph(){
             }
         }
 
-        // std::string outputFilename = OuputFilepathPrefix +'/'+ OuputFilenamePrefix + funcName + "-libc.dot";
-        // funcMeta.libcCallGraph.dump_todot(outputFilename);
+        stats.vertices += libcCallGraph.num_vertices();
+        stats.edges += libcCallGraph.num_edges();
 
-        // DEBUG_PRINT(BOLD_GREEN << "Output filename: " << BOLD_WHITE << outputFilename << RESET << "\n");
         // DEBUG_PRINT(BOLD_GREEN << "\tEntry Node: " << BOLD_WHITE << funcMeta.entryNode << RESET << "\n");
         // DEBUG_PRINT(BOLD_GREEN << "\tExit Node: " << BOLD_WHITE << funcMeta.exitNode << RESET << "\n");
     }
 }
 
 //------------------------------------------------------------------------------
-// Combine the libc call graphs of each functions to create the final graph
+// DOT output of the per function graphs
 //------------------------------------------------------------------------------
 
-void CombineLibcgGraph (){
-    finalGraph = funcBBToMetaMap["main"].libcCallGraph;
-    finalGraphEntryNode = funcBBToMetaMap["main"].entryNode;
-    finalGraphExitNode = funcBBToMetaMap["main"].exitNode;
+/**
+ * @brief Write the DOT files of the per function graphs requested with -cg-print-cfg and -cg-print-libc-cg
+ *
+ * @details The graphs are only read from here on, the files are written in parallel.
+ */
+void DumpStageGraphs(){
+    if (!PrintControlflowGraph && !PrintLibcCallGraph) {
+        return;
+    }
+    std::vector<std::pair<const LibcCallgraph *, std::string>> dotFiles;
+    for (const auto &entry : funcBBToMetaMap) {
+        const auto &funcMeta = entry.second;
+        std::string outputPrefix = OuputFilepathPrefix +'/'+ OuputFilenamePrefix + entry.first;
+        if (PrintControlflowGraph) {
+            dotFiles.emplace_back(&funcMeta.bbGraph, outputPrefix + ".dot");
+            dotFiles.emplace_back(&funcMeta.bbExpandedGraph, outputPrefix + "-expanded.dot");
+        }
+        if (PrintLibcCallGraph) {
+            dotFiles.emplace_back(&funcMeta.libcCallGraph, outputPrefix + "-libc.dot");
+        }
+        DEBUG_PRINT(BOLD_GREEN << "Output filename prefix: " << BOLD_WHITE << outputPrefix << RESET << "\n");
+    }
+    parallelForEach(dotFiles.begin(), dotFiles.end(), [](const auto &dotFile) {
+        dotFile.first->dump_todot(dotFile.second);
+    });
+}
+
+//------------------------------------------------------------------------------
+// Binary snapshots of the stage graphs
+//------------------------------------------------------------------------------
+
+static const char *LibcCGSnapshotNames[SNAPSHOT_COUNT] = {"bb", "expanded", "libc", "final"};
+
+// Name of the combined graph in the final snapshot, not a valid function name
+static const char *FinalSnapshotGraph = "[final]";
+
+/**
+ * @brief Write the graphs built by a stage, one per function along with its entry and exit nodes
+ *
+ * @details The final snapshot only keeps the entry and exit nodes of the functions, which the pushdown graph is
+ *          generated from, along with the combined graph.
+ */
+bool WriteStageSnapshot(LibcCGSnapshot snapshot, const std::string &filename){
+    GraphSnapshot out;
+    out.stage = LibcCGSnapshotNames[snapshot];
+    for (const auto &entry : funcBBToMetaMap) {
+        const auto &funcMeta = entry.second;
+        switch (snapshot) {
+        case SNAPSHOT_BB_GRAPH:
+            out.add_graph(entry.first, funcMeta.bbGraph, funcMeta.entryNode, funcMeta.exitNode, funcMeta.bbToLibcMap);
+            break;
+        case SNAPSHOT_EXPANDED_GRAPH:
+            out.add_graph(entry.first, funcMeta.bbExpandedGraph, funcMeta.entryNode, funcMeta.exitNode);
+            break;
+        case SNAPSHOT_LIBC_GRAPH:
+            out.add_graph(entry.first, funcMeta.libcCallGraph, funcMeta.entryNode, funcMeta.exitNode);
+            break;
+        default:
+            out.add_graph(entry.first, LibcCallgraph(), funcMeta.entryNode, funcMeta.exitNode);
+            break;
+        }
+    }
+    if (snapshot == SNAPSHOT_FINAL_GRAPH) {
+        out.add_graph(FinalSnapshotGraph, finalGraph, finalGraphEntryNode, finalGraphExitNode);
+    }
+    return out.write(filename);
+}
+
+/**
+ * @brief Replace the graphs of the pass with the ones of a snapshot, for the stage following it to be run again
+ */
+bool LoadStageSnapshot(const std::string &filename, LibcCGSnapshot &snapshot){
+    GraphSnapshot in;
+    if (!in.read(filename)) {
+        return false;
+    }
+    auto name = std::find(std::begin(LibcCGSnapshotNames), std::end(LibcCGSnapshotNames), in.stage);
+    if (name == std::end(LibcCGSnapshotNames)) {
+        return false;
+    }
+    snapshot = static_cast<LibcCGSnapshot>(name - std::begin(LibcCGSnapshotNames));
+
+    ResetGraphState();
+    for (const auto &graph : in.graphs) {
+        const std::string &graphName = in.str(graph.name);
+        if (snapshot == SNAPSHOT_FINAL_GRAPH && graphName == FinalSnapshotGraph) {
+            finalGraph = in.to_graph(graph);
+            finalGraphEntryNode = in.str(graph.entry);
+            finalGraphExitNode = in.str(graph.exit);
+            continue;
+        }
+        auto &funcMeta = funcBBToMetaMap[graphName];
+        funcMeta.funcName = graphName;
+        funcMeta.entryNode = in.str(graph.entry);
+        funcMeta.exitNode = in.str(graph.exit);
+        switch (snapshot) {
+        case SNAPSHOT_BB_GRAPH:
+            funcMeta.bbGraph = in.to_graph(graph);
+            funcMeta.bbToLibcMap = in.to_calls(graph);
+            break;
+        case SNAPSHOT_EXPANDED_GRAPH:
+            funcMeta.bbExpandedGraph = in.to_graph(graph);
+            break;
+        case SNAPSHOT_LIBC_GRAPH:
+            funcMeta.libcCallGraph = in.to_graph(graph);
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+static void SnapshotStage(LibcCGSnapshot snapshot){
+    if (!WriteSnapshots) {
+        return;
+    }
+    std::string outputFilename = OuputFilepathPrefix +'/'+ OuputFilenamePrefix + LibcCGSnapshotNames[snapshot] + ".snap";
+    if (!WriteStageSnapshot(snapshot, outputFilename)) {
+        errs() << "Failed to write the snapshot " << outputFilename << "\n";
+    }
+    DEBUG_PRINT(BOLD_GREEN << "Snapshot: " << BOLD_WHITE << outputFilename << RESET << "\n");
+}
+
+//------------------------------------------------------------------------------
+// Combine the libc call graphs of each functions to create the final graph
+//------------------------------------------------------------------------------
 
+/**
+ * @brief Inline the graphs of the called user functions in to the graph of main, merging across the call edges
+ */
+static void InlineUserFunctions(LibcCGStageStats &stats){
     // DEBUG_PRINT(BOLD_YELLOW << "Main function: " << BOLD_WHITE << "main" << RESET << "\n");
     for(auto &entry : finalGraph.get_vertices()){
         // DEBUG_PRINT(BOLD_YELLOW << "Vertex: " << BOLD_WHITE << entry << RESET << "\n");
@@ -434,14 +666,14 @@ void CombineLibcgGraph (){
     }
 
     bool noMergeFound = false;
-    int count = 0;
 
     while (!noMergeFound) {
         // DEBUG_PRINT(BOLD_YELLOW << "__________________________________________________\n");
-        // DEBUG_PRINT(BOLD_YELLOW << "Iteration: " << BOLD_WHITE << count++ << RESET << "\n");
+        // DEBUG_PRINT(BOLD_YELLOW << "Iteration: " << BOLD_WHITE << stats.mergeIterations << RESET << "\n");
+        stats.mergeIterations++;
         noMergeFound = true;
         for (const auto &vertex : finalGraph.get_vertices()) {
-            const std::vector<std::string> neighbors = finalGraph.get_control_edge_neighbors(vertex);
+            const std::vector<std::string_view> neighbors = finalGraph.get_control_edge_neighbors(vertex);
             // DEBUG_PRINT(BOLD_YELLOW << "Checking neighbors for : "<< BOLD_WHITE << vertex << " (" << neighbors.size() << ")" << RESET);
             // for (const auto &neighbor : neighbors) {
             //     DEBUG_PRINT(BOLD_YELLOW << " -> " << BOLD_WHITE << neighbor << RESET);
@@ -453,6 +685,10 @@ void CombineLibcgGraph (){
 
                     // DEBUG_PRINT(BOLD_YELLOW << "Merging: " << BOLD_WHITE << vertex << BOLD_YELLOW << " -> " << BOLD_WHITE << neighbor << RESET << "\n");
                     finalGraph.combine_vertex(vertex, neighbor);
+                    stats.merges++;
+                    if (finalGraphEntryNode == neighbor) {
+                        finalGraphEntryNode = vertex;
+                    }
                     if (finalGraphExitNode == neighbor) {
                         finalGraphExitNode = vertex;
                     }
@@ -460,7 +696,7 @@ void CombineLibcgGraph (){
                 noMergeFound = false;
             }
 
-            const std::vector<std::string> neighbors_user = finalGraph.get_user_edge_neighbors(vertex);
+            const std::vector<std::string_view> neighbors_user = finalGraph.get_user_edge_neighbors(vertex);
             // DEBUG_PRINT(BOLD_YELLOW << "Checking neighbors for : "<< BOLD_WHITE << vertex << " (" << neighbors.size() << ")" << RESET);
             // for (const auto &neighbor : neighbors) {
             //     DEBUG_PRINT(BOLD_YELLOW << " -> " << BOLD_WHITE << neighbor << RESET);
@@ -472,6 +708,10 @@ void CombineLibcgGraph (){
 
                     // DEBUG_PRINT(BOLD_YELLOW << "Merging: " << BOLD_WHITE << vertex << BOLD_YELLOW << " -> " << BOLD_WHITE << neighbor << RESET << "\n");
                     finalGraph.combine_vertex(vertex, neighbor);
+                    stats.merges++;
+                    if (finalGraphEntryNode == neighbor) {
+                        finalGraphEntryNode = vertex;
+                    }
                     if (finalGraphExitNode == neighbor) {
                         finalGraphExitNode = vertex;
                     }
@@ -481,51 +721,185 @@ void CombineLibcgGraph (){
 
         }
     }
+}
+
+/**
+ * @brief Add the graphs of the user functions reachable from main, once each, keeping the call edges
+ *
+ * @details The calls are resolved at run time on the call string of the kernel (pushdown mode), so that the
+ *          graph grows with the number of functions rather than with the number of call sites.
+ */
+static void ShareUserFunctions(){
+    std::vector<std::string> worklist;
+    std::unordered_set<std::string> inserted = {"main"};
+    auto queueCallees = [&](LibcCallgraph &graph) {
+        for (const auto &vertex : graph.get_vertices()) {
+            for (const auto &edge : graph.get_outgoing_edges(vertex)) {
+                if (edge.find("user:") != 0) {
+                    continue;
+                }
+                std::string callee = edge.substr(5);
+                if (funcBBToMetaMap.count(callee) != 0 && inserted.insert(callee).second) {
+                    worklist.push_back(callee);
+                }
+            }
+        }
+    };
+
+    // The graph of main was moved in to the final graph
+    queueCallees(finalGraph);
+    while (!worklist.empty()) {
+        auto &calleeMeta = funcBBToMetaMap[worklist.back()];
+        worklist.pop_back();
+        finalGraph.insert_graph(calleeMeta.libcCallGraph, calleeMeta.entryNode, calleeMeta.exitNode);
+        queueCallees(calleeMeta.libcCallGraph);
+    }
+}
 
+bool CombineLibcgGraph (){
+    LibcCGStageScope stageScope(STAGE_COMBINE_LIBC_GRAPH);
+    LibcCGStageStats &stats = LibcCGStats[STAGE_COMBINE_LIBC_GRAPH];
+    auto mainIt = funcBBToMetaMap.find("main");
+    if (mainIt == funcBBToMetaMap.end()) {
+        errs() << "No main function, the libc call graph is not generated\n";
+        return false;
+    }
+    // Main's graph is left empty, only its entry and exit nodes are used past this point
+    finalGraph = std::move(mainIt->second.libcCallGraph);
+    finalGraphEntryNode = mainIt->second.entryNode;
+    finalGraphExitNode = mainIt->second.exitNode;
+
+    if (PolicyMode == PolicyPushdown) {
+        ShareUserFunctions();
+    } else {
+        InlineUserFunctions(stats);
+    }
+
+    stats.vertices += finalGraph.num_vertices();
+    stats.edges += finalGraph.num_edges();
 
-    std::string outputFilename = OuputFilepathPrefix +'/'+ OuputFilenamePrefix + "final.dot";
-    finalGraph.dump_todot(outputFilename, finalGraphEntryNode, finalGraphExitNode);
-    DEBUG_PRINT(BOLD_GREEN << "Output filename: " << BOLD_WHITE << outputFilename << RESET << "\n");
+    if (PrintFinalGraph) {
+        std::string outputFilename = OuputFilepathPrefix +'/'+ OuputFilenamePrefix + "final.dot";
+        finalGraph.dump_todot(outputFilename, finalGraphEntryNode, finalGraphExitNode);
+        DEBUG_PRINT(BOLD_GREEN << "Output filename: " << BOLD_WHITE << outputFilename << RESET << "\n");
+    }
     DEBUG_PRINT(BOLD_GREEN << "\tEntry Node: " << BOLD_WHITE << finalGraphEntryNode << RESET << "\n");
     DEBUG_PRINT(BOLD_GREEN << "\tExit Node: " << BOLD_WHITE << finalGraphExitNode << RESET << "\n");
+    return true;
 }
 
 
 //------------------------------------------------------------------------------
 // Generate the in-memory graph to be embedded in to the program
 //------------------------------------------------------------------------------
-#include "memgraph.h"
-void LibcSandboxing::GenerateInMemoryGraph(llvm::Module &M){
-    int numOutEdges = 0;
-    const int MAX_NEIGHBORS = 1000;
-    const int MODULUS = 1000;
-    unsigned long neighborList [MAX_NEIGHBORS] , edgeList[MAX_NEIGHBORS];
+
+/**
+ * @brief Build the in-memory graph of the final graph, left finalized in the graph pool
+ */
+void LibcSandboxing::BuildInMemoryGraph(){
+    LibcCGStageScope stageScope(STAGE_GENERATE_INMEMORY_GRAPH);
+    LibcCGStageStats &stats = LibcCGStats[STAGE_GENERATE_INMEMORY_GRAPH];
+    std::vector<unsigned long> neighborList, edgeList;
     initialize_graph(NULL, 0);
 
-    for (const auto &vertex : finalGraph.get_vertices()) {
-        // Calculate the hash of the vertex - to have unique ID for the node
-        std::size_t strId = std::hash<std::string>{}(vertex)  % MODULUS;
+    if (PolicyMode == PolicyAllowset) {
+        // Libc IDs on the edges reachable from the entry node, other edges (llvm:, decl:, user:) carry no ID.
+        // The vertex names are interned, a vertex is told apart by the address of its name.
+        std::string_view entryNode = VertexNames::find(finalGraphEntryNode);
+        std::unordered_set<const char *> visited = {entryNode.data()};
+        std::vector<std::string_view> worklist = {entryNode};
+        while (!worklist.empty()) {
+            std::string_view vertex = worklist.back();
+            worklist.pop_back();
+            for (const auto &edge : finalGraph.get_outgoing_edges(vertex)) {
+                if (edge.find("libc:") != 0) {
+                    continue;
+                }
+                int libcId = fileToMapReader.getValueFromMap(edge.substr(5));
+                if (libcId >= 0) {
+                    edgeList.push_back(libcId);
+                }
+            }
+            for (const auto &neighbor : finalGraph.get_neighbors(vertex)) {
+                if (visited.insert(neighbor.data()).second) {
+                    worklist.push_back(neighbor);
+                }
+            }
+            stats.vertices++;
+        }
+        stats.edges += edgeList.size();
+        if (alloc_allowset(edgeList.size(), edgeList.data()) == nullptr) {
+            report_fatal_error("Libc call allow-set does not fit in the in-memory graph pool");
+        }
+    } else {
+        // Dense node IDs (they index the node table of the graph), with the entry node as the initial state 0. The
+        // vertex names are interned, the maps are keyed by the address of the name.
+        auto nodeKey = [](const std::string &vertex) { return VertexNames::find(vertex).data(); };
+        std::unordered_map<const char *, unsigned long> vertexToNodeId;
+        vertexToNodeId[nodeKey(finalGraphEntryNode)] = 0;
+        for (const auto &vertex : finalGraph.get_vertices()) {
+            vertexToNodeId.emplace(vertex.data(), vertexToNodeId.size());
+        }
 
+        // Return states of the call sites of each function, by its exit node
+        std::unordered_map<const char *, std::vector<unsigned long>> returnSites;
+        auto calleeOf = [](const std::string &edge) -> funcBBGraphMeta * {
+            auto it = (PolicyMode == PolicyPushdown && edge.find("user:") == 0) ? funcBBToMetaMap.find(edge.substr(5))
+                                                                                : funcBBToMetaMap.end();
+            return (it != funcBBToMetaMap.end()) ? &it->second : nullptr;
+        };
         for (const auto &vertex : finalGraph.get_vertices()) {
-            for (const auto &edge : finalGraph.get_outgoing_edges(vertex)) {
-                std::string edgeStr = (edge.find("libc:") == 0) ? edge.substr(5) : edge;
-                int libcId = fileToMapReader.getValueFromMap(edgeStr);
-                edgeList[numOutEdges] = libcId;
+            std::vector<std::string> edges = finalGraph.get_outgoing_edges(vertex);
+            std::vector<std::string_view> neighbors = finalGraph.get_neighbors(vertex);
+            for (size_t i = 0; i < edges.size(); i++) {
+                if (funcBBGraphMeta *callee = calleeOf(edges[i])) {
+                    returnSites[nodeKey(callee->exitNode)].push_back(vertexToNodeId.at(neighbors[i].data()));
+                }
             }
+        }
 
-            for (const auto &edge : finalGraph.get_neighbors(vertex)) {
-                neighborList[numOutEdges] = std::hash<std::string>{}(edge) % MODULUS;
+        for (const auto &vertex : finalGraph.get_vertices()) {
+            // Outgoing edges and neighbors are listed in the same (adjacency) order
+            std::vector<std::string> edges = finalGraph.get_outgoing_edges(vertex);
+            std::vector<std::string_view> neighbors = finalGraph.get_neighbors(vertex);
+            edgeList.clear();
+            neighborList.clear();
+            for (size_t i = 0; i < edges.size(); i++) {
+                if (funcBBGraphMeta *callee = calleeOf(edges[i])) {
+                    edgeList.push_back(LIBCALL_CALL);
+                    neighborList.push_back(vertexToNodeId.at(nodeKey(callee->entryNode)));
+                    edgeList.push_back(LIBCALL_CALL_RETURN);
+                    neighborList.push_back(vertexToNodeId.at(neighbors[i].data()));
+                } else if (edges[i].find("libc:") == 0) {
+                    // Other edges (llvm:, decl:, user: without a graph) carry no libc ID
+                    int libcId = fileToMapReader.getValueFromMap(edges[i].substr(5));
+                    if (libcId >= 0) {
+                        edgeList.push_back(libcId);
+                        neighborList.push_back(vertexToNodeId.at(neighbors[i].data()));
+                    }
+                }
+            }
+            for (unsigned long returnSite : returnSites[vertex.data()]) {
+                edgeList.push_back(LIBCALL_RETURN);
+                neighborList.push_back(returnSite);
             }
-            numOutEdges++;
-            assert (numOutEdges < MAX_NEIGHBORS);
+            if (alloc_node(vertexToNodeId.at(vertex.data()), neighborList.size(), neighborList.data(), edgeList.data()) == nullptr) {
+                report_fatal_error("Libc call graph does not fit in the in-memory graph pool");
+            }
+            stats.vertices++;
+            stats.edges += neighborList.size();
         }
-        alloc_node(strId, numOutEdges, edgeList, neighborList);
     }
     
+    set_violation_mode(ViolationMode);
     finalize_graph();
-    void * graph = get_graph();
-    SectionAddressHandler(M, (unsigned char*)graph, (1024 * 1024));
-    destroy_graph();    
+}
+
+void LibcSandboxing::GenerateInMemoryGraph(llvm::Module &M){
+    // Timed apart from the embedding, which has a stage of its own
+    BuildInMemoryGraph();
+    SectionAddressHandler(M, (unsigned char*)get_graph(), get_graph_size());
+    destroy_graph();
 }
 
 //------------------------------------------------------------------------------
@@ -539,62 +913,17 @@ bool LibcSandboxing::runOnModule(Module &M, ModuleAnalysisManager &MAM, Function
     
 
     for (auto &F : M) {
-        struct funcBBGraphMeta funcMeta;
-        
         if (F.isDeclaration()) continue;            // Skip external functions
         std::string funcName = F.getName().str();
         if (funcName.find("llvm.") == 0) continue; // Skip internal LLVM functions
         if (funcName.find("syscall") == 0) continue; // Skip the syscall wrapper function used for injection
 
         // DEBUG_PRINT(GREEN<<"\n===== Function: " << WHITE << funcName << GREEN << " =====\n"<<RESET);
-        LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
-        funcMeta.funcName = funcName;
         ///// Name the basic blocks
         nameBasicBlocks(F);        
 
-        ///// Generate the call graph - vertices/basicblocks
-        for (BasicBlock &BB : F) {
-            // DEBUG_PRINT_BB(BB);
-            auto *TI = BB.getTerminator();
-            if (BB.hasNPredecessors(0)) {
-                funcMeta.entryNode = BB.getName().str();
-                funcMeta.bbGraph.add_vertex(BB.getName().str(), (fileToMapReader.getLibraryCalls(BB).empty()) ? false : true);
-                // DEBUG_PRINT("ENTRY\n");
-            } 
-                
-            if (isa<ReturnInst>(TI)) {
-                funcMeta.exitNode = BB.getName().str();
-                funcMeta.bbGraph.add_vertex(BB.getName().str(),(fileToMapReader.getLibraryCalls(BB).empty()) ? false : true);
-                // DEBUG_PRINT("EXIT\n");
-                continue;
-            }
-
-            funcMeta.bbGraph.add_vertex(BB.getName().str(),
-                                    (fileToMapReader.getLibraryCalls(BB).empty()) ? false : true);
-            // DEBUG_PRINT("INTERNAL\n");
-        }
-
-        ///// Generate the call graph - populate edges
-        for (BasicBlock &BB : F) {
-            for (BasicBlock *Succ : successors(&BB)) {
-                funcMeta.bbGraph.add_edge(BB.getName().str(), Succ->getName().str(), "control");
-            }
-        }
-
-        ///// Generate the libc call list for each BB
-        for (BasicBlock &BB : F) {
-            std::vector<std::string> libCalls = fileToMapReader.getLibraryCalls(BB);
-            if (!libCalls.empty()) {
-                funcMeta.bbToLibcMap[BB.getName().str()] = libCalls;
-            }
-        }
-        funcBBToMetaMap[funcName] = funcMeta;
-        
-        // std::string outputFilename = OuputFilepathPrefix +'/'+ OuputFilenamePrefix + funcName + ".dot";
-        // funcMeta.bbGraph.dump_todot(outputFilename);
-
-        // DEBUG_PRINT(BOLD_GREEN << "Output filename: " << BOLD_WHITE << outputFilename << RESET << "\n");
-       
+        ///// Generate the call graph & the libc call list for each BB
+        BuildBBGraph(F);
         
         ///// Inject the dummy syscall
         for (BasicBlock &BB : F) {
@@ -641,11 +970,17 @@ bool LibcSandboxing::runOnModule(Module &M, ModuleAnalysisManager &MAM, Function
 //     }
 // }
 ////////////////////////////////////////////////////////////
+    SnapshotStage(SNAPSHOT_BB_GRAPH);
     ExpandBBGraph();
+    SnapshotStage(SNAPSHOT_EXPANDED_GRAPH);
     ConvertBBGraphToLibcCallGraph();
-    CombineLibcgGraph ();
+    SnapshotStage(SNAPSHOT_LIBC_GRAPH);
+    DumpStageGraphs();
+    if (!CombineLibcgGraph ()) {
+        return InsertedAtLeastOnePrintf;
+    }
+    SnapshotStage(SNAPSHOT_FINAL_GRAPH);
     GenerateInMemoryGraph(M);
-    MemoryCleanupHandler(M);
     return InsertedAtLeastOnePrintf;
 }
 
@@ -653,7 +988,12 @@ PreservedAnalyses LibcSandboxing::run(llvm::Module &M,
                                        llvm::ModuleAnalysisManager &AM) {
     FunctionAnalysisManager &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
     fileToMapReader.readFileToMap(InputLibFuncsPath);
+    resetLibcCGStats();
+    ResetGraphState();
     bool Changed =  runOnModule(M, AM, FAM);
+    if (PrintStats) {
+        printLibcCGStats(errs());
+    }
 
     return (Changed ? llvm::PreservedAnalyses::none()
                   : llvm::PreservedAnalyses::all());
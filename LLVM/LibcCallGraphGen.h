@@ -0,0 +1,95 @@
+#ifndef LLVM_ANALYSIS_UTILS_LIBCCALLGRAPHGEN_H
+#define LLVM_ANALYSIS_UTILS_LIBCCALLGRAPHGEN_H
+
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Pass.h"
+
+#include "LibcCallGraphUtils.h"
+#include "GraphLib.hpp"
+
+#include <map>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// New PM interface
+//------------------------------------------------------------------------------
+struct LibcSandboxing : public llvm::PassInfoMixin<LibcSandboxing> {
+private:
+    llvm::FileToMapReader fileToMapReader;
+
+    llvm::Function *DummySyscallF;
+    llvm::FunctionCallee DummySyscall;
+
+    void BuildInMemoryGraph();
+
+public:
+    llvm::PreservedAnalyses run(llvm::Module &M,
+                                llvm::ModuleAnalysisManager &);
+    bool runOnModule(llvm::Module &M, llvm::ModuleAnalysisManager &MAM, llvm::FunctionAnalysisManager &FAM);
+
+    static bool isRequired() { return true; }
+
+    bool readLibcListing(const std::string &filePath) { return fileToMapReader.readFileToMap(filePath); }
+
+    void setupDummySyscall(llvm::Module &M);
+    void injectDummySyscall(llvm::Instruction &I, int syscallNum);
+
+    void GenerateInMemoryGraph(llvm::Module &M);
+
+    void nameBasicBlocks(llvm::Function &F);
+    void BuildBBGraph(llvm::Function &F);
+    void SectionAddressHandler(llvm::Module &M, unsigned char *data, unsigned long size);
+};
+
+//-----------------------------------------------------------------------------
+// Data structures to store the basic block graphs
+//-----------------------------------------------------------------------------
+
+struct funcBBGraphMeta {
+    std::string funcName;
+
+    // Entry and exit node names
+    std::string entryNode;
+    std::string exitNode;
+
+    // Map to store the libc calls for each basic block
+    std::map <std::string, std::vector<std::string>> bbToLibcMap;
+
+    // Each stage moves the graph of the previous one in and transforms it in place, the graphs of the earlier
+    // stages are left empty unless their DOT output is requested (-cg-print-cfg)
+    LibcCallgraph bbGraph;          // Just basic block control flow graph
+    LibcCallgraph bbExpandedGraph;  // Graph with libc calls expanded
+    LibcCallgraph libcCallGraph;    // Graph with libc calls and program abstract state
+};
+extern std::map<std::string, funcBBGraphMeta> funcBBToMetaMap;
+
+extern std::string finalGraphEntryNode;
+extern std::string finalGraphExitNode;
+extern LibcCallgraph finalGraph;    // Final graph with libc calls and program abstract state
+
+//-----------------------------------------------------------------------------
+// Graph generation stages, run in this order after BuildBBGraph
+//-----------------------------------------------------------------------------
+void ResetGraphState();
+void ExpandBBGraph();
+void ConvertBBGraphToLibcCallGraph();
+void DumpStageGraphs();
+bool CombineLibcgGraph();
+
+//-----------------------------------------------------------------------------
+// Binary snapshots of the graphs built by the stages (-cg-snapshot)
+//-----------------------------------------------------------------------------
+enum LibcCGSnapshot {
+    SNAPSHOT_BB_GRAPH = 0,      // bbGraph and the calls of each basic block, after BuildBBGraph
+    SNAPSHOT_EXPANDED_GRAPH,    // bbExpandedGraph, after ExpandBBGraph
+    SNAPSHOT_LIBC_GRAPH,        // libcCallGraph, after ConvertBBGraphToLibcCallGraph
+    SNAPSHOT_FINAL_GRAPH,       // finalGraph, after CombineLibcgGraph
+    SNAPSHOT_COUNT
+};
+bool WriteStageSnapshot(LibcCGSnapshot snapshot, const std::string &filename);
+bool LoadStageSnapshot(const std::string &filename, LibcCGSnapshot &snapshot);
+
+#endif // LLVM_ANALYSIS_UTILS_LIBCCALLGRAPHGEN_H
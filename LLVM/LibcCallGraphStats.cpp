@@ -0,0 +1,50 @@
+#include "LibcCallGraphStats.h"
+
+namespace llvm {
+
+    LibcCGStageStats LibcCGStats[STAGE_COUNT];
+
+    const char *const LibcCGStageNames[STAGE_COUNT] = {
+        "nameBasicBlocks",
+        "BuildBBGraph",
+        "ExpandBBGraph",
+        "ConvertBBGraphToLibcCallGraph",
+        "CombineLibcgGraph",
+        "GenerateInMemoryGraph",
+        "SectionAddressHandler",
+    };
+
+    const char *const LibcCGStageDescs[STAGE_COUNT] = {
+        "Name basic blocks",
+        "Build basic block graph",
+        "Expand basic block graph",
+        "Convert to libc call graph",
+        "Combine libc call graphs",
+        "Generate in-memory graph",
+        "Embed sandbox section",
+    };
+
+    void resetLibcCGStats() {
+        for (auto &stats : LibcCGStats) {
+            stats = LibcCGStageStats();
+        }
+    }
+
+    void printLibcCGStats(raw_ostream &OS) {
+        OS << "===" << std::string(89, '-') << "===\n"
+           << "                               LibcSandboxing pass statistics\n"
+           << "===" << std::string(89, '-') << "===\n";
+        OS << left_justify("Stage", 30) << right_justify("Calls", 8) << right_justify("Vertices", 11)
+           << right_justify("Edges", 11) << right_justify("MergeIter", 11) << right_justify("Merges", 11)
+           << right_justify("Bytes", 13) << "\n";
+        for (unsigned i = 0; i < STAGE_COUNT; i++) {
+            const LibcCGStageStats &stats = LibcCGStats[i];
+            OS << left_justify(LibcCGStageNames[i], 30) << format_decimal(stats.invocations, 8)
+               << format_decimal(stats.vertices, 11) << format_decimal(stats.edges, 11)
+               << format_decimal(stats.mergeIterations, 11) << format_decimal(stats.merges, 11)
+               << format_decimal(stats.bytesEmitted, 13) << "\n";
+        }
+        OS << "\n";
+    }
+
+}
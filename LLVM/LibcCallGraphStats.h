@@ -0,0 +1,76 @@
+#ifndef LLVM_ANALYSIS_UTILS_LIBCCALLGRAPHSTATS_H
+#define LLVM_ANALYSIS_UTILS_LIBCCALLGRAPHSTATS_H
+
+#include "llvm/Pass.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace llvm {
+
+    /**
+     * @brief Stages of the libc call graph pipeline, listed in execution order
+     */
+    enum LibcCGStage {
+        STAGE_NAME_BASIC_BLOCKS = 0,
+        STAGE_BUILD_BB_GRAPH,
+        STAGE_EXPAND_BB_GRAPH,
+        STAGE_CONVERT_TO_LIBC_GRAPH,
+        STAGE_COMBINE_LIBC_GRAPH,
+        STAGE_GENERATE_INMEMORY_GRAPH,
+        STAGE_SECTION_ADDRESS_HANDLER,
+        STAGE_COUNT
+    };
+
+    /**
+     * @brief Per stage counters, reported with -cg-stats
+     *
+     * @details Vertex/edge counts are the size of the graph(s) produced by the stage,
+     *          summed over all the functions for per-function stages.
+     */
+    struct LibcCGStageStats {
+        unsigned long invocations      = 0;
+        unsigned long vertices         = 0;
+        unsigned long edges            = 0;
+        unsigned long mergeIterations  = 0;
+        unsigned long merges           = 0;
+        unsigned long bytesEmitted     = 0;
+    };
+
+    // Defined in LibcCallGraphStats.cpp, shared by every translation unit of the pass
+    extern LibcCGStageStats LibcCGStats[STAGE_COUNT];
+    extern const char *const LibcCGStageNames[STAGE_COUNT];
+    extern const char *const LibcCGStageDescs[STAGE_COUNT];
+
+    /**
+     * @brief RAII scope timing one invocation of a pipeline stage
+     *
+     * @details The stage shows up in the -time-passes report (under its own timer group)
+     *          and as a named region in -ftime-trace / -time-trace output.
+     */
+    class LibcCGStageScope {
+        NamedRegionTimer timer;
+        TimeTraceScope trace;
+
+        public:
+        LibcCGStageScope(LibcCGStage stage, StringRef detail = "")
+            : timer(LibcCGStageNames[stage], LibcCGStageDescs[stage],
+                    "libc-sandboxing", "LibcSandboxing pass stages", TimePassesIsEnabled),
+              trace(LibcCGStageNames[stage], detail) {
+            LibcCGStats[stage].invocations++;
+        }
+    };
+
+    /**
+     * @brief Reset all the stage counters, to be done at the start of each pass run
+     */
+    void resetLibcCGStats();
+
+    /**
+     * @brief Print the stage counters as a table
+     */
+    void printLibcCGStats(raw_ostream &OS);
+
+}
+#endif // LLVM_ANALYSIS_UTILS_LIBCCALLGRAPHSTATS_H
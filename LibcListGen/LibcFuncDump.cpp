@@ -1,115 +1,374 @@
 /**
  * @file library_func_dump.cpp
  * @author Vaisakh P S <vaisakhp@iisc.ac.in>
- * @brief Extracts the names of all functions in a shared library and writes them to a file.
+ * @brief Extracts the names of all functions in a set of shared libraries and writes them to a file.
  *
- * @details This program extracts the names of all functions in a shared library and writes them to a file.
- *          The output file contains one function name per line, prefixed by the function's index in the symbol table.
- *          The function names are extracted from the symbol table of the shared library.
+ * @details This program extracts the names of all functions exported by the given shared libraries and writes them to a file.
+ *          The output file contains one function name per line, prefixed by the function's ID.
+ *          The function names are extracted from all the symbol tables (SHT_SYMTAB and SHT_DYNSYM) of each library,
+ *          libraries being processed in parallel.
+ *
+ *          IDs are dense (starting at 1) and only depend on the set of function names:
+ *           - versioned symbols (name@VERSION) are reduced to their name
+ *           - aliases, i.e. names at the same address within a library, share the ID of the function
+ *           - functions are numbered in the order of their canonical (least decorated) name
+ *
+ *          With an ID registry (-r), IDs are kept stable across library upgrades: names of the registry keep
+ *          their ID, new functions get the next IDs, and the registry is extended with them. IDs of names
+ *          no longer exported stay reserved in the registry, so an ID never changes its meaning.
  *
  * @example ./library_func_dump <shared-library> <output-file>
+ * @example ./library_func_dump [-r <registry-file>] -o <output-file> <shared-library> [<shared-library> ...]
  *
  * @note This program uses the ELF library to parse the shared library.
  *       Hence ensure that the ELF library is installed and linked to in the CMakeLists.txt file.
  */
-#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
 #include <libelf.h>
 #include <fcntl.h>
 #include <gelf.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 /**
- * @brief Extracts the names of all functions in the shared library at the given path and writes them to the output file.
+ * @brief Functions of a library, as groups of aliases
+ */
+struct LibraryFunctions {
+    std::string path;
+    std::vector<std::set<std::string>> aliasGroups;
+    bool valid = false;
+};
+
+/**
+ * @brief Canonical name of an alias group: least leading underscores, then shortest, then lexicographic
+ */
+static const std::string &canonicalName(const std::set<std::string> &names) {
+    auto rank = [](const std::string &name) {
+        size_t underscores = name.find_first_not_of('_');
+        return std::make_tuple(underscores == std::string::npos ? name.size() : underscores, name.size(), std::cref(name));
+    };
+    return *std::min_element(names.begin(), names.end(),
+                             [&rank](const std::string &a, const std::string &b) { return rank(a) < rank(b); });
+}
+
+/**
+ * @brief Extracts the names of all functions defined in the shared library at the given path, grouped by address.
  *
  */
-void extractFunctionNames(const char *libPath, const char *outputFile) {
-    // Initialize the ELF library and perform sanity checks
-    if (elf_version(EV_CURRENT) == EV_NONE) {
-        std::cerr << "ELF library initialization failed: " << elf_errmsg(-1) << std::endl;
-        return;
-    }
+bool extractFunctionNames(const char *libPath, LibraryFunctions &functions) {
+    functions.path = libPath;
 
     // Open the shared library file
     int fd = open(libPath, O_RDONLY, 0);
     if (fd < 0) {
-        std::cerr << "Failed to open file: " << libPath << std::endl;
-        return;
+        std::cerr << "Failed to open file: " << libPath << "\n";
+        return false;
     }
 
-    // Initialize the ELF descriptor
-    Elf *elf = elf_begin(fd, ELF_C_READ, nullptr);
+    // Initialize the ELF descriptor, over a mapping of the file
+    Elf *elf = elf_begin(fd, ELF_C_READ_MMAP, nullptr);
     if (!elf) {
-        std::cerr << "elf_begin() failed: " << elf_errmsg(-1) << std::endl;
+        std::cerr << "elf_begin() failed for " << libPath << ": " << elf_errmsg(-1) << "\n";
         close(fd);
-        return;
+        return false;
     }
 
-    // Iterate over the sections to find the symbol table
+    // Iterate over all the symbol tables, static and dynamic
+    std::map<GElf_Addr, std::set<std::string>> namesAtAddress;
+    bool symbolTableFound = false;
     Elf_Scn *scn = nullptr;
     GElf_Shdr shdr;
     while ((scn = elf_nextscn(elf, scn)) != nullptr) {
-        gelf_getshdr(scn, &shdr);
-        if (shdr.sh_type == SHT_SYMTAB || shdr.sh_type == SHT_DYNSYM) {
-            break;
+        if (!gelf_getshdr(scn, &shdr) || (shdr.sh_type != SHT_SYMTAB && shdr.sh_type != SHT_DYNSYM) || shdr.sh_entsize == 0) {
+            continue;
+        }
+        symbolTableFound = true;
+
+        // Get the symbol table data, skip the table in case of error.
+        Elf_Data *data = elf_getdata(scn, nullptr);
+        if (!data) {
+            std::cerr << "elf_getdata() failed for " << libPath << ": " << elf_errmsg(-1) << "\n";
+            continue;
+        }
+
+        // Iterate over the symbol table entries and extract the functions defined and exported by the library
+        size_t count = shdr.sh_size / shdr.sh_entsize;
+        for (size_t i = 0; i < count; ++i) {
+            GElf_Sym sym;
+            if (!gelf_getsym(data, i, &sym)) {
+                continue;
+            }
+            int type = GELF_ST_TYPE(sym.st_info), bind = GELF_ST_BIND(sym.st_info);
+            if ((type != STT_FUNC && type != STT_GNU_IFUNC) || sym.st_shndx == SHN_UNDEF ||
+                (bind != STB_GLOBAL && bind != STB_WEAK)) {
+                continue;
+            }
+            const char *name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+            if (!name || !*name) {
+                continue;
+            }
+            // Versioned names of the static symbol table, e.g. memcpy@GLIBC_2.2.5 or memcpy@@GLIBC_2.14
+            std::string funcName(name);
+            funcName = funcName.substr(0, funcName.find('@'));
+            namesAtAddress[sym.st_value].insert(funcName);
         }
     }
 
-    // Check if the symbol table was found, if not print an error message
-    if (!scn) {
-        std::cerr << "No symbol table found in " << libPath << std::endl;
-        elf_end(elf);
-        close(fd);
-        return;
+    if (!symbolTableFound) {
+        std::cerr << "No symbol table found in " << libPath << "\n";
+    }
+    for (auto &entry : namesAtAddress) {
+        functions.aliasGroups.push_back(std::move(entry.second));
     }
 
-    // Get the symbol table data, exit in case of error.
-    Elf_Data *data = elf_getdata(scn, nullptr);
-    if (!data) {
-        std::cerr << "elf_getdata() failed: " << elf_errmsg(-1) << std::endl;
-        elf_end(elf);
-        close(fd);
-        return;
+    elf_end(elf);
+    close(fd);
+    functions.valid = symbolTableFound;
+    return functions.valid;
+}
+
+/**
+ * @brief Merges the alias groups of all libraries, a name found in several groups joins them
+ *
+ * @return The merged groups, ordered by their canonical name
+ */
+static std::vector<std::set<std::string>> mergeAliasGroups(std::vector<LibraryFunctions> &libraries) {
+    std::vector<std::set<std::string>> groups;
+    std::unordered_map<std::string, size_t> groupOfName;
+
+    for (auto &library : libraries) {
+        for (auto &aliases : library.aliasGroups) {
+            // Groups already holding any of these names
+            std::set<size_t> existing;
+            for (const auto &name : aliases) {
+                auto it = groupOfName.find(name);
+                if (it != groupOfName.end()) {
+                    existing.insert(it->second);
+                }
+            }
+
+            size_t target = existing.empty() ? groups.size() : *existing.begin();
+            if (existing.empty()) {
+                groups.emplace_back();
+            }
+            for (size_t other : existing) {
+                if (other != target) {
+                    for (const auto &name : groups[other]) {
+                        groupOfName[name] = target;
+                    }
+                    groups[target].merge(groups[other]);
+                    groups[other].clear();
+                }
+            }
+            for (const auto &name : aliases) {
+                groupOfName[name] = target;
+                groups[target].insert(name);
+            }
+        }
     }
 
-    // Open the output file for writing
-    std::ofstream outFile(outputFile);
-    if (!outFile.is_open()) {
-        std::cerr << "Failed to open output file: " << outputFile << std::endl;
-        elf_end(elf);
-        close(fd);
-        return;
+    groups.erase(std::remove_if(groups.begin(), groups.end(), [](const auto &group) { return group.empty(); }),
+                 groups.end());
+    std::sort(groups.begin(), groups.end(), [](const auto &a, const auto &b) { return canonicalName(a) < canonicalName(b); });
+    return groups;
+}
+
+/**
+ * @brief Reads a listing/registry of "<id>:<name>" lines in to the name to ID map
+ *
+ * @return false if the file exists but is malformed, a missing registry is an empty one
+ */
+static bool readIdRegistry(const char *registryFile, std::map<std::string, unsigned long> &registry) {
+    std::ifstream file(registryFile);
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t colonPos = line.find(':');
+        if (colonPos == std::string::npos || colonPos == 0 ||
+            line.find_first_not_of("0123456789") != colonPos) {
+            std::cerr << "Invalid line in ID registry " << registryFile << ": " << line << "\n";
+            return false;
+        }
+        try {
+            registry[line.substr(colonPos + 1)] = std::stoul(line.substr(0, colonPos));
+        } catch (const std::out_of_range &) {
+            std::cerr << "Invalid ID in ID registry " << registryFile << ": " << line << "\n";
+            return false;
+        }
     }
+    return true;
+}
 
-    // Iterate over the symbol table entries and extract function names
-    int count = shdr.sh_size / shdr.sh_entsize;
-    for (int i = 0; i < count; ++i) {
-        GElf_Sym sym;
-        gelf_getsym(data, i, &sym);
-        if (GELF_ST_TYPE(sym.st_info) == STT_FUNC) {
-            const char *name = elf_strptr(elf, shdr.sh_link, sym.st_name);
-            if (name) {
-                outFile << i << ":" << name << std::endl;
+/**
+ * @brief Writes the listing of the names of each ID, ordered by ID
+ *
+ * @note The file is replaced atomically, so that an interrupted run never leaves a truncated registry behind.
+ */
+static bool writeListing(const char *outputFile, const std::map<std::string, unsigned long> &ids) {
+    std::vector<std::pair<unsigned long, const std::string *>> entries;
+    for (const auto &entry : ids) {
+        entries.emplace_back(entry.second, &entry.first);
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const auto &a, const auto &b) { return std::tie(a.first, *a.second) < std::tie(b.first, *b.second); });
+
+    std::string listing;
+    for (const auto &entry : entries) {
+        listing += std::to_string(entry.first) + ":" + *entry.second + "\n";
+    }
+
+    // A temporary file of its own in the same directory, concurrent runs each rename theirs over the output
+    std::string tmpFile = std::string(outputFile) + ".XXXXXX";
+    int fd = mkstemp(tmpFile.data());
+    FILE *file = (fd < 0) ? nullptr : fdopen(fd, "w");
+    if (!file) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmpFile.c_str());
+        }
+        std::cerr << "Failed to open output file: " << outputFile << "\n";
+        return false;
+    }
+    // mkstemp creates the file private to the owner, the listing is readable by all
+    bool failed = fwrite(listing.data(), 1, listing.size(), file) != listing.size() || fchmod(fd, 0644) != 0;
+    failed = (fclose(file) != 0) || failed;
+    if (failed) {
+        unlink(tmpFile.c_str());
+        std::cerr << "Failed to write output file: " << outputFile << "\n";
+        return false;
+    }
+    if (std::rename(tmpFile.c_str(), outputFile) != 0) {
+        unlink(tmpFile.c_str());
+        std::cerr << "Failed to write output file: " << outputFile << "\n";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Assigns an ID to each function group
+ *
+ * @details A group takes the smallest registry ID among its names, if any, and all its names then share it
+ *          (each name of the registry still keeps its own ID). Other groups get the IDs following the largest
+ *          one of the registry, in the order of their canonical name. The registry is extended with the new names.
+ */
+static std::map<std::string, unsigned long> assignIds(const std::vector<std::set<std::string>> &groups,
+                                                      std::map<std::string, unsigned long> &registry) {
+    std::map<std::string, unsigned long> ids;
+    unsigned long nextId = 1;
+    for (const auto &entry : registry) {
+        nextId = std::max(nextId, entry.second + 1);
+    }
+
+    for (const auto &group : groups) {
+        unsigned long groupId = 0;
+        for (const auto &name : group) {
+            auto it = registry.find(name);
+            if (it != registry.end() && (groupId == 0 || it->second < groupId)) {
+                groupId = it->second;
             }
         }
+        if (groupId == 0) {
+            groupId = nextId++;
+        }
+        for (const auto &name : group) {
+            ids[name] = registry.emplace(name, groupId).first->second;
+        }
+    }
+    return ids;
+}
+
+/**
+ * @brief Extracts the functions of all the libraries on a pool of threads and writes the listing to the output file.
+ *
+ * @param registryFile ID registry to take the IDs from and extend, none if NULL
+ */
+bool extractLibrariesFunctionNames(const std::vector<std::string> &libPaths, const char *outputFile, const char *registryFile) {
+    // Initialize the ELF library and perform sanity checks, once for all the threads
+    if (elf_version(EV_CURRENT) == EV_NONE) {
+        std::cerr << "ELF library initialization failed: " << elf_errmsg(-1) << "\n";
+        return false;
+    }
+
+    std::vector<LibraryFunctions> libraries(libPaths.size());
+    std::atomic<size_t> nextLibrary{0};
+    auto worker = [&]() {
+        for (size_t i = nextLibrary++; i < libPaths.size(); i = nextLibrary++) {
+            extractFunctionNames(libPaths[i].c_str(), libraries[i]);
+        }
+    };
+
+    size_t numThreads = std::min<size_t>(libPaths.size(), std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < numThreads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : threads) {
+        thread.join();
     }
 
-    // Close the output file and cleanup
-    outFile.close();
-    elf_end(elf);
-    close(fd);
+    for (const auto &library : libraries) {
+        if (!library.valid) {
+            return false;
+        }
+    }
+
+    // Assign the IDs and write all the names of each function, in a single write
+    std::map<std::string, unsigned long> registry;
+    if (registryFile && !readIdRegistry(registryFile, registry)) {
+        return false;
+    }
+    std::map<std::string, unsigned long> ids = assignIds(mergeAliasGroups(libraries), registry);
+    if (registryFile && !writeListing(registryFile, registry)) {
+        return false;
+    }
+    return writeListing(outputFile, ids);
 }
 
 /**
  * @brief Main function that parses the command line arguments and calls the function to extract function names.
  * @example ./library_func_dump <shared-library> <output-file>
+ * @example ./library_func_dump [-r <registry-file>] -o <output-file> <shared-library> [<shared-library> ...]
  */
 int main(int argc, char **argv) {
-    if (argc != 3) {
+    std::vector<std::string> libPaths;
+    const char *outputFile = nullptr;
+    const char *registryFile = nullptr;
+
+    if (argc == 3 && argv[1][0] != '-') {
+        libPaths.push_back(argv[1]);
+        outputFile = argv[2];
+    } else {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "-o" && i + 1 < argc) {
+                outputFile = argv[++i];
+            } else if (arg == "-r" && i + 1 < argc) {
+                registryFile = argv[++i];
+            } else {
+                libPaths.push_back(arg);
+            }
+        }
+    }
+
+    if (!outputFile || libPaths.empty()) {
         std::cerr << "Usage: " << argv[0] << " <shared-library> <output-file>" << std::endl;
+        std::cerr << "       " << argv[0] << " [-r <registry-file>] -o <output-file> <shared-library> [<shared-library> ...]" << std::endl;
         return 1;
     }
 
-    extractFunctionNames(argv[1], argv[2]);
-    return 0;
+    return extractLibrariesFunctionNames(libPaths, outputFile, registryFile) ? 0 : 1;
 }
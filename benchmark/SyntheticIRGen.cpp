@@ -0,0 +1,128 @@
+/**
+ * @file SyntheticIRGen.cpp
+ * @brief Generator for synthetic IR modules, used to benchmark the libc call graph generation at scale.
+ */
+#include "SyntheticIRGen.h"
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+
+#include <fstream>
+#include <map>
+#include <random>
+
+using namespace llvm;
+
+std::vector<std::string> readLibcNames(const std::string &listingPath) {
+    std::vector<std::string> names;
+    std::ifstream file(listingPath);
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t colonPos = line.find(':');
+        if (colonPos != std::string::npos) {
+            names.push_back(line.substr(colonPos + 1));
+        }
+    }
+    return names;
+}
+
+static const std::vector<std::string> DefaultLibcNames = {
+    "printf", "puts", "malloc", "free", "memcpy", "snprintf", "fopen", "fclose", "read", "write", "getpid",
+};
+
+std::unique_ptr<Module> generateSyntheticModule(LLVMContext &ctx, const SyntheticIRConfig &config,
+                                                const std::vector<std::string> &libcNames) {
+    const std::vector<std::string> &libcs = libcNames.empty() ? DefaultLibcNames : libcNames;
+    const unsigned numFunctions = std::max(config.numFunctions, 1u);
+    const unsigned numBBs = std::max(config.bbsPerFunction, 2u);
+    const unsigned numLevels = std::max(config.callGraphDepth, 1u);
+
+    std::mt19937 rng(config.seed);
+    auto percent = [&rng](unsigned density) { return (rng() % 100) < density; };
+
+    auto M = std::make_unique<Module>("synthetic", ctx);
+    IntegerType *Int32Ty = Type::getInt32Ty(ctx);
+
+    // Branch conditions are derived from a volatile load, so that no branch can be folded away
+    auto *state = new GlobalVariable(*M, Int32Ty, false, GlobalValue::ExternalLinkage,
+                                     ConstantInt::get(Int32Ty, 0), "synthetic_state");
+
+    // Declare all the functions up front, assigning each to a call-graph level
+    std::vector<Function *> functions;
+    std::vector<unsigned> levels;
+    FunctionType *MainTy = FunctionType::get(Int32Ty, false);
+    FunctionType *FuncTy = FunctionType::get(Int32Ty, {Int32Ty}, false);
+    functions.push_back(Function::Create(MainTy, GlobalValue::ExternalLinkage, "main", *M));
+    levels.push_back(0);
+    for (unsigned i = 1; i < numFunctions; i++) {
+        functions.push_back(Function::Create(FuncTy, GlobalValue::ExternalLinkage, "synthetic_func_" + std::to_string(i), *M));
+        levels.push_back(numLevels > 1 ? 1 + (i - 1) % (numLevels - 1) : 1);
+    }
+
+    // Distribute the functions of each level among the callers of the previous level
+    std::map<unsigned, std::vector<unsigned>> functionsAtLevel;
+    for (unsigned i = 0; i < numFunctions; i++) {
+        functionsAtLevel[levels[i]].push_back(i);
+    }
+    std::vector<std::vector<Function *>> callees(numFunctions);
+    for (unsigned level = 1; level < numLevels; level++) {
+        const auto &callers = functionsAtLevel[level - 1];
+        const auto &levelFuncs = functionsAtLevel[level];
+        for (unsigned j = 0; j < levelFuncs.size() && !callers.empty(); j++) {
+            callees[callers[j % callers.size()]].push_back(functions[levelFuncs[j]]);
+        }
+    }
+
+    FunctionType *LibcTy = FunctionType::get(Int32Ty, true);
+    for (unsigned f = 0; f < numFunctions; f++) {
+        Function *F = functions[f];
+        std::vector<BasicBlock *> bbs;
+        for (unsigned i = 0; i < numBBs; i++) {
+            bbs.push_back(BasicBlock::Create(ctx, "", F));
+        }
+
+        IRBuilder<> Builder(bbs[0]);
+        Value *cond = Builder.CreateLoad(Int32Ty, state, true);
+
+        // Loop nest: the k-th loop spans [1 + k, numBBs - 2 - k], the entry block never is a loop header
+        std::map<unsigned, unsigned> latchToHeader;
+        for (unsigned k = 0; k < config.loopNesting; k++) {
+            unsigned header = 1 + k, latch = numBBs - 2 - k;
+            if (header >= latch || latch >= numBBs) {
+                break;
+            }
+            latchToHeader[latch] = header;
+        }
+
+        for (unsigned i = 0; i < numBBs; i++) {
+            Builder.SetInsertPoint(bbs[i]);
+            if (percent(config.libcCallDensity)) {
+                FunctionCallee libc = M->getOrInsertFunction(libcs[rng() % libcs.size()], LibcTy);
+                Builder.CreateCall(libc, {});
+            }
+            // Spread the calls to the next level over the non-entry blocks
+            for (unsigned c = 0; c < callees[f].size(); c++) {
+                if (1 + c % (numBBs - 1) == i) {
+                    Builder.CreateCall(callees[f][c], {cond});
+                }
+            }
+
+            if (i == numBBs - 1) {
+                Builder.CreateRet(ConstantInt::get(Int32Ty, 0));
+            } else if (latchToHeader.count(i)) {
+                Value *cmp = Builder.CreateICmpEQ(cond, ConstantInt::get(Int32Ty, i));
+                Builder.CreateCondBr(cmp, bbs[latchToHeader[i]], bbs[i + 1]);
+            } else if (i + 2 < numBBs && percent(config.branchDensity)) {
+                unsigned target = i + 2 + rng() % (numBBs - i - 2);
+                Value *cmp = Builder.CreateICmpEQ(cond, ConstantInt::get(Int32Ty, i));
+                Builder.CreateCondBr(cmp, bbs[i + 1], bbs[target]);
+            } else {
+                Builder.CreateBr(bbs[i + 1]);
+            }
+        }
+    }
+    return M;
+}
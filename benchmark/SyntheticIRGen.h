@@ -0,0 +1,43 @@
+#ifndef BENCHMARK_SYNTHETICIRGEN_H
+#define BENCHMARK_SYNTHETICIRGEN_H
+
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Shape of a synthetic module to be generated
+ *
+ * @details Functions are arranged in call-graph levels, with `main` alone at level 0 and every other function
+ *          placed round-robin in levels [1, callGraphDepth). A function only calls functions of the next level,
+ *          so the generated call graph is acyclic and exactly `callGraphDepth` levels deep.
+ */
+struct SyntheticIRConfig {
+    unsigned numFunctions    = 16;  // Total number of defined functions, including main
+    unsigned bbsPerFunction  = 32;  // Basic blocks in each function (minimum 2: entry and exit)
+    unsigned loopNesting     = 2;   // Depth of the loop nest in each function
+    unsigned libcCallDensity = 50;  // Percentage of basic blocks carrying a libc call
+    unsigned callGraphDepth  = 4;   // Number of levels in the user function call graph
+    unsigned branchDensity   = 25;  // Percentage of basic blocks ending with a forward conditional branch
+    unsigned seed            = 1;   // Seed for the generator, same seed produces the same module
+};
+
+/**
+ * @brief Read the libc function names from a listing generated by LibcListGen
+ */
+std::vector<std::string> readLibcNames(const std::string &listingPath);
+
+/**
+ * @brief Generate a synthetic module with the given shape
+ *
+ * @param ctx       Context to create the module in
+ * @param config    Shape of the module
+ * @param libcNames Libc functions to pick the calls from, a small builtin set is used if empty
+ */
+std::unique_ptr<llvm::Module> generateSyntheticModule(llvm::LLVMContext &ctx, const SyntheticIRConfig &config,
+                                                      const std::vector<std::string> &libcNames);
+
+#endif // BENCHMARK_SYNTHETICIRGEN_H
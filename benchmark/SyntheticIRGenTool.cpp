@@ -0,0 +1,58 @@
+/**
+ * @file SyntheticIRGenTool.cpp
+ * @brief Command line front-end of the synthetic IR generator.
+ *
+ * @example ./synthetic-irgen -functions 64 -bbs 128 -loop-nesting 3 -libc-density 40 -call-depth 6 -o synthetic.ll
+ */
+#include "SyntheticIRGen.h"
+
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+static cl::opt<unsigned> NumFunctions("functions", cl::desc("Number of functions, including main"), cl::init(16));
+static cl::opt<unsigned> BBsPerFunction("bbs", cl::desc("Basic blocks per function"), cl::init(32));
+static cl::opt<unsigned> LoopNesting("loop-nesting", cl::desc("Depth of the loop nest in each function"), cl::init(2));
+static cl::opt<unsigned> LibcDensity("libc-density", cl::desc("Percentage of basic blocks with a libc call"), cl::init(50));
+static cl::opt<unsigned> CallDepth("call-depth", cl::desc("Depth of the user function call graph"), cl::init(4));
+static cl::opt<unsigned> BranchDensity("branch-density", cl::desc("Percentage of basic blocks ending with a conditional branch"), cl::init(25));
+static cl::opt<unsigned> Seed("seed", cl::desc("Seed of the generator"), cl::init(1));
+static cl::opt<std::string> LibcListing("libc-listing", cl::desc("Libc listing generated by LibcListGen to pick calls from"),
+                                        cl::value_desc("filepath"), cl::init(""));
+static cl::opt<std::string> OutputFilename("o", cl::desc("Output IR file"), cl::value_desc("filename"), cl::init("-"));
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Synthetic IR module generator for LibcSandboxing benchmarks\n");
+
+    SyntheticIRConfig config;
+    config.numFunctions    = NumFunctions;
+    config.bbsPerFunction  = BBsPerFunction;
+    config.loopNesting     = LoopNesting;
+    config.libcCallDensity = LibcDensity;
+    config.callGraphDepth  = CallDepth;
+    config.branchDensity   = BranchDensity;
+    config.seed            = Seed;
+
+    LLVMContext ctx;
+    std::vector<std::string> libcNames;
+    if (!LibcListing.empty()) {
+        libcNames = readLibcNames(LibcListing);
+    }
+    auto M = generateSyntheticModule(ctx, config, libcNames);
+    if (verifyModule(*M, &errs())) {
+        errs() << "Generated module is broken\n";
+        return 1;
+    }
+
+    std::error_code EC;
+    raw_fd_ostream out(OutputFilename, EC, sys::fs::OF_Text);
+    if (EC) {
+        errs() << "Failed to open output file: " << OutputFilename << " (" << EC.message() << ")\n";
+        return 1;
+    }
+    M->print(out, nullptr);
+    return 0;
+}
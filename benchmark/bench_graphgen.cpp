@@ -0,0 +1,435 @@
+/**
+ * @file bench_graphgen.cpp
+ * @brief Google Benchmark harness for the LibcSandboxing pass stages and LibcCallgraph primitives.
+ *
+ * @details Every pass stage is measured on its own over synthetic modules: the stages preceding it are run with
+ *          the timer paused. Along with the time, each benchmark reports the peak RSS of the measured stage
+ *          (`peak_rss_kb`, from VmHWM which is reset before the stage) and the RSS growth it caused (`rss_delta_kb`).
+ *
+ * @example ./bench_graphgen -bench-libc-listing test/libc_listing.lst --benchmark_filter=Expand
+ * @example ./bench_graphgen -bench-snapshot out-dir/dot/helloworld.c.lllibc.snap --benchmark_filter=Snapshot
+ */
+#include "GraphSnapshot.hpp"
+#include "LibcCallGraphGen.h"
+#include "SyntheticIRGen.h"
+
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+
+#include <benchmark/benchmark.h>
+
+#include <fstream>
+#include <unistd.h>
+
+using namespace llvm;
+
+static cl::opt<std::string> BenchLibcListing(
+    "bench-libc-listing",
+    cl::desc("Libc listing used by the generator and the pass"),
+    cl::value_desc("filepath"),
+    cl::init(BENCH_DEFAULT_LIBC_LISTING));
+
+static cl::opt<std::string> BenchSnapshot(
+    "bench-snapshot",
+    cl::desc("Stage snapshot written by the pass with -cg-snapshot, the stage following it is measured on its graphs"),
+    cl::value_desc("filepath"),
+    cl::init(""));
+
+static std::vector<std::string> LibcNames;
+
+//------------------------------------------------------------------------------
+// Memory accounting
+//------------------------------------------------------------------------------
+
+/**
+ * @brief Read a "<Field>: <value> kB" entry of /proc/self/status
+ */
+static long readProcStatusKB(const char *field) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    size_t fieldLen = strlen(field);
+    while (std::getline(status, line)) {
+        if (line.compare(0, fieldLen, field) == 0 && line[fieldLen] == ':') {
+            return std::stol(line.substr(fieldLen + 1));
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Reset the peak RSS (VmHWM) of the process, so that it tracks only what follows
+ */
+static void resetPeakRSS() {
+    std::ofstream clearRefs("/proc/self/clear_refs");
+    clearRefs << "5";
+}
+
+struct StageMemory {
+    long peakKB = 0;
+    long deltaKB = 0;
+
+    void begin() {
+        resetPeakRSS();
+        startKB = readProcStatusKB("VmRSS");
+    }
+    void end() {
+        peakKB = std::max(peakKB, readProcStatusKB("VmHWM"));
+        deltaKB += readProcStatusKB("VmRSS") - startKB;
+    }
+    void report(benchmark::State &state) {
+        state.counters["peak_rss_kb"] = benchmark::Counter(peakKB);
+        state.counters["rss_delta_kb"] = benchmark::Counter(deltaKB, benchmark::Counter::kAvgIterations);
+    }
+
+    private:
+    long startKB = 0;
+};
+
+//------------------------------------------------------------------------------
+// Pipeline set-up
+//------------------------------------------------------------------------------
+
+/**
+ * @brief Stages of the pipeline, a benchmark runs every stage before the measured one untimed
+ */
+enum PipelineStage {
+    NAME_BASIC_BLOCKS = 0,
+    BUILD_BB_GRAPH,
+    EXPAND_BB_GRAPH,
+    CONVERT_TO_LIBC_GRAPH,
+    COMBINE_LIBC_GRAPH,
+    GENERATE_INMEMORY_GRAPH,
+};
+
+static SyntheticIRConfig configFromState(const benchmark::State &state) {
+    SyntheticIRConfig config;
+    config.numFunctions    = state.range(0);
+    config.bbsPerFunction  = state.range(1);
+    config.loopNesting     = state.range(2);
+    config.libcCallDensity = state.range(3);
+    config.callGraphDepth  = state.range(4);
+    return config;
+}
+
+static bool isPassFunction(const Function &F) {
+    std::string funcName = F.getName().str();
+    return !F.isDeclaration() && funcName.find("llvm.") != 0 && funcName.find("syscall") != 0;
+}
+
+static void runStage(LibcSandboxing &pass, Module &M, PipelineStage stage) {
+    switch (stage) {
+    case NAME_BASIC_BLOCKS:
+        for (Function &F : M) {
+            if (isPassFunction(F)) pass.nameBasicBlocks(F);
+        }
+        break;
+    case BUILD_BB_GRAPH:
+        for (Function &F : M) {
+            if (isPassFunction(F)) pass.BuildBBGraph(F);
+        }
+        break;
+    case EXPAND_BB_GRAPH:         ExpandBBGraph(); break;
+    case CONVERT_TO_LIBC_GRAPH:   ConvertBBGraphToLibcCallGraph(); break;
+    case COMBINE_LIBC_GRAPH:      CombineLibcgGraph(); break;
+    case GENERATE_INMEMORY_GRAPH: pass.GenerateInMemoryGraph(M); break;
+    }
+}
+
+static void BM_PipelineStage(benchmark::State &state, PipelineStage measured) {
+    SyntheticIRConfig config = configFromState(state);
+    StageMemory memory;
+    unsigned long vertices = 0;
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        LLVMContext ctx;
+        auto M = generateSyntheticModule(ctx, config, LibcNames);
+        LibcSandboxing pass;
+        pass.readLibcListing(BenchLibcListing);
+        pass.setupDummySyscall(*M);
+        ResetGraphState();
+        for (int stage = NAME_BASIC_BLOCKS; stage < measured; stage++) {
+            runStage(pass, *M, static_cast<PipelineStage>(stage));
+        }
+        memory.begin();
+        state.ResumeTiming();
+
+        runStage(pass, *M, measured);
+
+        state.PauseTiming();
+        memory.end();
+        vertices = finalGraph.num_vertices();
+        ResetGraphState();
+        M.reset();
+        state.ResumeTiming();
+    }
+    memory.report(state);
+    state.counters["final_vertices"] = vertices;
+}
+
+static void BM_FullPass(benchmark::State &state) {
+    SyntheticIRConfig config = configFromState(state);
+    StageMemory memory;
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        LLVMContext ctx;
+        auto M = generateSyntheticModule(ctx, config, LibcNames);
+        PassBuilder PB;
+        LoopAnalysisManager LAM;
+        FunctionAnalysisManager FAM;
+        CGSCCAnalysisManager CGAM;
+        ModuleAnalysisManager MAM;
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+        memory.begin();
+        state.ResumeTiming();
+
+        LibcSandboxing().run(*M, MAM);
+
+        state.PauseTiming();
+        memory.end();
+        M.reset();
+        state.ResumeTiming();
+    }
+    memory.report(state);
+}
+
+static void BM_SyntheticIRGen(benchmark::State &state) {
+    SyntheticIRConfig config = configFromState(state);
+    for (auto _ : state) {
+        LLVMContext ctx;
+        auto M = generateSyntheticModule(ctx, config, LibcNames);
+        benchmark::DoNotOptimize(M.get());
+    }
+}
+
+/**
+ * @brief The stage following the snapshot given with -bench-snapshot, run on the graphs of the snapshot
+ */
+static void BM_SnapshotStage(benchmark::State &state, PipelineStage measured) {
+    StageMemory memory;
+    LLVMContext ctx;
+    LibcCGSnapshot snapshot;
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        Module M("snapshot", ctx);
+        LibcSandboxing pass;
+        pass.readLibcListing(BenchLibcListing);
+        if (!LoadStageSnapshot(BenchSnapshot, snapshot)) {
+            state.SkipWithError("Failed to load the snapshot");
+            break;
+        }
+        memory.begin();
+        state.ResumeTiming();
+
+        runStage(pass, M, measured);
+
+        state.PauseTiming();
+        memory.end();
+        ResetGraphState();
+        state.ResumeTiming();
+    }
+    memory.report(state);
+}
+
+/**
+ * @brief Module shapes: {functions, BBs per function, loop nesting, libc density %, call graph depth}
+ */
+static void ModuleShapes(benchmark::internal::Benchmark *b) {
+    b->ArgNames({"funcs", "bbs", "loops", "libc", "depth"});
+    b->Args({8, 16, 1, 50, 2});
+    b->Args({32, 32, 2, 50, 4});
+    b->Args({64, 64, 3, 50, 6});
+    b->Args({128, 128, 3, 30, 8});
+    b->Args({32, 256, 4, 80, 4});
+    b->Unit(benchmark::kMillisecond);
+}
+
+BENCHMARK(BM_SyntheticIRGen)->Apply(ModuleShapes);
+BENCHMARK_CAPTURE(BM_PipelineStage, nameBasicBlocks, NAME_BASIC_BLOCKS)->Apply(ModuleShapes);
+BENCHMARK_CAPTURE(BM_PipelineStage, BuildBBGraph, BUILD_BB_GRAPH)->Apply(ModuleShapes);
+BENCHMARK_CAPTURE(BM_PipelineStage, ExpandBBGraph, EXPAND_BB_GRAPH)->Apply(ModuleShapes);
+BENCHMARK_CAPTURE(BM_PipelineStage, ConvertBBGraphToLibcCallGraph, CONVERT_TO_LIBC_GRAPH)->Apply(ModuleShapes);
+BENCHMARK_CAPTURE(BM_PipelineStage, CombineLibcgGraph, COMBINE_LIBC_GRAPH)->Apply(ModuleShapes);
+BENCHMARK_CAPTURE(BM_PipelineStage, GenerateInMemoryGraph, GENERATE_INMEMORY_GRAPH)->Apply(ModuleShapes);
+BENCHMARK(BM_FullPass)->Apply(ModuleShapes);
+
+//------------------------------------------------------------------------------
+// LibcCallgraph primitives
+//------------------------------------------------------------------------------
+
+/**
+ * @brief Build a CFG-like graph: a chain of `n` vertices, every 4th one branching forward and back
+ */
+static LibcCallgraph buildChainGraph(unsigned n) {
+    LibcCallgraph graph;
+    for (unsigned i = 0; i < n; i++) {
+        graph.add_vertex("bb" + std::to_string(i), (i % 3) == 0);
+    }
+    for (unsigned i = 0; i + 1 < n; i++) {
+        graph.add_edge("bb" + std::to_string(i), "bb" + std::to_string(i + 1), (i % 2) ? "control" : "libc:printf");
+        if ((i % 4) == 0 && i + 3 < n) {
+            graph.add_edge("bb" + std::to_string(i), "bb" + std::to_string(i + 3), "control");
+        }
+        if ((i % 4) == 3 && i >= 3) {
+            graph.add_edge("bb" + std::to_string(i), "bb" + std::to_string(i - 3), "control");
+        }
+    }
+    return graph;
+}
+
+static void BM_LibcCallgraph_Build(benchmark::State &state) {
+    for (auto _ : state) {
+        LibcCallgraph graph = buildChainGraph(state.range(0));
+        benchmark::DoNotOptimize(graph.num_edges());
+    }
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_LibcCallgraph_Copy(benchmark::State &state) {
+    LibcCallgraph graph = buildChainGraph(state.range(0));
+    for (auto _ : state) {
+        LibcCallgraph copy = graph;
+        benchmark::DoNotOptimize(copy.num_vertices());
+    }
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_LibcCallgraph_CopyAndModify(benchmark::State &state) {
+    LibcCallgraph graph = buildChainGraph(state.range(0));
+    for (auto _ : state) {
+        // A derived stage graph: a snapshot followed by its first change
+        LibcCallgraph copy = graph;
+        copy.add_vertex("exit");
+        benchmark::DoNotOptimize(copy.num_vertices());
+    }
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_LibcCallgraph_GetVertices(benchmark::State &state) {
+    LibcCallgraph graph = buildChainGraph(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(graph.get_vertices());
+    }
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_LibcCallgraph_ControlNeighbors(benchmark::State &state) {
+    LibcCallgraph graph = buildChainGraph(state.range(0));
+    std::vector<std::string_view> vertices = graph.get_vertices();
+    for (auto _ : state) {
+        for (const auto &vertex : vertices) {
+            benchmark::DoNotOptimize(graph.get_control_edge_neighbors(vertex));
+        }
+    }
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_LibcCallgraph_DumpDot(benchmark::State &state) {
+    LibcCallgraph graph = buildChainGraph(state.range(0));
+    SmallString<128> path;
+    sys::fs::createTemporaryFile("bench_graphgen", "dot", path);
+    for (auto _ : state) {
+        graph.dump_todot(path.str().str(), "bb0", "bb1");
+    }
+    sys::fs::remove(path);
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_LibcCallgraph_CombineVertex(benchmark::State &state) {
+    for (auto _ : state) {
+        state.PauseTiming();
+        LibcCallgraph graph = buildChainGraph(state.range(0));
+        state.ResumeTiming();
+        // Collapse the chain from its head, as the merge loops of the pass do
+        for (unsigned i = 1; i < state.range(0); i++) {
+            graph.combine_vertex("bb0", "bb" + std::to_string(i));
+        }
+    }
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_GraphSnapshot_Write(benchmark::State &state) {
+    LibcCallgraph graph = buildChainGraph(state.range(0));
+    SmallString<128> path;
+    sys::fs::createTemporaryFile("bench_graphgen", "snap", path);
+    for (auto _ : state) {
+        GraphSnapshot snapshot;
+        snapshot.add_graph("main", graph, "bb0", "bb1");
+        snapshot.write(path.str().str());
+    }
+    sys::fs::remove(path);
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_GraphSnapshot_Load(benchmark::State &state) {
+    GraphSnapshot snapshot;
+    snapshot.add_graph("main", buildChainGraph(state.range(0)), "bb0", "bb1");
+    SmallString<128> path;
+    sys::fs::createTemporaryFile("bench_graphgen", "snap", path);
+    snapshot.write(path.str().str());
+    for (auto _ : state) {
+        GraphSnapshot loaded;
+        loaded.read(path.str().str());
+        benchmark::DoNotOptimize(loaded.to_graph(loaded.graphs.front()));
+    }
+    sys::fs::remove(path);
+    state.SetComplexityN(state.range(0));
+}
+
+BENCHMARK(BM_LibcCallgraph_Build)->RangeMultiplier(4)->Range(64, 16 << 10)->Complexity();
+BENCHMARK(BM_LibcCallgraph_Copy)->RangeMultiplier(4)->Range(64, 16 << 10)->Complexity();
+BENCHMARK(BM_LibcCallgraph_CopyAndModify)->RangeMultiplier(4)->Range(64, 16 << 10)->Complexity();
+BENCHMARK(BM_LibcCallgraph_GetVertices)->RangeMultiplier(4)->Range(64, 16 << 10)->Complexity();
+BENCHMARK(BM_LibcCallgraph_ControlNeighbors)->RangeMultiplier(4)->Range(64, 4 << 10)->Complexity();
+BENCHMARK(BM_LibcCallgraph_DumpDot)->RangeMultiplier(4)->Range(64, 16 << 10)->Complexity();
+BENCHMARK(BM_LibcCallgraph_CombineVertex)->RangeMultiplier(4)->Range(64, 1 << 10)->Complexity()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_GraphSnapshot_Write)->RangeMultiplier(4)->Range(64, 16 << 10)->Complexity();
+BENCHMARK(BM_GraphSnapshot_Load)->RangeMultiplier(4)->Range(64, 16 << 10)->Complexity();
+
+/**
+ * @brief Point a string option of the pass at the given value, unless it was given on the command line
+ */
+static void setPassOption(StringRef name, const std::string &value) {
+    auto *opt = static_cast<cl::opt<std::string> *>(cl::getRegisteredOptions()[name]);
+    if (opt && opt->getNumOccurrences() == 0) {
+        opt->setValue(value);
+    }
+}
+
+int main(int argc, char **argv) {
+    benchmark::Initialize(&argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "LibcSandboxing graph generation benchmarks\n");
+
+    // Keep the DOT output of the pass out of the working directory
+    SmallString<128> outputDir;
+    sys::fs::createUniqueDirectory("bench_graphgen", outputDir);
+    setPassOption("cg-output-path", outputDir.str().str());
+    setPassOption("cg-lib-funcs-path", BenchLibcListing);
+
+    LibcNames = readLibcNames(BenchLibcListing);
+
+    // Stage following the snapshot, by the stage the snapshot was written after
+    if (!BenchSnapshot.empty()) {
+        static const PipelineStage nextStage[SNAPSHOT_COUNT] = {EXPAND_BB_GRAPH, CONVERT_TO_LIBC_GRAPH,
+                                                                COMBINE_LIBC_GRAPH, GENERATE_INMEMORY_GRAPH};
+        LibcCGSnapshot snapshot;
+        if (!LoadStageSnapshot(BenchSnapshot, snapshot)) {
+            errs() << "Failed to load the snapshot " << BenchSnapshot << "\n";
+            return 1;
+        }
+        ResetGraphState();
+        benchmark::RegisterBenchmark("BM_SnapshotStage", BM_SnapshotStage, nextStage[snapshot])
+            ->Unit(benchmark::kMillisecond);
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -25,6 +25,8 @@ function(setup_kernel_workspace_fn kernel_src_dir project_root_dir)
 
         COMMAND echo "Applying patches necessary for integration"
         COMMAND patch -p1 --ignore-whitespace < ${project_root_dir}/0001-Necessary-changes-to-include-module.patch
+        COMMAND patch -p1 --ignore-whitespace < ${project_root_dir}/0002-Attach-the-sandbox-graph-at-exec-from-an-ELF-note.patch
+        COMMAND patch -p1 --ignore-whitespace < ${project_root_dir}/0003-Per-thread-sandbox-cursors.patch
         COMMAND patch -p0 --ignore-whitespace < ${project_root_dir}/syscall-tbl_${PRJ_LINUX_VERSION}.patch
 
         COMMAND echo "Mapping necessary implementation directories/files"        
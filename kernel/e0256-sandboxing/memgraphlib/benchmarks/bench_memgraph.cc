@@ -0,0 +1,437 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include <memgraph.h>
+
+#include "../definitions.h"
+#include "../tests/test_utils.h"
+
+/* ------------------------------------------------------------------------- */
+/* --------------------------- GRAPH GENERATION ---------------------------- */
+/* ------------------------------------------------------------------------- */
+
+/* Libc ID space the synthetic edges are drawn from, in line with a glibc listing */
+#define BENCH_LIBC_ID_SPACE     (3000)
+/* Transitions timed together when sampling the latency distribution */
+#define LATENCY_BATCH           (32)
+/* Transitions replayed per benchmark iteration */
+#define TRACE_LENGTH            (4096)
+
+/**
+ * Layered synthetic automaton:
+ *  - state 0 is the entry, with `fanout` edges in to layer 1
+ *  - each of the `depth` layers is `width` states wide, every state having `fanout` edges to the next layer
+ *  - the last layer loops back to layer 1, so that walks of any length can be generated
+ */
+struct SyntheticGraph {
+    unsigned long fanout = 0;
+    unsigned long depth = 0;
+    unsigned long width = 0;
+    unsigned long num_nodes = 0;
+    unsigned long num_edges = 0;
+    std::vector<std::vector<unsigned long>> successors;
+    std::vector<std::vector<unsigned long>> libcalls;
+};
+
+static unsigned long layer_node(const SyntheticGraph &g, unsigned long layer, unsigned long idx) {
+    return 1 + ((layer - 1) % g.depth) * g.width + (idx % g.width);
+}
+
+static SyntheticGraph make_graph(unsigned long fanout, unsigned long depth, unsigned seed) {
+    SyntheticGraph g;
+    std::mt19937 rng(seed);
+    g.fanout = fanout;
+    g.depth = depth;
+    g.width = std::min(fanout, 4UL);
+    g.num_nodes = 1 + depth * g.width;
+    g.successors.resize(g.num_nodes);
+    g.libcalls.resize(g.num_nodes);
+
+    for (unsigned long node = 0; node < g.num_nodes; node++) {
+        unsigned long layer = (node == 0) ? 0 : 1 + (node - 1) / g.width;
+        // Distinct libc IDs on the outgoing edges of a state keep the automaton deterministic
+        std::vector<unsigned long> ids(BENCH_LIBC_ID_SPACE);
+        for (unsigned long i = 0; i < ids.size(); i++) ids[i] = i + 1;
+        std::shuffle(ids.begin(), ids.end(), rng);
+        for (unsigned long k = 0; k < fanout; k++) {
+            g.successors[node].push_back(layer_node(g, layer + 1, node + k));
+            g.libcalls[node].push_back(ids[k]);
+        }
+        g.num_edges += fanout;
+    }
+    return g;
+}
+
+/**
+ * Bytes taken by the graph in the pool, with all the nodes represented as lists
+ */
+static unsigned long graph_bytes(unsigned long num_nodes, unsigned long num_edges) {
+    return NODE_TABLE_OFFSET + num_nodes * (PROGSTATE_SIZE(0) + sizeof(unsigned int))
+            + num_edges * (PROGSTATE_SIZE(1) - PROGSTATE_SIZE(0));
+}
+
+static bool load_synthetic(const SyntheticGraph &g) {
+    if (graph_bytes(g.num_nodes, g.num_edges) > MEMORY_POOL_SIZE) {
+        return false;
+    }
+    initialize_graph(NULL, 0);
+    for (unsigned long node = 0; node < g.num_nodes; node++) {
+        alloc_node(node, g.fanout,
+                   const_cast<unsigned long *>(g.successors[node].data()),
+                   const_cast<unsigned long *>(g.libcalls[node].data()));
+    }
+    finalize_graph();
+    return verify_graph() == 1;
+}
+
+/**
+ * Record a trace by walking the graph from the entry state, picking edges at random
+ */
+static std::vector<unsigned long> record_walk(const SyntheticGraph &g, unsigned long length, unsigned seed) {
+    std::vector<unsigned long> trace;
+    std::mt19937 rng(seed);
+    unsigned long node = 0;
+    for (unsigned long i = 0; i < length; i++) {
+        unsigned long k = rng() % g.fanout;
+        trace.push_back(g.libcalls[node][k]);
+        node = g.successors[node][k];
+    }
+    return trace;
+}
+
+/* ------------------------------------------------------------------------- */
+/* ---------------------------- LATENCY SAMPLING --------------------------- */
+/* ------------------------------------------------------------------------- */
+
+struct LatencySamples {
+    std::vector<double> ns_per_op;
+
+    void report(benchmark::State &state) {
+        if (ns_per_op.empty()) {
+            return;
+        }
+        std::sort(ns_per_op.begin(), ns_per_op.end());
+        auto pct = [this](double p) {
+            return ns_per_op[std::min(ns_per_op.size() - 1, (size_t)(p * ns_per_op.size()))];
+        };
+        // Per-thread percentiles, averaged over the threads of the run
+        state.counters["p50_ns"] = benchmark::Counter(pct(0.50), benchmark::Counter::kAvgThreads);
+        state.counters["p99_ns"] = benchmark::Counter(pct(0.99), benchmark::Counter::kAvgThreads);
+        state.counters["p999_ns"] = benchmark::Counter(pct(0.999), benchmark::Counter::kAvgThreads);
+        state.counters["max_ns"] = benchmark::Counter(ns_per_op.back(), benchmark::Counter::kAvgThreads);
+    }
+};
+
+enum ReplayMode {
+    REPLAY_TRANSITION,              // transition_to_state() only
+    REPLAY_VALIDATE_AND_TRANSITION, // is_state_transition_valid() + transition_to_state(), as in sandbox_dummycall
+};
+
+/**
+ * Replay a trace from the entry state, sampling the latency per batch of transitions
+ * @return the number of transitions replayed
+ */
+static unsigned long replay(const std::vector<unsigned long> &trace, ReplayMode mode, LatencySamples &samples) {
+    unsigned long done = 0;
+    reset_progstate();
+    for (size_t i = 0; i < trace.size(); i += LATENCY_BATCH) {
+        size_t end = std::min(trace.size(), i + LATENCY_BATCH);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t j = i; j < end; j++) {
+            if (mode == REPLAY_VALIDATE_AND_TRANSITION) {
+                if (!is_state_transition_valid(trace[j])) {
+                    return done;
+                }
+            }
+            benchmark::DoNotOptimize(transition_to_state(trace[j]));
+            done++;
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        samples.ns_per_op.push_back(std::chrono::duration<double, std::nano>(elapsed).count() / (end - i));
+    }
+    return done;
+}
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------ SYNTHETIC GRAPH BENCHMARKS --------------------- */
+/* ------------------------------------------------------------------------- */
+
+static void BM_SyntheticReplay(benchmark::State &state, ReplayMode mode) {
+    static SyntheticGraph graph;
+    static bool loaded;
+    if (state.thread_index() == 0) {
+        graph = make_graph(state.range(0), state.range(1), 1);
+        loaded = load_synthetic(graph);
+    }
+    std::vector<unsigned long> trace = record_walk(make_graph(state.range(0), state.range(1), 1),
+                                                   TRACE_LENGTH, 100 + state.thread_index());
+    LatencySamples samples;
+    unsigned long transitions = 0;
+
+    for (auto _ : state) {
+        if (!loaded) {
+            state.SkipWithError("Graph does not fit in the memory pool");
+            break;
+        }
+        transitions += replay(trace, mode, samples);
+    }
+
+    state.SetItemsProcessed(transitions);
+    samples.report(state);
+    if (state.thread_index() == 0) {
+        state.counters["graph_bytes"] = get_graph_size();
+        state.counters["nodes"] = graph.num_nodes;
+        destroy_graph();
+    }
+}
+
+/**
+ * Lookup of a libc ID absent from the entry state: the full edge list of the state is scanned
+ */
+static void BM_IsStateTransitionValid_Miss(benchmark::State &state) {
+    SyntheticGraph graph = make_graph(state.range(0), 1, 1);
+    if (!load_synthetic(graph)) {
+        state.SkipWithError("Graph does not fit in the memory pool");
+        return;
+    }
+    reset_progstate();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(is_state_transition_valid(BENCH_LIBC_ID_SPACE + 1));
+    }
+    state.SetItemsProcessed(state.iterations());
+    destroy_graph();
+}
+
+/**
+ * Lookup in a single state with `edges` edges on half of 2 * `edges` consecutive libc IDs, with the state
+ * represented as a list or as a table: half of the lookups hit, at random. The crossover point of the two
+ * representations sets PROGSTATE_TABLE_MIN_EDGES.
+ */
+static void BM_NodeLookup(benchmark::State &state, int repr) {
+    unsigned long edges = state.range(0);
+    std::mt19937 rng(1);
+    std::vector<unsigned long> libcalls(2 * edges);
+    for (unsigned long i = 0; i < libcalls.size(); i++) libcalls[i] = i + 1;
+    std::shuffle(libcalls.begin(), libcalls.end(), rng);
+    std::vector<unsigned long> lookups(TRACE_LENGTH);
+    for (auto &libcall : lookups) libcall = libcalls[rng() % libcalls.size()];
+    libcalls.resize(edges);
+    std::vector<unsigned long> successors(edges, 1);
+
+    if (repr == PROGSTATE_REPR_TABLE) {
+        set_progstate_repr_policy(1, 2);
+    } else {
+        set_progstate_repr_policy(0, 0);
+    }
+    initialize_graph(NULL, 0);
+    struct abstract_progstate *node =
+        (struct abstract_progstate *)alloc_node(0, edges, successors.data(), libcalls.data());
+    alloc_node(1, 0, NULL, NULL);
+    finalize_graph();
+    set_progstate_repr_policy(PROGSTATE_TABLE_MIN_EDGES, PROGSTATE_TABLE_MAX_SPAN_RATIO);
+    if (node == NULL || node->repr != repr) {
+        state.SkipWithError("State not allocated with the requested representation");
+        destroy_graph();
+        return;
+    }
+    state.counters["node_bytes"] = PROGSTATE_NODE_SIZE(node);
+
+    reset_progstate();
+    for (auto _ : state) {
+        for (unsigned long libcall : lookups) {
+            benchmark::DoNotOptimize(is_state_transition_valid(libcall));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * lookups.size());
+    destroy_graph();
+}
+
+/**
+ * Check of random libc IDs against an allow-set of half of the libc ID space, as in sandbox_dummycall
+ */
+static void BM_IsLibcallAllowed(benchmark::State &state) {
+    std::mt19937 rng(1);
+    std::vector<unsigned long> libcalls, lookups(TRACE_LENGTH);
+    for (unsigned long i = 0; i < BENCH_LIBC_ID_SPACE; i += 2) libcalls.push_back(i);
+    for (auto &libcall : lookups) libcall = rng() % BENCH_LIBC_ID_SPACE;
+
+    initialize_graph(NULL, 0);
+    alloc_allowset(libcalls.size(), libcalls.data());
+    finalize_graph();
+    for (auto _ : state) {
+        for (unsigned long libcall : lookups) {
+            benchmark::DoNotOptimize(is_libcall_allowed(libcall));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * lookups.size());
+    state.counters["graph_bytes"] = get_graph_size();
+    destroy_graph();
+}
+
+/**
+ * Start-up cost of a policy: verification of the serialized graph, as done by sandbox_init
+ */
+static void BM_VerifyGraph(benchmark::State &state) {
+    SyntheticGraph graph = make_graph(state.range(0), state.range(1), 1);
+    if (!load_synthetic(graph)) {
+        state.SkipWithError("Graph does not fit in the memory pool");
+        return;
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(verify_graph());
+    }
+    state.SetBytesProcessed(state.iterations() * get_graph_size());
+    state.counters["graph_bytes"] = get_graph_size();
+    destroy_graph();
+}
+
+/**
+ * Graph shapes: {fan-out, depth}
+ */
+static void GraphShapes(benchmark::internal::Benchmark *b) {
+    b->ArgNames({"fanout", "depth"});
+    for (long fanout : {1, 4, 16, 64}) {
+        for (long depth : {4, 32, 256}) {
+            b->Args({fanout, depth});
+        }
+    }
+}
+
+BENCHMARK_CAPTURE(BM_SyntheticReplay, transition, REPLAY_TRANSITION)
+    ->Apply(GraphShapes)->Threads(1)->Threads(2)->Threads(4)->Threads(8)->UseRealTime();
+BENCHMARK_CAPTURE(BM_SyntheticReplay, validate_and_transition, REPLAY_VALIDATE_AND_TRANSITION)
+    ->Apply(GraphShapes)->Threads(1)->Threads(2)->Threads(4)->Threads(8)->UseRealTime();
+BENCHMARK(BM_IsStateTransitionValid_Miss)->RangeMultiplier(4)->Range(1, 1024);
+BENCHMARK_CAPTURE(BM_NodeLookup, list, PROGSTATE_REPR_LIST)->ArgName("edges")->RangeMultiplier(2)->Range(1, 4096);
+BENCHMARK_CAPTURE(BM_NodeLookup, table, PROGSTATE_REPR_TABLE)->ArgName("edges")->RangeMultiplier(2)->Range(1, 4096);
+BENCHMARK(BM_IsLibcallAllowed);
+BENCHMARK(BM_VerifyGraph)->Apply(GraphShapes);
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------ RECORDED TRACE BENCHMARKS ---------------------- */
+/* ------------------------------------------------------------------------- */
+
+/**
+ * Replays the accepted traces of a test data file (see tests/test_data) over its graph
+ */
+static void BM_RecordedReplay(benchmark::State &state, const std::string &filename) {
+    static std::vector<std::vector<unsigned long>> traces;
+    if (state.thread_index() == 0) {
+        traces.clear();
+        if (read_test_data(filename.c_str())) {
+            initialize_graph(NULL, 0);
+            for (unsigned long i = 0; i < tc_data_size; i++) {
+                alloc_node(i, tc_edge_listings[i].size(), &tc_edge_listings[i][0], &tc_libcall_listings[i][0]);
+            }
+            finalize_graph();
+            for (unsigned long i = 0; i < test_cases.size(); i++) {
+                if (test_cases_results[i]) {
+                    traces.push_back(test_cases[i]);
+                }
+            }
+        }
+    }
+    LatencySamples samples;
+    unsigned long transitions = 0;
+
+    for (auto _ : state) {
+        if (traces.empty()) {
+            state.SkipWithError("No accepted traces to replay");
+            break;
+        }
+        for (const auto &trace : traces) {
+            transitions += replay(trace, REPLAY_VALIDATE_AND_TRANSITION, samples);
+        }
+    }
+
+    state.SetItemsProcessed(transitions);
+    samples.report(state);
+    if (state.thread_index() == 0) {
+        destroy_graph();
+        cleanup_test_data();
+    }
+}
+
+/**
+ * Replays a trace file (whitespace separated libc IDs, one trace per line) over a graph stored by store_graph()
+ */
+static void BM_StoredGraphReplay(benchmark::State &state, const std::string &graphFile, const std::string &traceFile) {
+    static std::vector<std::vector<unsigned long>> traces;
+    if (state.thread_index() == 0) {
+        traces.clear();
+        load_graph(graphFile.c_str());
+        std::ifstream infile(traceFile);
+        std::string line;
+        while (std::getline(infile, line)) {
+            std::istringstream iss(line);
+            std::vector<unsigned long> trace;
+            unsigned long libcall;
+            while (iss >> libcall) {
+                trace.push_back(libcall);
+            }
+            if (!trace.empty()) {
+                traces.push_back(trace);
+            }
+        }
+    }
+    LatencySamples samples;
+    unsigned long transitions = 0;
+
+    for (auto _ : state) {
+        if (traces.empty()) {
+            state.SkipWithError("No traces to replay");
+            break;
+        }
+        for (const auto &trace : traces) {
+            transitions += replay(trace, REPLAY_VALIDATE_AND_TRANSITION, samples);
+        }
+    }
+
+    state.SetItemsProcessed(transitions);
+    samples.report(state);
+    if (state.thread_index() == 0) {
+        destroy_graph();
+    }
+}
+
+/**
+ * @example ./bench_memgraph --memgraph_graph=policy.graph --memgraph_trace=ltrace.ids
+ */
+int main(int argc, char **argv) {
+    std::string graphFile, traceFile;
+    std::vector<char *> args;
+    for (int i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "--memgraph_graph=", 17) == 0) {
+            graphFile = argv[i] + 17;
+        } else if (strncmp(argv[i], "--memgraph_trace=", 17) == 0) {
+            traceFile = argv[i] + 17;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    int nargs = args.size();
+
+    for (const char *testCase : {"tests/test_data/test-case-1.txt",
+                                 "tests/test_data/test-case-2.txt",
+                                 "tests/test_data/test-case-3.txt"}) {
+        benchmark::RegisterBenchmark((std::string("BM_RecordedReplay/") + testCase).c_str(),
+                                     BM_RecordedReplay, std::string(testCase))
+            ->Threads(1)->Threads(4)->UseRealTime();
+    }
+    if (!graphFile.empty() && !traceFile.empty()) {
+        benchmark::RegisterBenchmark("BM_StoredGraphReplay", BM_StoredGraphReplay, graphFile, traceFile)
+            ->Threads(1)->Threads(2)->Threads(4)->Threads(8)->UseRealTime();
+    }
+
+    benchmark::Initialize(&nargs, args.data());
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
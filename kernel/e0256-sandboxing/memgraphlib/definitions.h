@@ -4,7 +4,8 @@
 #define MEMORY_POOL_SIZE            (1024 * 1024)       // 1MB memory pool
 #define GRAPH_META_MAGIC_NUMBER     (0xDEADBEEF)        // Magic number for graph metadata
 
-#define NODE_TABLE_OFFSET           (sizeof(struct graph_metadata))
+#define NODE_TABLE_ALIGNMENT        (64)                // Node table starts on a cache line
+#define NODE_TABLE_OFFSET           ((sizeof(struct graph_metadata) + NODE_TABLE_ALIGNMENT - 1) & ~(NODE_TABLE_ALIGNMENT - 1))
 
 /**
  * Structure to represent the metadata of the graph.
@@ -21,10 +22,17 @@
  *              |  Node Table             | <!-- This will be used to store the nodes and edges -->
 *               |                         | 
  *              +-------------------------+
- *              |  Node Listings          | <!-- This will be used as a quick lookup table for nodes -->
+ *              |  Node Index             | <!-- Offset of each node in the pool, indexed by node ID -->
  *              |                         | <!-- Will be populated after graph is finalized -->
  *              +-------------------------+
  * 
+ *          The checksum (CRC32C) covers the first `used_size` bytes of the pool, with the checksum field as zero.
+ *
+ *          References within the graph are never addresses: the node index holds offsets from the start of the
+ *          pool and the edges hold node IDs. A copy of the graph is used as is wherever it is mapped.
+ *
+ *          A graph in POLICY_MODE_ALLOWSET has no nodes, its node table holds the allow-set bitmap instead
+ *          (bit N of the bitmap set if libc ID N may be called) and its node index is empty.
  * 
  */
 struct graph_metadata {
@@ -35,7 +43,9 @@ struct graph_metadata {
 
     unsigned char   graph_finalized;      // Flag to indicate if the graph is finalized
 
-    unsigned char   reserved0[15];        // Reserved for future use
+    unsigned char   policy_mode;          // Enforcement mode of the graph, POLICY_MODE_*
+    unsigned char   violation_mode;       // Handling of the libc calls not allowed, VIOLATION_MODE_*
+    unsigned char   reserved0[13];        // Reserved for future use
     unsigned char   reserved1[16];        // Reserved for future use
     
 
@@ -45,6 +55,11 @@ struct graph_metadata {
 
     unsigned long   nodes_table_offset;   // Offset to the nodes table
     unsigned long   nodes_table_size;     // Size of the nodes table
+
+    unsigned long   node_index_offset;    // Offset to the node index
+    unsigned long   node_index_size;      // Number of entries in the node index (highest node ID + 1)
+
+    unsigned long   used_size;            // Bytes of the memory pool in use, i.e. size of the serialized graph
 };
 
 /**
@@ -57,29 +72,60 @@ struct memory_pool {
     /** Node Table to represent graph/automaton **/
 };
 
-/* Magic numbers to ensure sanity of data being processed */
-#define NODE_MAGIC_NUMBER       (0xCAFEBABE)
-#define EDGE_MAGIC_NUMBER       (0xBAADF00D)
-
-/**
- * Structure to represent a library call (edges in the graph).
- */
-struct libcalls {
-    unsigned long magic;
-    unsigned long libcallid;
-    unsigned long next_progstate;
-};
-
 /**
  * Structure to represent a program state (Nodes in the graph).
+ * 
+ * @details The edges (library calls) of the node follow it, in one of two representations picked per node:
+ *          PROGSTATE_REPR_LIST, structure-of-arrays sorted on the libc ID:
+ *              unsigned int libcallid[num_libcalls];         <!-- Searched on every lookup -->
+ *              unsigned int next_progstate[num_libcalls];    <!-- Read only for the matching edge -->
+ *          A node with up to 7 edges thus takes no more than a cache line.
+ *
+ *          PROGSTATE_REPR_TABLE, direct-indexed on the libc ID, for nodes whose edges cover a dense range of IDs:
+ *              unsigned int table_base;                      <!-- Libc ID of the first entry -->
+ *              unsigned int next_progstate[num_libcalls];    <!-- PROGSTATE_TABLE_NONE for IDs without an edge -->
  */
 struct abstract_progstate{
-    unsigned long magic;
-    unsigned long id;
-    unsigned long num_libcalls;
+    unsigned int    id;
+    unsigned short  num_libcalls;       // Number of edges (list) or of entries (table)
+    unsigned char   repr;               // Representation of the edges, PROGSTATE_REPR_*
+    unsigned char   reserved;
 };
 
-#define DEFAULT_NUMBER_OF_NODESLISTINGS  (4*1024)
+#define PROGSTATE_REPR_LIST             (0)
+#define PROGSTATE_REPR_TABLE            (1)
+/* Bounded by the 16 bit count, well above what fits in MEMORY_POOL_SIZE for a list */
+#define PROGSTATE_MAX_ENTRIES           (0xFFFF)
+/* Table entry of a libc ID without an edge */
+#define PROGSTATE_TABLE_NONE            (0xFFFFFFFF)
+
+/* Selection of the representation: a table for nodes with at least PROGSTATE_TABLE_MIN_EDGES edges,
+   whose libc IDs span no more than PROGSTATE_TABLE_MAX_SPAN_RATIO times the number of edges, i.e. no
+   larger than the list. The table is faster from 4 edges on, see BM_NodeLookup. */
+#define PROGSTATE_TABLE_MIN_EDGES       (4)
+#define PROGSTATE_TABLE_MAX_SPAN_RATIO  (2)
+
+/* Lists longer than this are binary searched down to this many edges, then scanned */
+#define PROGSTATE_LIST_SCAN_MAX         (16)
+
+#define PROGSTATE_SIZE(num_libcalls)        (sizeof(struct abstract_progstate) + 2 * (num_libcalls) * sizeof(unsigned int))
+#define PROGSTATE_LIBCALLS(node)            ((unsigned int *)((char *)(node) + sizeof(struct abstract_progstate)))
+#define PROGSTATE_NEXT_STATES(node)         (PROGSTATE_LIBCALLS(node) + (node)->num_libcalls)
+
+#define PROGSTATE_TABLE_SIZE(num_entries)   (sizeof(struct abstract_progstate) + (1 + (num_entries)) * sizeof(unsigned int))
+#define PROGSTATE_TABLE_BASE(node)          (PROGSTATE_LIBCALLS(node)[0])
+#define PROGSTATE_TABLE(node)               (PROGSTATE_LIBCALLS(node) + 1)
+
+#define PROGSTATE_NODE_SIZE(node)           (((node)->repr == PROGSTATE_REPR_TABLE) ? \
+                                                PROGSTATE_TABLE_SIZE((unsigned long)(node)->num_libcalls) : \
+                                                PROGSTATE_SIZE((unsigned long)(node)->num_libcalls))
+
+/* Allow-set bitmap, in words of unsigned long */
+#define ALLOWSET_WORD_BITS              (8 * sizeof(unsigned long))
+#define ALLOWSET_SIZE(num_bits)         ((((num_bits) + ALLOWSET_WORD_BITS - 1) / ALLOWSET_WORD_BITS) * sizeof(unsigned long))
+
+/* Node index entry of a node ID not present in the graph */
+#define NODE_INDEX_NONE             (0)
 
 
 #endif // __DEFINITIONS_H_INCLUDED__
@@ -6,7 +6,73 @@ extern "C" {
 #endif // __cplusplus
 
 /* Constants */
-#define MEMPOOL_VERSION     (0x00000001)    // Version of the memory pool library
+#define MEMPOOL_VERSION     (0x00000004)    // Version of the memory pool library, gates the graph format
+
+/* Policy modes */
+#define POLICY_MODE_AUTOMATON   (0)         // Libc calls checked against the automaton, in order
+#define POLICY_MODE_ALLOWSET    (1)         // Libc calls checked against the set of reachable libc IDs only
+#define POLICY_MODE_PUSHDOWN    (2)         // Automaton of each function, calls and returns tracked on a call string
+
+/* Violation modes, the handling of a libc call not allowed by the graph */
+#define VIOLATION_MODE_ENFORCE  (0)         // Process killed
+#define VIOLATION_MODE_AUDIT    (1)         // Logged, the process continues from a recovery state
+#define VIOLATION_MODE_LEARN    (2)         // Recorded for the policy to be extended, continues as on audit
+
+/* Reserved libc IDs, on the edges of POLICY_MODE_PUSHDOWN */
+#define LIBCALL_RESERVED        (0xFFFFFFF0)
+#define LIBCALL_CALL            (0xFFFFFFF0)    // Call, to the entry state of the callee
+#define LIBCALL_CALL_RETURN     (0xFFFFFFF1)    // State returned to from the callee, one for each LIBCALL_CALL edge
+#define LIBCALL_RETURN          (0xFFFFFFF2)    // Return, from an exit state to a caller once the call string is exhausted
+
+/* ELF note of a sandboxed executable, its descriptor is the graph, attached by the kernel at exec */
+#define SANDBOX_NOTE_SECTION    ".note.sandbox"
+#define SANDBOX_NOTE_NAME       "LibcSandbox"   // 12 bytes, the descriptor is 8-byte aligned after the 12-byte header
+#define SANDBOX_NOTE_TYPE       (0x584F4253)    // "SBOX"
+
+/* Calls tracked on the call string of POLICY_MODE_PUSHDOWN, the outermost calls are dropped beyond */
+#define CALL_STRING_MAX         (8)
+
+/**
+ * Call string of POLICY_MODE_PUSHDOWN: the states to return to, of the innermost CALL_STRING_MAX calls
+ */
+struct call_string {
+    unsigned int    return_progstate[CALL_STRING_MAX];
+    unsigned int    top;                // Slot of the innermost call
+    unsigned int    depth;              // Calls in the string, the outermost are dropped beyond CALL_STRING_MAX
+};
+
+/* Configurations tracked at once in POLICY_MODE_PUSHDOWN, the ones reached beyond are dropped */
+#define PUSHDOWN_CONFIGS_MAX    (16)
+
+/**
+ * Configuration of POLICY_MODE_PUSHDOWN: a state, with the calls made to reach it
+ */
+struct pushdown_config {
+    unsigned int        progstate;
+    struct call_string  calls;
+};
+
+/**
+ * Cursor of a thread over a (shared, read-only) graph, each thread moves its own
+ */
+struct progstate_cursor {
+    void                    *graph;         // Graph walked by the cursor
+    unsigned long           progstate;      // ID of the current state, of the first configuration in POLICY_MODE_PUSHDOWN
+    char                    *node;          // Node of the current state, NULL if the state is not in the graph
+    unsigned int            num_configs;    // Configurations reachable after the libc calls so far, in POLICY_MODE_PUSHDOWN
+    struct pushdown_config  configs[PUSHDOWN_CONFIGS_MAX];
+};
+
+/* Commands of the sandbox_ctl system call, on the violation handling of the calling process */
+#define SANDBOX_CTL_GET_MODE    (0)         // Returns the violation mode
+#define SANDBOX_CTL_SET_MODE    (1)         // Sets the violation mode, a less strict mode needs CAP_SYS_ADMIN
+#define SANDBOX_CTL_DRAIN       (2)         // Moves up to `arg` learnt records to the buffer, returns their count
+
+/* Libc call not allowed from a state, recorded in VIOLATION_MODE_LEARN */
+struct sandbox_learn_record {
+    unsigned long   progstate;
+    unsigned long   libcall;
+};
 
 /* Error codes */
 #define ERROR_INVALID_GRAPH (-1)
@@ -18,21 +84,38 @@ extern "C" {
 /* Library APIs */
 
 void initialize_graph(void *data, unsigned long size);
+int attach_graph(void *data, unsigned long size);
 void destroy_graph(void);
 void *get_graph(void);
+unsigned long get_graph_size(void);
+int get_policy_mode(void);
+int get_violation_mode(void);
+int get_graph_violation_mode(void *graph);
 
 #ifndef __KERNEL__
 void store_graph(const char *filename);
 void load_graph(const char *filename);
+int map_graph(const char *filename);
 void *alloc_node(unsigned long id, int num_successors, unsigned long *successor_node_list, unsigned long *libcall_list);
+void *alloc_allowset(int num_libcalls, unsigned long *libcall_list);
 void finalize_graph(void);
+void set_progstate_repr_policy(unsigned long min_edges, unsigned long max_span_ratio);
+int set_violation_mode(int mode);
 #endif // __KERNEL__
 int verify_graph(void);
+int verify_graph_buffer(void *data, unsigned long size);
 
 void reset_progstate(void);
 int is_state_transition_valid (unsigned long libccall);
 int transition_to_state(unsigned long libccall);
 
+void attach_progstate_cursor(struct progstate_cursor *cursor, void *graph);
+void reset_progstate_cursor(struct progstate_cursor *cursor);
+int is_cursor_transition_valid(struct progstate_cursor *cursor, unsigned long libccall);
+int cursor_transition_to_state(struct progstate_cursor *cursor, unsigned long libccall);
+int cursor_resync_to_state(struct progstate_cursor *cursor, unsigned long libccall);
+int is_libcall_allowed(unsigned long libccall);
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
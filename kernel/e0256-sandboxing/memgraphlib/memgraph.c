@@ -10,12 +10,22 @@
 #include <linux/slab.h>
 #include <linux/printk.h>
 #include <linux/string.h>
+#include <linux/stddef.h>
+#include <linux/crc32c.h>
 
 #else
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif // __x86_64__
 
 #endif // __KERNEL__
 
@@ -26,19 +36,132 @@
 /* Module level variables */
 static struct memory_pool       *pool = NULL;
 static char                     *pool_edge = NULL;
+static int                       pool_attached = 0;     // Pool is the caller's buffer, see attach_graph
+#ifndef __KERNEL__
+static unsigned long             pool_mapped_size = 0;  // Pool is a read-only mapping of a file, see map_graph
+static unsigned char            *pool_node_checks = NULL;   // NODE_CHECK_* of each node index entry, see map_graph
+#endif // __KERNEL__
+
+static int verify_pool_layout(struct memory_pool *graph);
+
+/* Lazy verification state of a node of a mapped graph */
+#define NODE_CHECK_PENDING          (0)
+#define NODE_CHECK_VALID            (1)
+#define NODE_CHECK_INVALID          (2)
+
+/* ========================== START: Checksum  ================================ */
+/*  CRC32C (Castagnoli), the kernel and SSE4.2 implementations are hardware     */
+/*  accelerated, with a nibble table fallback in user-space                     */
+/* ============================================================================ */
+
+#ifdef __KERNEL__
+
+#define crc32c_update(crc, data, size)      crc32c(crc, data, size)
+
+#else
+
+static const unsigned int crc32c_nibble_table[16] = {
+    0x00000000, 0x105ec76f, 0x20bd8ede, 0x30e349b1, 0x417b1dbc, 0x5125dad3, 0x61c69362, 0x7198540d,
+    0x82f63b78, 0x92a8fc17, 0xa24bb5a6, 0xb21572c9, 0xc38d26c4, 0xd3d3e1ab, 0xe330a81a, 0xf36e6f75,
+};
+
+static unsigned int crc32c_update_sw(unsigned int crc, const unsigned char *data, unsigned long size) {
+    for (unsigned long i = 0; i < size; i++) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ crc32c_nibble_table[crc & 0x0F];
+        crc = (crc >> 4) ^ crc32c_nibble_table[crc & 0x0F];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_update_sse42(unsigned int crc, const unsigned char *data, unsigned long size) {
+    unsigned long long crc64 = crc;
+    for (; size >= sizeof(unsigned long long); size -= sizeof(unsigned long long)) {
+        unsigned long long word;
+        MEMCPY(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += sizeof(word);
+    }
+    crc = (unsigned int)crc64;
+    for (; size > 0; size--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif // __x86_64__
+
+/**
+ * Update a CRC32C (without the pre/post inversion), same as crc32c() of the kernel
+ */
+static unsigned int crc32c_update(unsigned int crc, const void *data, unsigned long size) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc32c_update_sse42(crc, (const unsigned char *)data, size);
+    }
+#endif // __x86_64__
+    return crc32c_update_sw(crc, (const unsigned char *)data, size);
+}
+
+#endif // __KERNEL__
+
+/**
+ * This function will calculate the checksum of the graph header, i.e. the bytes before the node table.
+ * @return unsigned int: Running CRC32C, taking the checksum field as zero.
+ */
+static unsigned int graph_checksum_header(const struct memory_pool *graph) {
+    const unsigned long zero = 0;
+    const unsigned long skip = offsetof(struct graph_metadata, checksum) + sizeof(graph->metadata.checksum);
+    unsigned int crc = 0xFFFFFFFF;
+
+    crc = crc32c_update(crc, graph, offsetof(struct graph_metadata, checksum));
+    crc = crc32c_update(crc, &zero, sizeof(zero));
+    crc = crc32c_update(crc, ((const char *)graph) + skip, graph->metadata.nodes_table_offset - skip);
+    return crc;
+}
 
-static struct abstract_progstate **nodes = NULL;
 #ifndef __KERNEL__
-static unsigned long num_nodes_listings = 0;
+/**
+ * This function will calculate the checksum of the graph in the memory pool.
+ * @return unsigned long: CRC32C of the first `used_size` bytes, taking the checksum field as zero.
+ */
+static unsigned long graph_checksum(void) {
+    unsigned int crc = graph_checksum_header(pool);
+    crc = crc32c_update(crc, ((const char *)pool) + pool->metadata.nodes_table_offset,
+                        pool->metadata.used_size - pool->metadata.nodes_table_offset);
+    return crc ^ 0xFFFFFFFF;
+}
 #endif // __KERNEL__
 
+/* ============================================================================ */
+/* ========================== END: Checksum  ================================== */
+/* ============================================================================ */
+
 /* ========================== START: Pool Allocator  ========================== */
 /*  This section is intended for both kernel and user utilization               */
 /* ============================================================================ */
 
+/**
+ * This function will reset the metadata of the memory pool to an empty graph.
+ */
+static void reset_pool(void) {
+    MEMSET(pool, 0, NODE_TABLE_OFFSET);
+    pool_edge = ((char*)pool) + NODE_TABLE_OFFSET;
+
+    pool->metadata.total_size            = MEMORY_POOL_SIZE;
+    pool->metadata.version               = MEMPOOL_VERSION;
+    pool->metadata.magic                 = GRAPH_META_MAGIC_NUMBER;
+    pool->metadata.policy_mode           = POLICY_MODE_AUTOMATON;
+    pool->metadata.violation_mode        = VIOLATION_MODE_ENFORCE;
+    pool->metadata.nodes_table_offset    = NODE_TABLE_OFFSET;
+    pool->metadata.num_nodes             = 0;
+    pool->metadata.used_size             = NODE_TABLE_OFFSET;
+}
+
 /**
  * This function will create a memory pool.
- * 
+ *
  * @note: The memory pool will be created only once.
  */
 static void create_pool(void) {
@@ -47,24 +170,26 @@ static void create_pool(void) {
         PRINT_ERROR_AND_EXIT("Failed to allocate memory for memory pool");
     }
 
-    pool_edge = ((char*)pool) + NODE_TABLE_OFFSET;
-    MEMSET(pool, 0, MEMORY_POOL_SIZE);
-
-    pool->metadata.total_size            = MEMORY_POOL_SIZE;
-    pool->metadata.version               = MEMPOOL_VERSION;
-    pool->metadata.magic                 = GRAPH_META_MAGIC_NUMBER;    
-    pool->metadata.nodes_table_offset    = NODE_TABLE_OFFSET;
-    pool->metadata.num_nodes             = 0;
+    reset_pool();
 }
 
 /**
  * This function will destroy the memory pool.
  */
 static void destroy_pool(void) {
-    if (pool) {
+    if (pool && !pool_attached) {
         FREE(pool);
-        pool = NULL;
     }
+#ifndef __KERNEL__
+    if (pool && pool_mapped_size) {
+        munmap(pool, pool_mapped_size);
+    }
+    FREE(pool_node_checks);
+    pool_node_checks = NULL;
+    pool_mapped_size = 0;
+#endif // __KERNEL__
+    pool = NULL;
+    pool_attached = 0;
 }
 
 /**
@@ -75,39 +200,89 @@ void *get_graph(void) {
     return (void *)pool;
 }
 
+/**
+ * This function will return the size of the serialized graph.
+ * @return unsigned long: Bytes of the memory pool to be stored/embedded, 0 if not initialized.
+ */
+unsigned long get_graph_size(void) {
+    return pool ? pool->metadata.used_size : 0;
+}
+
+/**
+ * This function will return the policy mode of the graph.
+ * @return int: POLICY_MODE_AUTOMATON, POLICY_MODE_ALLOWSET or POLICY_MODE_PUSHDOWN, ERROR_INVALID_GRAPH if not initialized.
+ */
+int get_policy_mode(void) {
+    return pool ? pool->metadata.policy_mode : ERROR_INVALID_GRAPH;
+}
+
+/**
+ * This function will return the violation mode of the given graph.
+ * @return int: VIOLATION_MODE_ENFORCE, VIOLATION_MODE_AUDIT or VIOLATION_MODE_LEARN, ERROR_INVALID_GRAPH if NULL.
+ */
+int get_graph_violation_mode(void *graph) {
+    return graph ? ((struct memory_pool *)graph)->metadata.violation_mode : ERROR_INVALID_GRAPH;
+}
+
+int get_violation_mode(void) {
+    return get_graph_violation_mode(pool);
+}
+
 /**
  * To initialize the graph in the memory pool from a buffer
  */
 void initialize_graph(void *data, unsigned long size) {
-    if (pool == NULL) {
+    if (pool == NULL || pool_attached) {
+        destroy_pool();
         create_pool();
     }
 
-    // Copy the data to the memory pool
-    MEMSET(pool, 0, size);
     if (size > MEMORY_POOL_SIZE) {
         PRINT_ERROR_AND_EXIT("Data size exceeds memory pool size");
     } else if ((data != NULL) && (size > 0)) {
         MEMCPY(pool, data, size);
 
-        if (verify_graph() != 1) {
+        if (size < sizeof(struct graph_metadata) || size < pool->metadata.used_size) {
+            reset_pool();
+            PRINT_ERROR_AND_EXIT("Failed to initialize graph, buffer smaller than the graph.");
+        } else if (verify_graph() != 1) {
+            reset_pool();
             PRINT_ERROR_AND_EXIT("Failed to initialize graph, verification failed.");
         } else {
             PRINT_INFO("Graph initialized from buffer and verified.\n");
         }
     } else {
-        nodes = NULL;
+        reset_pool();
     }
 
     PRINT_DEBUG("Graph initialized.\n");
 }
 
-void destroy_graph(void) {
+/**
+ * To use the graph in a buffer in place, without copying it in to a memory pool
+ * @return int: 1 if the graph is verified and attached, error code otherwise (with no graph attached)
+ *
+ * @note: The buffer is only read, it must stay mapped and unchanged until destroy_graph, which does not free it.
+ * @note: The verification is the only pass over the graph.
+ */
+int attach_graph(void *data, unsigned long size) {
     destroy_pool();
-    if (nodes) {
-        FREE(nodes);
-        nodes = NULL;
+
+    int ret = verify_graph_buffer(data, size);
+    if (ret != 1) {
+        PRINT_ERROR("Failed to attach graph, verification failed.");
+        return ret;
     }
+
+    pool = (struct memory_pool *)data;
+    pool_attached = 1;
+
+    PRINT_DEBUG("Graph attached from buffer and verified.\n");
+    return 1;
+}
+
+void destroy_graph(void) {
+    destroy_pool();
 }
 
 
@@ -115,57 +290,127 @@ void destroy_graph(void) {
 /**
  * This function will dump the graph to a file.
  * @param filename: The name of the file to which the graph will be dumped.
- * 
- * @note: The file will be overwritten if it already exists.
- * @note: The graph will be dumped in binary format.
+ *
+ * @note: The file will be replaced if it already exists. The graph is written to a temporary file in the same
+ *        directory and renamed over it, so readers (and mappings, see map_graph) see either graph in full.
+ * @note: The graph will be dumped in binary format, only the `used_size` bytes of the pool are written.
  * @note: The graph can be loaded back using the load_graph function.
  * @note: Essentially a serialization routine.
- * 
+ *
  */
 void store_graph(const char *filename) {
-    FILE *file = fopen(filename, "wb");
+    static const char suffix[] = ".XXXXXX";
+    size_t length = strlen(filename);
+    char *tmpname = (char *)MALLOC(length + sizeof(suffix));
+    if (!tmpname) {
+        PRINT_ERROR_AND_EXIT("Failed to allocate the temporary file name");
+    }
+    MEMCPY(tmpname, filename, length);
+    MEMCPY(tmpname + length, suffix, sizeof(suffix));
+
+    int fd = mkstemp(tmpname);
+    FILE *file = (fd < 0) ? NULL : fdopen(fd, "wb");
     if (!file) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmpname);
+        }
+        FREE(tmpname);
         PRINT_ERROR_AND_EXIT("Failed to open file for writing");
     }
 
-    size_t written = fwrite(pool, 1, MEMORY_POOL_SIZE, file);
-    if (written != MEMORY_POOL_SIZE) {
-        fclose(file);
+    // mkstemp creates the file private to the owner, a graph is readable by all
+    size_t written = fwrite(pool, 1, pool->metadata.used_size, file);
+    int failed = (written != pool->metadata.used_size) || fchmod(fd, 0644) != 0 ||
+                 fflush(file) != 0 || fsync(fd) != 0;
+    failed = (fclose(file) != 0) || failed;
+    if (failed || rename(tmpname, filename) != 0) {
+        unlink(tmpname);
+        FREE(tmpname);
         PRINT_ERROR_AND_EXIT("Failed to write memory pool to file");
     }
 
-    fclose(file);
+    FREE(tmpname);
     PRINT_DEBUG("Graph stored to file %s\n", filename);
 }
 
 /**
- * This function will load the graph from a file.
- * @param filename: The name of the file from which the graph will be loaded.
- * 
- * @note: The file should be in the same format as dumped by the store_graph function.
- * @note: Essentially a deserialization routine.
- * 
+ * Maps the graph of a file in place, read-only, verifying only its header
+ * @param lazy: Whether the nodes are to be verified on their first lookup, else the caller verifies the graph.
  */
-void load_graph(const char *filename) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        PRINT_ERROR_AND_EXIT("Failed to open file for reading");
+static int map_graph_file(const char *filename, int lazy) {
+    destroy_pool();
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        PRINT_ERROR("Failed to open file %s for reading", filename);
+        return ERROR_INVALID_ARG;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct graph_metadata) || st.st_size > MEMORY_POOL_SIZE) {
+        close(fd);
+        PRINT_ERROR("Invalid graph file %s", filename);
+        return ERROR_INVALID_GRAPH;
+    }
+    struct memory_pool *graph = (struct memory_pool *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (graph == MAP_FAILED) {
+        PRINT_ERROR("Failed to map file %s", filename);
+        return ERROR_INVALID_GRAPH;
     }
 
-    // reinitialize the pool
-    if (pool == NULL) {
-        create_pool();
+    int ret = ((unsigned long)st.st_size < graph->metadata.used_size) ? ERROR_INVALID_GRAPH : verify_pool_layout(graph);
+    unsigned char *checks = NULL;
+    if (ret == 1 && lazy && graph->metadata.node_index_size > 0) {
+        checks = (unsigned char *)calloc(graph->metadata.node_index_size, sizeof(*checks));
+        ret = checks ? 1 : ERROR_INVALID_STATE;
+    }
+    if (ret != 1) {
+        munmap(graph, st.st_size);
+        PRINT_ERROR("Failed to map graph from file %s", filename);
+        return ret;
     }
 
-    size_t read = fread(pool, 1, MEMORY_POOL_SIZE, file);
-    if (read != MEMORY_POOL_SIZE) {
-        fclose(file);
-        PRINT_ERROR_AND_EXIT("Failed to read memory pool from file. Bytes read = %lu", read);
+    pool = graph;
+    pool_attached = 1;
+    pool_mapped_size = st.st_size;
+    pool_node_checks = checks;
+    return 1;
+}
+
+/**
+ * This function will map the graph of a file in place, read-only, verifying only its header.
+ * @param filename: The name of the file from which the graph will be mapped.
+ * @return int: 1 if the graph is mapped, error code otherwise (with no graph initialized).
+ *
+ * @note: The file should be in the same format as dumped by the store_graph function.
+ * @note: Each node is verified on its first lookup, a node failing the verification is taken as absent from the
+ *        graph. The checksum is only checked by verify_graph, which verifies the whole graph at once.
+ * @note: Mapping costs the same whatever the size of the graph, for tools opening many of them.
+ *
+ */
+int map_graph(const char *filename) {
+    return map_graph_file(filename, 1);
+}
+
+/**
+ * This function will load the graph from a file, and verify it in full.
+ * @param filename: The name of the file from which the graph will be loaded.
+ *
+ * @note: The file should be in the same format as dumped by the store_graph function.
+ * @note: The graph is mapped read-only (see map_graph), it is not copied in to a memory pool. The node index is
+ *        part of the graph, so loading allocates nothing and fixes up no pointers.
+ * @note: Essentially a deserialization routine.
+ *
+ */
+void load_graph(const char *filename) {
+    if (map_graph_file(filename, 0) != 1) {
+        PRINT_ERROR_AND_EXIT("Failed to read memory pool from file %s", filename);
     }
 
-    fclose(file);
     PRINT_DEBUG("Graph loaded from file %s, verifying it\n", filename);
     if(verify_graph() != 1) {
+        destroy_pool();
         PRINT_ERROR_AND_EXIT("Failed to load graph, verification failed.");
     }
 }
@@ -183,63 +428,234 @@ void load_graph(const char *filename) {
 /* ============================================================================ */
 
 #ifndef __KERNEL__
+static unsigned long table_min_edges = PROGSTATE_TABLE_MIN_EDGES;
+static unsigned long table_max_span_ratio = PROGSTATE_TABLE_MAX_SPAN_RATIO;
+
+/**
+ * This function will set the heuristic picking the representation of the nodes allocated afterwards.
+ * @param min_edges: Nodes with fewer edges are kept as a list.
+ * @param max_span_ratio: Nodes whose libc IDs span more than this many times their edges are kept as a list.
+ *
+ * @note: The defaults are PROGSTATE_TABLE_MIN_EDGES and PROGSTATE_TABLE_MAX_SPAN_RATIO, 0 as min_edges
+ *        disables the tables.
+ */
+void set_progstate_repr_policy(unsigned long min_edges, unsigned long max_span_ratio) {
+    table_min_edges = min_edges ? min_edges : (unsigned long)-1;
+    table_max_span_ratio = max_span_ratio;
+}
+
+/**
+ * This function will set the violation mode of the graph, the mode the process starts with.
+ * @return int: 1 on success, ERROR_INVALID_ARG for an unknown mode, ERROR_INVALID_STATE once finalized.
+ */
+int set_violation_mode(int mode) {
+    if (pool == NULL || pool->metadata.graph_finalized) {
+        PRINT_ERROR("Graph not initialized, or already finalized");
+        return ERROR_INVALID_STATE;
+    }
+    if (mode != VIOLATION_MODE_ENFORCE && mode != VIOLATION_MODE_AUDIT && mode != VIOLATION_MODE_LEARN) {
+        PRINT_ERROR("Unknown violation mode %d", mode);
+        return ERROR_INVALID_ARG;
+    }
+    pool->metadata.violation_mode = mode;
+    return 1;
+}
+
 /**
  * This function will allocate memory for a new node in the memory pool.
- * @param num_predecessors: The number of predecessors of the node.
- * @return struct abstract_progstate*: The pointer to the newly allocated node.
- * 
+ * @param id: ID of the node, the entry node of the graph is expected to be 0.
+ * @param num_successors: The number of successors (edges) of the node.
+ * @return struct abstract_progstate*: The pointer to the newly allocated node, NULL if the pool is exhausted.
+ *
  * @note: The memory will be allocated from the memory pool.
- * 
+ * @note: IDs are expected to be dense, the node index has an entry for each ID up to the highest one.
+ * @note: The representation of the edges is picked here, as it sizes the node. On a libc ID with several
+ *        edges the first one wins, as in the order of the given list.
+ * @note: Edges on the LIBCALL_CALL, LIBCALL_CALL_RETURN and LIBCALL_RETURN IDs switch the graph to
+ *        POLICY_MODE_PUSHDOWN, and keep the node a list, the representation the pushdown search reads.
+ * @note: IDs that do not fit the 32 bit fields of the node, and the other reserved libc IDs, are rejected.
+ *
  */
 void *alloc_node(unsigned long id, int num_successors, unsigned long *successor_node_list, unsigned long *libcall_list) {
-    struct abstract_progstate *node = (struct abstract_progstate *)pool_edge;
-    pool_edge += sizeof(struct abstract_progstate);
+    if (pool == NULL || pool_attached) {
+        PRINT_ERROR("Graph not initialized, or read-only, failed to allocate node %lu", id);
+        return NULL;
+    }
+    if (pool->metadata.policy_mode == POLICY_MODE_ALLOWSET) {
+        PRINT_ERROR("Graph holds an allow-set, failed to allocate node %lu", id);
+        return NULL;
+    }
+    if (num_successors < 0 || num_successors > PROGSTATE_MAX_ENTRIES) {
+        PRINT_ERROR("Invalid number of edges %d, failed to allocate node %lu", num_successors, id);
+        return NULL;
+    }
 
-    // Check if we need to allocate more memory for the node listings
-    if (nodes == NULL) {
-        nodes = (struct abstract_progstate **)MALLOC(sizeof(struct abstract_progstate *) * DEFAULT_NUMBER_OF_NODESLISTINGS);
-    } else if (pool->metadata.num_nodes >= num_nodes_listings) {
-        num_nodes_listings += DEFAULT_NUMBER_OF_NODESLISTINGS;
-        nodes = (struct abstract_progstate **)REALLOC(nodes, sizeof(struct abstract_progstate *) * num_nodes_listings);
+    // IDs are stored in 32 bits, the all-ones value marks an entry of a table without an edge
+    if (id >= PROGSTATE_TABLE_NONE) {
+        PRINT_ERROR("Node ID %lu out of range, failed to allocate the node", id);
+        return NULL;
+    }
+    for (int i = 0; i < num_successors; i++) {
+        if (successor_node_list[i] >= PROGSTATE_TABLE_NONE) {
+            PRINT_ERROR("Next state %lu out of range, failed to allocate node %lu", successor_node_list[i], id);
+            return NULL;
+        }
+        if (libcall_list[i] >= LIBCALL_RESERVED && (libcall_list[i] < LIBCALL_CALL || libcall_list[i] > LIBCALL_RETURN)) {
+            PRINT_ERROR("Libc ID %lu out of range, failed to allocate node %lu", libcall_list[i], id);
+            return NULL;
+        }
     }
 
+    unsigned long lowest = (unsigned long)-1, highest = 0, span = 0;
+    for (int i = 0; i < num_successors; i++) {
+        if (libcall_list[i] >= LIBCALL_CALL && libcall_list[i] <= LIBCALL_RETURN) {
+            pool->metadata.policy_mode = POLICY_MODE_PUSHDOWN;
+        }
+        lowest = (libcall_list[i] < lowest) ? libcall_list[i] : lowest;
+        highest = (libcall_list[i] > highest) ? libcall_list[i] : highest;
+    }
+    if (num_successors > 0) {
+        span = highest - lowest + 1;
+    }
+
+    int use_table = (highest < LIBCALL_RESERVED) && ((unsigned long)num_successors >= table_min_edges) &&
+                    (span <= PROGSTATE_MAX_ENTRIES) && (span <= table_max_span_ratio * num_successors);
+    unsigned long size = use_table ? PROGSTATE_TABLE_SIZE(span) : PROGSTATE_SIZE(num_successors);
+    if ((pool_edge + size) > (((char*)pool) + MEMORY_POOL_SIZE)) {
+        PRINT_ERROR("Memory pool exhausted, failed to allocate node %lu", id);
+        return NULL;
+    }
+
+    struct abstract_progstate *node = (struct abstract_progstate *)pool_edge;
+    pool_edge += size;
+
     // Initialize the node
-    node->magic = NODE_MAGIC_NUMBER;
     node->id = id;
-    node->num_libcalls = num_successors;
+    node->reserved = 0;
 
-    // Add the node to the node listings (Lookup table), will be compiled during finalization
-    nodes[id] = node;
+    if (use_table) {
+        node->repr = PROGSTATE_REPR_TABLE;
+        node->num_libcalls = span;
+        PROGSTATE_TABLE_BASE(node) = lowest;
 
-    // Add the edges to the node
-    if (num_successors > 0) {
-        struct libcalls *libcalls = (struct libcalls *)pool_edge;
-        pool_edge += num_successors * sizeof(struct libcalls);
+        unsigned int *table = PROGSTATE_TABLE(node);
+        MEMSET(table, 0xFF, span * sizeof(unsigned int));
+        for (int i = num_successors - 1; i >= 0; i--) {
+            table[libcall_list[i] - lowest] = successor_node_list[i];
+        }
+    } else {
+        node->repr = PROGSTATE_REPR_LIST;
+        node->num_libcalls = num_successors;
 
+        // Insertion sort on the libc ID, stable to keep the first of the edges sharing an ID ahead
+        unsigned int *libcallids = PROGSTATE_LIBCALLS(node);
+        unsigned int *next_progstates = PROGSTATE_NEXT_STATES(node);
         for (int i = 0; i < num_successors; i++) {
-            libcalls[i].magic = EDGE_MAGIC_NUMBER;
-            libcalls[i].libcallid = libcall_list[i];
-            libcalls[i].next_progstate = successor_node_list[i];            
+            int j = i;
+            for (; j > 0 && libcallids[j - 1] > libcall_list[i]; j--) {
+                libcallids[j] = libcallids[j - 1];
+                next_progstates[j] = next_progstates[j - 1];
+            }
+            libcallids[j] = libcall_list[i];
+            next_progstates[j] = successor_node_list[i];
         }
     }
+
     // Update the number of nodes
     pool->metadata.num_nodes++;
+    pool->metadata.used_size = pool_edge - (char*)pool;
     return node;
 }
 
 /**
- * This function will add a new node to the graph.
- * 
+ * This function will allocate the allow-set of the graph, switching it to POLICY_MODE_ALLOWSET.
+ * @param num_libcalls: The number of libc IDs in the list.
+ * @param libcall_list: The libc IDs that may be called, in any order.
+ * @return unsigned long*: The pointer to the allow-set bitmap, NULL if the graph has nodes or the pool is exhausted.
+ *
+ * @note: The bitmap takes the place of the node table, it is sized on the highest libc ID.
+ *
+ */
+void *alloc_allowset(int num_libcalls, unsigned long *libcall_list) {
+    unsigned long num_bits = 0;
+    if (pool == NULL || pool_attached) {
+        PRINT_ERROR("Graph not initialized, or read-only, failed to allocate the allow-set");
+        return NULL;
+    }
+    if (pool->metadata.num_nodes != 0 || pool->metadata.policy_mode != POLICY_MODE_AUTOMATON || num_libcalls < 0) {
+        PRINT_ERROR("Graph not empty, failed to allocate the allow-set");
+        return NULL;
+    }
+    for (int i = 0; i < num_libcalls; i++) {
+        if (libcall_list[i] >= MEMORY_POOL_SIZE * 8) {
+            PRINT_ERROR("Libc ID %lu beyond the pool, failed to allocate the allow-set", libcall_list[i]);
+            return NULL;
+        }
+        num_bits = (libcall_list[i] >= num_bits) ? libcall_list[i] + 1 : num_bits;
+    }
+
+    unsigned long size = ALLOWSET_SIZE(num_bits);
+    if ((pool_edge + size) > (((char*)pool) + MEMORY_POOL_SIZE)) {
+        PRINT_ERROR("Memory pool exhausted, failed to allocate the allow-set");
+        return NULL;
+    }
+
+    unsigned long *bitmap = (unsigned long *)pool_edge;
+    pool_edge += size;
+    MEMSET(bitmap, 0, size);
+    for (int i = 0; i < num_libcalls; i++) {
+        bitmap[libcall_list[i] / ALLOWSET_WORD_BITS] |= 1UL << (libcall_list[i] % ALLOWSET_WORD_BITS);
+    }
+
+    pool->metadata.policy_mode = POLICY_MODE_ALLOWSET;
+    pool->metadata.used_size = pool_edge - (char*)pool;
+    return bitmap;
+}
+
+/**
+ * This function will finalize the graph: build the node index and calculate the checksum.
+ *
+ * @note: The node index of an allow-set is empty.
  */
 void finalize_graph() {
-    if (nodes == NULL) {
-    } else {
+    if (pool == NULL || pool_attached) {
+        PRINT_ERROR("Graph not initialized, or read-only, failed to finalize it");
+        return;
+    }
+    char *nodes_table = ((char*)pool) + pool->metadata.nodes_table_offset;
+    char *nodes_end = (pool->metadata.policy_mode != POLICY_MODE_ALLOWSET) ? pool_edge : nodes_table;
+    unsigned long index_size = 0;
 
+    // Size the node index on the highest node ID
+    for (char *cursor = nodes_table; cursor < nodes_end; ) {
+        struct abstract_progstate *node = (struct abstract_progstate *)cursor;
+        if (node->id >= index_size) {
+            index_size = node->id + 1;
+        }
+        cursor += PROGSTATE_NODE_SIZE(node);
     }
+
+    if ((pool_edge + index_size * sizeof(unsigned int)) > (((char*)pool) + MEMORY_POOL_SIZE)) {
+        PRINT_ERROR("Memory pool exhausted, failed to finalize graph");
+        return;
+    }
+
+    unsigned int *node_index = (unsigned int *)pool_edge;
+    MEMSET(node_index, 0, index_size * sizeof(unsigned int));
+    for (char *cursor = nodes_table; cursor < nodes_end; ) {
+        struct abstract_progstate *node = (struct abstract_progstate *)cursor;
+        node_index[node->id] = cursor - (char*)pool;
+        cursor += PROGSTATE_NODE_SIZE(node);
+    }
+
+    pool->metadata.nodes_table_size     = pool_edge - nodes_table;
+    pool->metadata.node_index_offset    = pool_edge - (char*)pool;
+    pool->metadata.node_index_size      = index_size;
+    pool->metadata.used_size            = pool->metadata.node_index_offset + index_size * sizeof(unsigned int);
+
     // Mark the graph as finalized
     pool->metadata.graph_finalized = 1;
-    
-    // TODO: Calculate checksum on the finalized graph
+    pool->metadata.checksum = graph_checksum();
 
     PRINT_DEBUG("Graph finalized\n");
 }
@@ -247,54 +663,180 @@ void finalize_graph() {
 #endif // __KERNEL__
 
 /**
- * This function will verify the graph in the memory pool.
- * @return int: 1 if the graph is valid, else appropriate error code.
- * 
+ * This function will verify the header of the graph in the given pool: the sections and modes.
+ * @return int: 1 if the header is valid, else appropriate error code.
  */
-int verify_graph(void) {
-    if (pool == NULL) {
+static int verify_pool_layout(struct memory_pool *graph) {
+    if (graph == NULL) {
         PRINT_ERROR("Graph not initialized");
         return ERROR_INVALID_GRAPH;
     }
 
-    if (pool->metadata.graph_finalized == 0) {
+    if (graph->metadata.graph_finalized == 0) {
         PRINT_ERROR("Graph not finalized");
         return ERROR_INVALID_STATE;
     }
 
-    if (pool->metadata.magic != GRAPH_META_MAGIC_NUMBER) {
+    if (graph->metadata.magic != GRAPH_META_MAGIC_NUMBER) {
         PRINT_ERROR("Invalid magic number in the graph");
         return ERROR_INVALID_GRAPH;
     }
-    // TODO: Add more checks such checksum calculation/verification
 
-    if (nodes == NULL) {
-        nodes = (struct abstract_progstate **)MALLOC(sizeof(struct abstract_progstate *) * pool->metadata.num_nodes);
+    if (graph->metadata.version != MEMPOOL_VERSION) {
+        PRINT_ERROR("Unsupported graph version %lu, expected %d", graph->metadata.version, MEMPOOL_VERSION);
+        return ERROR_INVALID_GRAPH;
+    }
+
+    if (graph->metadata.used_size > MEMORY_POOL_SIZE ||
+        graph->metadata.nodes_table_offset != NODE_TABLE_OFFSET ||
+        graph->metadata.nodes_table_size > graph->metadata.used_size ||
+        graph->metadata.node_index_size > (MEMORY_POOL_SIZE / sizeof(unsigned int)) ||
+        graph->metadata.nodes_table_offset + graph->metadata.nodes_table_size != graph->metadata.node_index_offset ||
+        graph->metadata.node_index_offset + graph->metadata.node_index_size * sizeof(unsigned int) != graph->metadata.used_size) {
+        PRINT_ERROR("Invalid section layout in the graph");
+        return ERROR_INVALID_GRAPH;
+    }
+
+    if (graph->metadata.violation_mode > VIOLATION_MODE_LEARN) {
+        PRINT_ERROR("Unknown violation mode %u of the graph", graph->metadata.violation_mode);
+        return ERROR_INVALID_GRAPH;
     }
 
-    //Verify nodes and edges too
-    char *start_node = ((char*)pool) + pool->metadata.nodes_table_offset;
-    for (unsigned long i = 0; i < pool->metadata.num_nodes; i++) {
-        struct abstract_progstate *node = (struct abstract_progstate *)start_node;
-        // Update the node pointer
-        nodes[i] = node;
-        if (node->magic != NODE_MAGIC_NUMBER) {
-            PRINT_ERROR("Invalid magic number in node %lu", i);
+    if (graph->metadata.policy_mode == POLICY_MODE_ALLOWSET) {
+        if (graph->metadata.num_nodes != 0 || graph->metadata.node_index_size != 0 ||
+            graph->metadata.nodes_table_size % sizeof(unsigned long) != 0) {
+            PRINT_ERROR("Invalid allow-set in the graph");
+            return ERROR_INVALID_GRAPH;
+        }
+    } else if (graph->metadata.policy_mode != POLICY_MODE_AUTOMATON && graph->metadata.policy_mode != POLICY_MODE_PUSHDOWN) {
+        PRINT_ERROR("Unknown policy mode %u of the graph", graph->metadata.policy_mode);
+        return ERROR_INVALID_GRAPH;
+    }
+    return 1;
+}
+
+/**
+ * This function will verify the node at the given offset of the node table: its bounds and representation.
+ * @return int: 1 if the node is valid, else ERROR_INVALID_NODE.
+ */
+static int verify_node(struct memory_pool *graph, unsigned long offset) {
+    struct abstract_progstate *node = (struct abstract_progstate *)(((char*)graph) + offset);
+    unsigned long room = graph->metadata.node_index_offset - offset;
+    if (room < sizeof(struct abstract_progstate) || room < PROGSTATE_NODE_SIZE(node)) {
+        PRINT_ERROR("Node at offset %lu exceeds the node table", offset);
+        return ERROR_INVALID_NODE;
+    }
+    if (node->repr != PROGSTATE_REPR_LIST && node->repr != PROGSTATE_REPR_TABLE) {
+        PRINT_ERROR("Node %u with unknown representation %u", node->id, node->repr);
+        return ERROR_INVALID_NODE;
+    }
+    return 1;
+}
+
+/**
+ * This function will verify the graph in the given pool.
+ * @return int: 1 if the graph is valid, else appropriate error code.
+ *
+ * @note: Integrity is covered by the checksum, the node index is checked to reference
+ *        nodes and edges within the pool. Edges to states absent from the index are
+ *        left to the query path, which treats them as dead ends.
+ * @note: Only the `used_size` bytes are read, each of them once.
+ */
+static int verify_pool(struct memory_pool *graph) {
+    int ret = verify_pool_layout(graph);
+    if (ret != 1) {
+        return ret;
+    }
+
+    if (graph->metadata.policy_mode == POLICY_MODE_ALLOWSET) {
+        unsigned int crc = graph_checksum_header(graph);
+        crc = crc32c_update(crc, ((char*)graph) + graph->metadata.nodes_table_offset, graph->metadata.nodes_table_size);
+        if (graph->metadata.checksum != (crc ^ 0xFFFFFFFF)) {
+            PRINT_ERROR("Checksum mismatch in the graph");
+            return ERROR_INVALID_GRAPH;
+        }
+        return 1;
+    }
+
+    /*
+     * Single sweep over the used bytes: each node is bounds-checked against the node table, matched
+     * against its node index entry and added to the checksum, then the node index is checksummed.
+     */
+    char *nodes_table = ((char*)graph) + graph->metadata.nodes_table_offset;
+    char *nodes_end = nodes_table + graph->metadata.nodes_table_size;
+    unsigned int *node_index = (unsigned int *)nodes_end;
+    unsigned long index_size = graph->metadata.node_index_size;
+    unsigned long num_nodes = 0, num_indexed = 0;
+    unsigned int crc = graph_checksum_header(graph);
+
+    for (char *cursor = nodes_table; cursor < nodes_end; num_nodes++) {
+        struct abstract_progstate *node = (struct abstract_progstate *)cursor;
+        unsigned long offset = cursor - (char*)graph;
+        if (verify_node(graph, offset) != 1) {
             return ERROR_INVALID_NODE;
         }
-        start_node += sizeof(struct abstract_progstate);
-        struct libcalls *libcalls = (struct libcalls *)(start_node);
-        for (unsigned long j = 0; j < node->num_libcalls; j++) {
-            if (libcalls[j].magic != EDGE_MAGIC_NUMBER) {
-                PRINT_ERROR("Invalid magic number in edge %lu of node %lu", j, i);
-                return ERROR_INVALID_EDGE;
-            }
-            start_node += sizeof(struct libcalls);
+        if (node->id >= index_size || node_index[node->id] != offset) {
+            PRINT_ERROR("Node %u at offset %lu not in the node index", node->id, offset);
+            return ERROR_INVALID_NODE;
         }
+        crc = crc32c_update(crc, cursor, PROGSTATE_NODE_SIZE(node));
+        cursor += PROGSTATE_NODE_SIZE(node);
+    }
+
+    // Each node matched its own entry, so any other entry in use would be dangling
+    for (unsigned long i = 0; i < index_size; i++) {
+        num_indexed += (node_index[i] != NODE_INDEX_NONE);
+    }
+    crc = crc32c_update(crc, node_index, index_size * sizeof(unsigned int));
+
+    if (num_nodes != graph->metadata.num_nodes || num_indexed != num_nodes) {
+        PRINT_ERROR("Node index does not match the %lu nodes of the graph", num_nodes);
+        return ERROR_INVALID_NODE;
+    }
+
+    if (graph->metadata.checksum != (crc ^ 0xFFFFFFFF)) {
+        PRINT_ERROR("Checksum mismatch in the graph");
+        return ERROR_INVALID_GRAPH;
     }
     return 1;
 }
 
+/**
+ * This function will verify the graph in full.
+ * @return int: 1 if the graph is valid, else appropriate error code.
+ *
+ * @note: Nodes of a mapped graph are not verified on lookup any more once it passes, so it is not to be called
+ *        while other threads walk the graph.
+ */
+int verify_graph(void) {
+    int ret = verify_pool(pool);
+#ifndef __KERNEL__
+    if (ret == 1 && pool_node_checks) {
+        FREE(pool_node_checks);
+        pool_node_checks = NULL;
+    }
+#endif // __KERNEL__
+    return ret;
+}
+
+/**
+ * This function will verify the graph in a buffer, in place, without initializing or attaching it.
+ * @return int: 1 if the buffer holds a valid graph, else appropriate error code.
+ */
+int verify_graph_buffer(void *data, unsigned long size) {
+    struct memory_pool *graph = (struct memory_pool *)data;
+    if (graph == NULL || ((unsigned long)graph % sizeof(unsigned long)) != 0 ||
+        size < sizeof(struct graph_metadata) || size > MEMORY_POOL_SIZE) {
+        PRINT_ERROR("Invalid graph buffer");
+        return ERROR_INVALID_ARG;
+    }
+    if (size < graph->metadata.used_size) {
+        PRINT_ERROR("Graph buffer smaller than the graph");
+        return ERROR_INVALID_GRAPH;
+    }
+    return verify_pool(graph);
+}
+
 /* ============================================================================ */
 /* ========================== END: Graph Management  ========================== */
 /* ============================================================================ */
@@ -302,56 +844,377 @@ int verify_graph(void) {
 /* ============================================================================ */
 /* ========================== START: Graph Querying  ============================ */
 /* ============================================================================ */
-static unsigned long current_progstate = 0;
-static char *start_node = NULL;
+/* Cursor of the calling thread, for the cursor-less API */
+static PROGSTATE_LOCAL struct progstate_cursor progstate_cursor;
 
-void reset_progstate(void) {
-    current_progstate = 0;
-    start_node = (char *)nodes[current_progstate];
+#ifndef __KERNEL__
+/**
+ * Verifies a node of a mapped graph on its first lookup, see map_graph
+ * @return int: 1 if the node is valid, 0 otherwise
+ *
+ * @note: Threads walking the graph may verify the same node at once, to the same result.
+ */
+static int check_mapped_node(unsigned long progstate, unsigned int offset) {
+    unsigned char check = __atomic_load_n(&pool_node_checks[progstate], __ATOMIC_RELAXED);
+    if (check == NODE_CHECK_PENDING) {
+        int valid = offset >= pool->metadata.nodes_table_offset && offset < pool->metadata.node_index_offset &&
+                    (offset % sizeof(unsigned int)) == 0 && verify_node(pool, offset) == 1 &&
+                    ((struct abstract_progstate *)(((char*)pool) + offset))->id == progstate;
+        check = valid ? NODE_CHECK_VALID : NODE_CHECK_INVALID;
+        if (!valid) {
+            PRINT_ERROR("Node %lu at offset %u failed verification, taken as absent", progstate, offset);
+        }
+        __atomic_store_n(&pool_node_checks[progstate], check, __ATOMIC_RELAXED);
+    }
+    return check == NODE_CHECK_VALID;
 }
+#endif // __KERNEL__
 
-int is_state_transition_valid (unsigned long libccall) {
-    struct abstract_progstate *node = (struct abstract_progstate *)start_node;
-    struct libcalls *libcalls = (struct libcalls *)(start_node + sizeof(struct abstract_progstate));
-    if (node->magic != NODE_MAGIC_NUMBER) {
-        PRINT_ERROR("Invalid magic number in node %lu", current_progstate);
+/**
+ * Node of the given state, NULL if the state is not in the graph
+ */
+static char *progstate_node(struct memory_pool *graph, unsigned long progstate) {
+    if (graph == NULL || progstate >= graph->metadata.node_index_size) {
+        return NULL;
+    }
+    unsigned int offset = ((unsigned int *)(((char*)graph) + graph->metadata.node_index_offset))[progstate];
+    if (offset == NODE_INDEX_NONE) {
+        return NULL;
+    }
+#ifndef __KERNEL__
+    if (graph == pool && pool_node_checks && !check_mapped_node(progstate, offset)) {
+        return NULL;
+    }
+#endif // __KERNEL__
+    return ((char*)graph) + offset;
+}
+
+/**
+ * First edge of a list node with a libc ID not below the given one
+ */
+static unsigned int list_lower_bound(struct abstract_progstate *node, unsigned int key) {
+    unsigned int *libcallids = PROGSTATE_LIBCALLS(node);
+    unsigned int num_libcalls = node->num_libcalls;
+    unsigned int i = 0;
+    // Sorted on the libc ID, halve the longer lists down to a few cache lines
+    for (unsigned int n = num_libcalls; n > PROGSTATE_LIST_SCAN_MAX; ) {
+        unsigned int half = n / 2;
+        if (libcallids[i + half - 1] < key) {
+            i += half;
+            n -= half;
+        } else {
+            n = half;
+        }
+    }
+    // Compare the rest four at a time to skip over the misses
+    for (; i + 4 <= num_libcalls; i += 4) {
+        if ((libcallids[i] >= key) | (libcallids[i + 1] >= key) |
+            (libcallids[i + 2] >= key) | (libcallids[i + 3] >= key)) {
+            break;
+        }
+    }
+    for (; i < num_libcalls && libcallids[i] < key; i++);
+    return i;
+}
+
+/**
+ * Next state of the given node for the given library call
+ * @return long: ID of the next state, -1 if there is no such transition
+ */
+static long find_transition(char *progstate, unsigned long libccall) {
+    struct abstract_progstate *node = (struct abstract_progstate *)progstate;
+    if (node == NULL || libccall >= LIBCALL_RESERVED) {
+        return -1;
+    }
+
+    if (node->repr == PROGSTATE_REPR_TABLE) {
+        // Direct-indexed, IDs below the base wrap around to beyond the table
+        unsigned long entry = libccall - PROGSTATE_TABLE_BASE(node);
+        if (entry >= node->num_libcalls || PROGSTATE_TABLE(node)[entry] == PROGSTATE_TABLE_NONE) {
+            return -1;
+        }
+        return PROGSTATE_TABLE(node)[entry];
+    }
+
+    unsigned int i = list_lower_bound(node, libccall);
+    if (i < node->num_libcalls && PROGSTATE_LIBCALLS(node)[i] == libccall) {
+        return PROGSTATE_NEXT_STATES(node)[i];
+    }
+    return -1;
+}
+
+static void call_string_push(struct call_string *calls, unsigned int return_progstate) {
+    calls->top = (calls->top + 1) % CALL_STRING_MAX;
+    calls->return_progstate[calls->top] = return_progstate;
+    calls->depth += (calls->depth < CALL_STRING_MAX);
+}
+
+static unsigned int call_string_pop(struct call_string *calls) {
+    unsigned int return_progstate = calls->return_progstate[calls->top];
+    calls->top = (calls->top + CALL_STRING_MAX - 1) % CALL_STRING_MAX;
+    calls->depth--;
+    return return_progstate;
+}
+
+/**
+ * Compares the calls held by two call strings, whatever slots they are in
+ */
+static int call_string_equal(const struct call_string *a, const struct call_string *b) {
+    if (a->depth != b->depth) {
         return 0;
     }
-    if (libcalls[0].magic != EDGE_MAGIC_NUMBER) {
-        PRINT_ERROR("Invalid magic number in edge %lu of node %lu", libccall, current_progstate);
+    for (unsigned int i = 0; i < a->depth; i++) {
+        if (a->return_progstate[(a->top + CALL_STRING_MAX - i) % CALL_STRING_MAX] !=
+            b->return_progstate[(b->top + CALL_STRING_MAX - i) % CALL_STRING_MAX]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Adds a configuration to the first `num_configs` of the cursor, unless already one of them
+ * @return int: 1 if added, 0 if already there or the set is full
+ */
+static int pushdown_config_add(struct progstate_cursor *cursor, unsigned int num_configs, unsigned int progstate,
+                               const struct call_string *calls) {
+    for (unsigned int c = 0; c < num_configs; c++) {
+        if (cursor->configs[c].progstate == progstate && call_string_equal(&cursor->configs[c].calls, calls)) {
+            return 0;
+        }
+    }
+    if (num_configs == PUSHDOWN_CONFIGS_MAX) {
         return 0;
     }
-    // PRINT_DEBUG("\t\tChecking transition: %lu(%lu) -> %lu", current_progstate, node->num_libcalls ,  libccall);
-    for (unsigned long i = 0; i < node->num_libcalls; i++) {
-        // PRINT_DEBUG("\t\t\tChecking edge: %lu -> %lu", libcalls[i].libcallid, libccall);
-        if (libcalls[i].libcallid == libccall) {
-            return libcalls[i].next_progstate;
+    cursor->configs[num_configs].progstate = progstate;
+    cursor->configs[num_configs].calls = *calls;
+    return 1;
+}
+
+/**
+ * Adds to the configurations of the cursor every configuration reachable from them past calls and returns, in
+ * POLICY_MODE_PUSHDOWN. The set is its own worklist: each configuration added is expanded in turn, and as the
+ * call strings are bounded the set stops growing.
+ *
+ * @note: A return with the call string exhausted (dropped or outermost calls) may go to any of the callers.
+ * @note: Configurations beyond PUSHDOWN_CONFIGS_MAX are dropped, a libc call only they allow is rejected.
+ */
+static void pushdown_closure(struct memory_pool *graph, struct progstate_cursor *cursor) {
+    for (unsigned int c = 0; c < cursor->num_configs; c++) {
+        struct abstract_progstate *node = (struct abstract_progstate *)progstate_node(graph, cursor->configs[c].progstate);
+        if (node == NULL || node->repr != PROGSTATE_REPR_LIST) {
+            continue;
+        }
+
+        unsigned int *next_progstates = PROGSTATE_NEXT_STATES(node);
+        unsigned int call = list_lower_bound(node, LIBCALL_CALL);
+        unsigned int call_return = list_lower_bound(node, LIBCALL_CALL_RETURN);
+        unsigned int ret = list_lower_bound(node, LIBCALL_RETURN);
+        unsigned int ret_end = list_lower_bound(node, LIBCALL_RETURN + 1);
+        unsigned int num_calls = ((call_return - call) < (ret - call_return)) ? (call_return - call) : (ret - call_return);
+
+        // Into the callees, the n-th LIBCALL_CALL_RETURN edge is the return state of the n-th LIBCALL_CALL edge
+        for (unsigned int i = 0; i < num_calls; i++) {
+            struct call_string callee = cursor->configs[c].calls;
+            call_string_push(&callee, next_progstates[call_return + i]);
+            cursor->num_configs += pushdown_config_add(cursor, cursor->num_configs, next_progstates[call + i], &callee);
+        }
+
+        // Out of the function, to the caller on the call string, or to any caller once the call string is exhausted
+        for (unsigned int i = ret; i < ret_end; i++) {
+            struct call_string caller = cursor->configs[c].calls;
+            if (caller.depth > 0) {
+                unsigned int return_progstate = call_string_pop(&caller);
+                cursor->num_configs += pushdown_config_add(cursor, cursor->num_configs, return_progstate, &caller);
+                break;
+            }
+            cursor->num_configs += pushdown_config_add(cursor, cursor->num_configs, next_progstates[i], &caller);
+        }
+    }
+}
+
+/**
+ * Checks the libc call against the configurations of the cursor, in POLICY_MODE_PUSHDOWN
+ * @return int: 1 if any of them allows the libc call, 0 otherwise
+ */
+static int pushdown_transition_valid(struct memory_pool *graph, struct progstate_cursor *cursor, unsigned long libccall) {
+    for (unsigned int c = 0; c < cursor->num_configs; c++) {
+        if (find_transition(progstate_node(graph, cursor->configs[c].progstate), libccall) >= 0) {
+            return 1;
         }
     }
     return 0;
 }
 
-int transition_to_state(unsigned long libccall) {
-    if (current_progstate >= pool->metadata.num_nodes) {
+/**
+ * Moves the configurations of the cursor past the libc call, in POLICY_MODE_PUSHDOWN: each configuration that
+ * allows it is moved to its next state, the others are dropped, then calls and returns are followed from them
+ * @return long: ID of the state of the first configuration, -1 if none allows the libc call (the cursor is left as is)
+ *
+ * @note: Every path is followed, so when several match (e.g. call sites to the same function) the libc calls
+ *        that come after are checked against the call strings of all of them.
+ */
+static long pushdown_transition(struct memory_pool *graph, struct progstate_cursor *cursor, unsigned long libccall) {
+    if (!pushdown_transition_valid(graph, cursor, libccall)) {
+        return -1;
+    }
+
+    // At most one next state per configuration, written over the ones already read
+    unsigned int num_configs = 0;
+    for (unsigned int c = 0; c < cursor->num_configs; c++) {
+        long next_progstate = find_transition(progstate_node(graph, cursor->configs[c].progstate), libccall);
+        if (next_progstate >= 0) {
+            struct call_string calls = cursor->configs[c].calls;
+            num_configs += pushdown_config_add(cursor, num_configs, next_progstate, &calls);
+        }
+    }
+    cursor->num_configs = num_configs;
+    pushdown_closure(graph, cursor);
+    return cursor->configs[0].progstate;
+}
+
+/**
+ * Allow-set lookup, the libc ID is checked on its own without any state
+ */
+static int graph_libcall_allowed(struct memory_pool *graph, unsigned long libccall) {
+    if (graph == NULL || graph->metadata.policy_mode != POLICY_MODE_ALLOWSET ||
+        libccall >= graph->metadata.nodes_table_size * 8) {
+        return 0;
+    }
+    const unsigned long *bitmap = (const unsigned long *)(((char*)graph) + graph->metadata.nodes_table_offset);
+    return (bitmap[libccall / ALLOWSET_WORD_BITS] >> (libccall % ALLOWSET_WORD_BITS)) & 1;
+}
+
+int is_libcall_allowed(unsigned long libccall) {
+    return graph_libcall_allowed(pool, libccall);
+}
+
+/**
+ * Moves the cursor to the given state, with no calls made to reach it
+ */
+static void cursor_set_state(struct progstate_cursor *cursor, unsigned long progstate) {
+    struct memory_pool *graph = cursor->graph;
+    cursor->progstate = progstate;
+    cursor->node = progstate_node(graph, cursor->progstate);
+    cursor->num_configs = 1;
+    cursor->configs[0].progstate = progstate;
+    cursor->configs[0].calls.top = 0;
+    cursor->configs[0].calls.depth = 0;
+    if (graph != NULL && graph->metadata.policy_mode == POLICY_MODE_PUSHDOWN) {
+        pushdown_closure(graph, cursor);
+    }
+}
+
+/**
+ * Points the cursor to the given (verified) graph, at its entry state
+ */
+void attach_progstate_cursor(struct progstate_cursor *cursor, void *graph) {
+    cursor->graph = graph;
+    reset_progstate_cursor(cursor);
+}
+
+/**
+ * Resets the cursor to the entry state of its graph
+ */
+void reset_progstate_cursor(struct progstate_cursor *cursor) {
+    cursor_set_state(cursor, 0);
+}
+
+/**
+ * Checks the libc call against the state of the cursor, without moving it
+ * @return int: 1 if the libc call is allowed, 0 otherwise
+ */
+int is_cursor_transition_valid(struct progstate_cursor *cursor, unsigned long libccall) {
+    struct memory_pool *graph = cursor->graph;
+    if (graph != NULL && graph->metadata.policy_mode == POLICY_MODE_PUSHDOWN) {
+        return pushdown_transition_valid(graph, cursor, libccall);
+    }
+    if (find_transition(cursor->node, libccall) >= 0) {
+        return 1;
+    }
+    // An allow-set has no states, its lookups miss the (absent) current state
+    return graph_libcall_allowed(graph, libccall);
+}
+
+/**
+ * Moves the cursor to the next state for the libc call
+ * @return int: ID of the new state, ERROR_INVALID_STATE if the libc call is not allowed
+ *
+ * @note: Only the cursor is written, threads moving their own cursors over a graph need no locking.
+ */
+int cursor_transition_to_state(struct progstate_cursor *cursor, unsigned long libccall) {
+    struct memory_pool *graph = cursor->graph;
+    if (graph != NULL && graph->metadata.policy_mode == POLICY_MODE_PUSHDOWN) {
+        long next_progstate = pushdown_transition(graph, cursor, libccall);
+        if (next_progstate < 0) {
+            PRINT_ERROR("Invalid state transition");
+            return ERROR_INVALID_STATE;
+        }
+        cursor->progstate = next_progstate;
+        cursor->node = progstate_node(graph, cursor->progstate);
+        return cursor->progstate;
+    } else if (cursor->node == NULL) {
+        if (graph_libcall_allowed(graph, libccall)) {
+            return cursor->progstate;
+        }
         PRINT_ERROR("Invalid current state");
         return ERROR_INVALID_STATE;
     } else {
-        unsigned long temp = is_state_transition_valid(libccall);
-        // PRINT_DEBUG("\t\tTransition: %lu -> %lu -> %lu", current_progstate, libccall, temp);
-        if (temp) {
-            current_progstate = temp;
-            start_node = (char *)nodes[current_progstate];
-            return current_progstate;
+        long next_progstate = find_transition(cursor->node, libccall);
+        if (next_progstate >= 0) {
+            cursor->progstate = next_progstate;
+            cursor->node = progstate_node(graph, cursor->progstate);
+            return cursor->progstate;
         } else {
             PRINT_ERROR("Invalid state transition");
             return ERROR_INVALID_STATE;
         }
-    }  
+    }
     return 0;
 }
 
+/**
+ * Moves the cursor past a libc call not allowed from its state (audit and learn modes), to the state the first
+ * transition on this libc call leads to, anywhere in the graph
+ * @return int: ID of the new state, ERROR_INVALID_STATE if no state allows the libc call (the cursor is left as is)
+ *
+ * @note: A scan of the node table, for the violations only. Each node is verified before it is read, the nodes
+ *        of a lazily mapped graph are not, and the scan stops at the first invalid one.
+ */
+int cursor_resync_to_state(struct progstate_cursor *cursor, unsigned long libccall) {
+    struct memory_pool *graph = cursor->graph;
+    if (graph == NULL || graph->metadata.policy_mode == POLICY_MODE_ALLOWSET) {
+        return ERROR_INVALID_STATE;
+    }
+
+    char *nodes_table = ((char*)graph) + graph->metadata.nodes_table_offset;
+    char *nodes_end = nodes_table + graph->metadata.nodes_table_size;
+    for (char *node = nodes_table; node < nodes_end; node += PROGSTATE_NODE_SIZE((struct abstract_progstate *)node)) {
+        if (verify_node(graph, node - (char*)graph) != 1) {
+            break;
+        }
+        long next_progstate = find_transition(node, libccall);
+        if (next_progstate >= 0) {
+            cursor_set_state(cursor, next_progstate);
+            return cursor->progstate;
+        }
+    }
+    return ERROR_INVALID_STATE;
+}
+
+void reset_progstate(void) {
+    attach_progstate_cursor(&progstate_cursor, pool);
+}
+
+int is_state_transition_valid (unsigned long libccall) {
+    return is_cursor_transition_valid(&progstate_cursor, libccall);
+}
+
+int transition_to_state(unsigned long libccall) {
+    return cursor_transition_to_state(&progstate_cursor, libccall);
+}
+
 
 /* ============================================================================ */
 /* ========================== END: Graph Querying  ============================ */
 /* ============================================================================ */
-
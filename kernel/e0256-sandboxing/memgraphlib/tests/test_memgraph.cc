@@ -1,6 +1,9 @@
+#include <algorithm>
+#include <cstring>
 #include <filesystem>
 #include <iostream>
 #include <fstream>
+#include <thread>
 #include <tuple>
 #include <gtest/gtest.h>
 #include <memgraph.h>
@@ -95,6 +98,70 @@ TEST (MemGraph_BasicUnit, PoolInitCheck2) {
     EXPECT_EQ(graph, nullptr) << "Graph not destroyed";
 }
 
+TEST (MemGraph_BasicUnit, AttachGraph) {
+    initialize_graph(NULL, 0);
+    unsigned long node_list[2] = {1, 0};
+    unsigned long libcall_list[2] = {10, 20};
+    alloc_node(0, 1, node_list, libcall_list);
+    alloc_node(1, 1, node_list + 1, libcall_list + 1);
+    finalize_graph();
+
+    // Graph used in place, as the kernel does with the pinned pages of the embedded section
+    unsigned long size = get_graph_size();
+    unsigned long *buffer = (unsigned long *)malloc(size + sizeof(unsigned long));
+    memcpy(buffer, get_graph(), size);
+    destroy_graph();
+
+    ASSERT_EQ(attach_graph(buffer, size), 1) << "Graph not attached";
+    EXPECT_EQ(get_graph(), (void *)buffer) << "Graph copied instead of attached";
+    reset_progstate();
+    EXPECT_EQ(transition_to_state(10), 1) << "Invalid transition in the attached graph";
+    EXPECT_EQ(is_state_transition_valid(10), 0) << "Invalid transition in the attached graph";
+    EXPECT_EQ(transition_to_state(20), 0) << "Invalid transition in the attached graph";
+    destroy_graph();
+    EXPECT_EQ(get_graph(), nullptr) << "Graph not detached";
+
+    // Buffer is not freed on detach, and is rejected when truncated, misaligned or corrupted
+    EXPECT_EQ(attach_graph(buffer, size - 1), ERROR_INVALID_GRAPH) << "Truncated graph attached";
+    memmove((char *)buffer + 1, buffer, size);
+    EXPECT_EQ(attach_graph((char *)buffer + 1, size), ERROR_INVALID_ARG) << "Misaligned graph attached";
+    memmove(buffer, (char *)buffer + 1, size);
+    ((char *)buffer)[size - 1] ^= 0xFF;
+    EXPECT_NE(attach_graph(buffer, size), 1) << "Corrupted graph attached";
+    EXPECT_EQ(get_graph(), nullptr) << "Corrupted graph left attached";
+    free(buffer);
+}
+
+TEST (MemGraph_BasicUnit, RelocatedGraph) {
+    initialize_graph(NULL, 0);
+    unsigned long node_list[3] = {1, 2, 0};
+    unsigned long libcall_list[3] = {10, 20, 30};
+    for (unsigned long i = 0; i < 3; i++) {
+        alloc_node(i, 1, node_list + i, libcall_list + i);
+    }
+    finalize_graph();
+
+    // Copies at different addresses, walked at once with no fix-up
+    unsigned long size = get_graph_size();
+    std::vector<unsigned long> first(size / sizeof(unsigned long) + 1), second(size / sizeof(unsigned long) + 8);
+    memcpy(first.data(), get_graph(), size);
+    memcpy(second.data() + 7, get_graph(), size);
+    destroy_graph();
+
+    void *copies[2] = {first.data(), second.data() + 7};
+    struct progstate_cursor cursors[2];
+    for (int i = 0; i < 2; i++) {
+        ASSERT_EQ(verify_graph_buffer(copies[i], size), 1) << "Relocated graph verification failed";
+        attach_progstate_cursor(&cursors[i], copies[i]);
+    }
+    for (unsigned long libcall : {10UL, 20UL, 30UL, 10UL}) {
+        EXPECT_EQ(cursor_transition_to_state(&cursors[0], libcall), cursor_transition_to_state(&cursors[1], libcall))
+            << "Copies of the graph diverge on libc ID " << libcall;
+    }
+    EXPECT_EQ(cursors[0].progstate, 1UL) << "Invalid transition in the relocated graph";
+    EXPECT_EQ(cursors[1].node - (char *)copies[1], cursors[0].node - (char *)copies[0]) << "Node not within its copy";
+}
+
 TEST (MemGraph_BasicUnit, VerifyCheckBasicSanity) {
   EXPECT_EQ(verify_graph(), ERROR_INVALID_GRAPH) << "Expected failure return code not received";
   initialize_graph(NULL, 0);
@@ -117,15 +184,14 @@ TEST(MemGraph_GraphCreation, CreateGraph) {
     unsigned long libcall_list[2] = {0, 1};
     struct abstract_progstate *node = (struct abstract_progstate *)alloc_node(0, sizeof(node_list)/sizeof(unsigned long), node_list, libcall_list);
     ASSERT_NE(node, nullptr) << "Node not allocated";
-    EXPECT_EQ(node->magic, NODE_MAGIC_NUMBER) << "Invalid magic number in the node";
     EXPECT_EQ(node->id, 0) << "Invalid node id";
     EXPECT_EQ(node->num_libcalls, 2) << "Invalid number of libcalls in the node";
     // Check the successors edges of the created node
-    struct libcalls *libcalls = (struct libcalls *)((char *)node + sizeof(struct abstract_progstate));
+    unsigned int *libcallids = PROGSTATE_LIBCALLS(node);
+    unsigned int *next_progstates = PROGSTATE_NEXT_STATES(node);
     for (int i = 0; i < 2; i++) {
-        EXPECT_EQ(libcalls[i].magic, EDGE_MAGIC_NUMBER) << "Invalid magic number in the edge";
-        EXPECT_EQ(libcalls[i].libcallid, i) << "Invalid libcall id in the edge";
-        EXPECT_EQ(libcalls[i].next_progstate, i) << "Invalid next progstate in the edge";
+        EXPECT_EQ(libcallids[i], i) << "Invalid libcall id in the edge";
+        EXPECT_EQ(next_progstates[i], i) << "Invalid next progstate in the edge";
     }
 
     // Check if the node is added to the graph
@@ -139,15 +205,15 @@ TEST(MemGraph_GraphCreation, CreateGraph) {
     unsigned long libcall_list1[2] = {100, 12};
     struct abstract_progstate *node1 = (struct abstract_progstate *)alloc_node(1, sizeof(node_list1)/sizeof(unsigned long), node_list1, libcall_list1);
     ASSERT_NE(node1, nullptr) << "Node not allocated";
-    EXPECT_EQ(node1->magic, NODE_MAGIC_NUMBER) << "Invalid magic number in the node";
     EXPECT_EQ(node1->id, 1) << "Invalid node id";
     EXPECT_EQ(node1->num_libcalls, 2) << "Invalid number of libcalls in the node";
     // Check the successors edges of the created node
-    struct libcalls *libcalls1 = (struct libcalls *)((char *)node1 + sizeof(struct abstract_progstate));
+    unsigned int *libcallids1 = PROGSTATE_LIBCALLS(node1);
+    unsigned int *next_progstates1 = PROGSTATE_NEXT_STATES(node1);
+    // Edges are sorted on the libc ID
     for (int i = 0; i < 2; i++) {
-        EXPECT_EQ(libcalls1[i].magic, EDGE_MAGIC_NUMBER) << "Invalid magic number in the edge";
-        EXPECT_EQ(libcalls1[i].libcallid, libcall_list1[i]) << "Invalid libcall id in the edge";
-        EXPECT_EQ(libcalls1[i].next_progstate, node_list1[i]) << "Invalid next progstate in the edge";
+        EXPECT_EQ(libcallids1[i], libcall_list1[1 - i]) << "Invalid libcall id in the edge";
+        EXPECT_EQ(next_progstates1[i], node_list1[1 - i]) << "Invalid next progstate in the edge";
     }
 
     // Check if the node is added to the graph
@@ -160,15 +226,16 @@ TEST(MemGraph_GraphCreation, CreateGraph) {
     unsigned long libcall_list2[3] = {10, 1, 10};
     struct abstract_progstate *node2 = (struct abstract_progstate *)alloc_node(20, sizeof(node_list2)/sizeof(unsigned long), node_list2, libcall_list2);
     ASSERT_NE(node2, nullptr) << "Node not allocated";
-    EXPECT_EQ(node2->magic, NODE_MAGIC_NUMBER) << "Invalid magic number in the node";
     EXPECT_EQ(node2->id, 20) << "Invalid node id";
     EXPECT_EQ(node2->num_libcalls, 3) << "Invalid number of libcalls in the node";
     // Check the successors edges of the created node
-    struct libcalls *libcalls2 = (struct libcalls *)((char *)node2 + sizeof(struct abstract_progstate));
+    unsigned int *libcallids2 = PROGSTATE_LIBCALLS(node2);
+    unsigned int *next_progstates2 = PROGSTATE_NEXT_STATES(node2);
+    // Edges sharing a libc ID keep their order
+    unsigned int sorted_libcalls2[3] = {1, 10, 10}, sorted_nodes2[3] = {1, 0, 2};
     for (int i = 0; i < 3; i++) {
-        EXPECT_EQ(libcalls2[i].magic, EDGE_MAGIC_NUMBER) << "Invalid magic number in the edge";
-        EXPECT_EQ(libcalls2[i].libcallid, libcall_list2[i]) << "Invalid libcall id in the edge";
-        EXPECT_EQ(libcalls2[i].next_progstate, node_list2[i]) << "Invalid next progstate in the edge";
+        EXPECT_EQ(libcallids2[i], sorted_libcalls2[i]) << "Invalid libcall id in the edge";
+        EXPECT_EQ(next_progstates2[i], sorted_nodes2[i]) << "Invalid next progstate in the edge";
     }
 
     destroy_graph ();
@@ -200,6 +267,520 @@ TEST(MemGraph_GraphCreation, GraphVerify) {
 }
 
 
+TEST(MemGraph_GraphCreation, GraphLayoutSize) {
+    initialize_graph(NULL, 0);
+    unsigned long node_list[3] = {1, 2, 0};
+    unsigned long libcall_list[3] = {10, 11, 12};
+    alloc_node(0, 3, node_list, libcall_list);
+    alloc_node(1, 1, node_list + 1, libcall_list + 1);
+    alloc_node(2, 0, node_list, libcall_list);
+    finalize_graph();
+    EXPECT_EQ(verify_graph(), 1) << "Graph verification failed";
+
+    struct memory_pool *pool = (struct memory_pool *)get_graph();
+    EXPECT_EQ(pool->metadata.nodes_table_offset % NODE_TABLE_ALIGNMENT, 0) << "Node table not cache line aligned";
+    EXPECT_EQ(pool->metadata.nodes_table_size, PROGSTATE_SIZE(3) + PROGSTATE_SIZE(1) + PROGSTATE_SIZE(0)) << "Invalid size of the nodes table";
+    EXPECT_EQ(pool->metadata.node_index_size, 3) << "Invalid size of the node index";
+    EXPECT_EQ(get_graph_size(), pool->metadata.node_index_offset + 3 * sizeof(unsigned int)) << "Invalid size of the graph";
+    EXPECT_LE(PROGSTATE_SIZE(7), 64) << "Node with 7 edges does not fit a cache line";
+    destroy_graph ();
+}
+
+TEST(MemGraph_GraphCreation, PoolExhausted) {
+    initialize_graph(NULL, 0);
+    unsigned long num_successors = PROGSTATE_MAX_ENTRIES;
+    std::vector<unsigned long> node_list(num_successors, 0), libcall_list(num_successors);
+    for (unsigned long i = 0; i < num_successors; i++) {
+        libcall_list[i] = i * PROGSTATE_TABLE_MAX_SPAN_RATIO * 2;
+    }
+    EXPECT_EQ(alloc_node(0, num_successors + 1, node_list.data(), libcall_list.data()), nullptr) << "Node allocated beyond the edge count";
+    EXPECT_NE(alloc_node(0, num_successors, node_list.data(), libcall_list.data()), nullptr) << "Node not allocated";
+    EXPECT_EQ(alloc_node(1, num_successors, node_list.data(), libcall_list.data()), nullptr) << "Node allocated beyond the pool";
+    EXPECT_NE(alloc_node(1, 1, node_list.data(), libcall_list.data()), nullptr) << "Node not allocated";
+    finalize_graph();
+    EXPECT_EQ(verify_graph(), 1) << "Graph verification failed";
+    destroy_graph ();
+}
+
+TEST(MemGraph_GraphCreation, IDsOutOfRange) {
+    initialize_graph(NULL, 0);
+    unsigned long node_list[1] = {0};
+    unsigned long libcall_list[1] = {10};
+    EXPECT_EQ(alloc_node(PROGSTATE_TABLE_NONE, 1, node_list, libcall_list), nullptr) << "Node ID beyond 32 bits allocated";
+    node_list[0] = 1UL << 32;
+    EXPECT_EQ(alloc_node(0, 1, node_list, libcall_list), nullptr) << "Next state beyond 32 bits allocated";
+    node_list[0] = 0;
+    libcall_list[0] = 0xFFFFFFFF;
+    EXPECT_EQ(alloc_node(0, 1, node_list, libcall_list), nullptr) << "Libc ID beyond 32 bits allocated";
+    libcall_list[0] = LIBCALL_RETURN + 1;
+    EXPECT_EQ(alloc_node(0, 1, node_list, libcall_list), nullptr) << "Unknown reserved libc ID allocated";
+    libcall_list[0] = LIBCALL_CALL;
+    EXPECT_NE(alloc_node(0, 1, node_list, libcall_list), nullptr) << "Call edge not allocated";
+    destroy_graph ();
+}
+
+TEST(MemGraph_GraphCreation, VerifyDetectsCorruption) {
+    initialize_graph(NULL, 0);
+    unsigned long node_list[2] = {1, 0};
+    unsigned long libcall_list[2] = {10, 20};
+    alloc_node(0, 1, node_list, libcall_list);
+    alloc_node(1, 1, node_list + 1, libcall_list + 1);
+    finalize_graph();
+    ASSERT_EQ(verify_graph(), 1) << "Graph verification failed";
+
+    struct memory_pool *pool = (struct memory_pool *)get_graph();
+    unsigned int *libcallids = PROGSTATE_LIBCALLS((char *)pool + pool->metadata.nodes_table_offset);
+    libcallids[0] ^= 1;
+    EXPECT_EQ(verify_graph(), ERROR_INVALID_GRAPH) << "Corrupted edge not detected";
+    libcallids[0] ^= 1;
+    EXPECT_EQ(verify_graph(), 1) << "Graph verification failed";
+
+    pool->metadata.version = 1;
+    EXPECT_EQ(verify_graph(), ERROR_INVALID_GRAPH) << "Unsupported version not detected";
+    destroy_graph ();
+}
+
+TEST(MemGraph_GraphCreation, VerifyChecksum) {
+    initialize_graph(NULL, 0);
+    unsigned long node_list[3] = {1, 2, 0};
+    unsigned long libcall_list[3] = {10, 11, 12};
+    alloc_node(0, 3, node_list, libcall_list);
+    alloc_node(1, 1, node_list + 1, libcall_list + 1);
+    finalize_graph();
+
+    // Bitwise CRC32C of the graph, with the checksum field as zero
+    struct memory_pool *pool = (struct memory_pool *)get_graph();
+    std::vector<unsigned char> blob((unsigned char *)pool, (unsigned char *)pool + get_graph_size());
+    reinterpret_cast<struct memory_pool *>(blob.data())->metadata.checksum = 0;
+    unsigned int crc = 0xFFFFFFFF;
+    for (unsigned char byte : blob) {
+        crc ^= byte;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+        }
+    }
+    EXPECT_EQ(pool->metadata.checksum, crc ^ 0xFFFFFFFF) << "Checksum is not the CRC32C of the graph";
+    destroy_graph ();
+}
+
+TEST(MemGraph_GraphCreation, VerifyRejectsInvalidIndex) {
+    initialize_graph(NULL, 0);
+    unsigned long node_list[2] = {2, 0};
+    unsigned long libcall_list[2] = {10, 20};
+    alloc_node(0, 1, node_list, libcall_list);
+    alloc_node(2, 1, node_list + 1, libcall_list + 1);
+    finalize_graph();
+    ASSERT_EQ(verify_graph(), 1) << "Graph verification failed";
+
+    struct memory_pool *pool = (struct memory_pool *)get_graph();
+    unsigned int *node_index = (unsigned int *)((char *)pool + pool->metadata.node_index_offset);
+    ASSERT_EQ(pool->metadata.node_index_size, 3) << "Invalid size of the node index";
+    ASSERT_EQ(node_index[1], NODE_INDEX_NONE) << "Absent node in the node index";
+
+    // Dangling entry, aliasing node 0
+    node_index[1] = node_index[0];
+    EXPECT_EQ(verify_graph(), ERROR_INVALID_NODE) << "Dangling node index entry not detected";
+    node_index[1] = NODE_INDEX_NONE;
+
+    // Edge list running past the node table
+    struct abstract_progstate *node = (struct abstract_progstate *)((char *)pool + node_index[2]);
+    node->num_libcalls = PROGSTATE_MAX_ENTRIES;
+    EXPECT_EQ(verify_graph(), ERROR_INVALID_NODE) << "Node exceeding the node table not detected";
+    node->num_libcalls = 1;
+
+    node->repr = 0xFF;
+    EXPECT_EQ(verify_graph(), ERROR_INVALID_NODE) << "Unknown node representation not detected";
+    node->repr = PROGSTATE_REPR_LIST;
+
+    pool->metadata.node_index_size = ~0UL;
+    EXPECT_EQ(verify_graph(), ERROR_INVALID_GRAPH) << "Oversized node index not detected";
+    pool->metadata.node_index_size = 3;
+    EXPECT_EQ(verify_graph(), 1) << "Graph verification failed";
+    destroy_graph ();
+}
+
+TEST(MemGraph_GraphCreation, TransitionToEntryState) {
+    initialize_graph(NULL, 0);
+    unsigned long node_list[2] = {1, 0};
+    unsigned long libcall_list[2] = {10, 20};
+    alloc_node(0, 1, node_list, libcall_list);
+    alloc_node(1, 1, node_list + 1, libcall_list + 1);
+    finalize_graph();
+
+    reset_progstate();
+    EXPECT_FALSE(is_state_transition_valid(20)) << "Invalid transition accepted";
+    EXPECT_TRUE(is_state_transition_valid(10)) << "Valid transition rejected";
+    EXPECT_EQ(transition_to_state(10), 1) << "Invalid transition";
+    EXPECT_TRUE(is_state_transition_valid(20)) << "Transition to the entry state rejected";
+    EXPECT_EQ(transition_to_state(20), 0) << "Invalid transition";
+    EXPECT_EQ(transition_to_state(20), ERROR_INVALID_STATE) << "Invalid transition accepted";
+    destroy_graph ();
+}
+
+
+TEST(MemGraph_GraphCreation, DenseNodeTable) {
+    initialize_graph(NULL, 0);
+    // Edges on every other libc ID from 100, the first of the edges on 100 wins
+    std::vector<unsigned long> node_list, libcall_list;
+    for (unsigned long i = 0; i < PROGSTATE_TABLE_MIN_EDGES; i++) {
+        node_list.push_back(i % 3);
+        libcall_list.push_back(100 + 2 * i);
+    }
+    node_list.push_back(2);
+    libcall_list.push_back(100);
+    struct abstract_progstate *node = (struct abstract_progstate *)alloc_node(0, node_list.size(), node_list.data(), libcall_list.data());
+    ASSERT_NE(node, nullptr) << "Node not allocated";
+    EXPECT_EQ(node->repr, PROGSTATE_REPR_TABLE) << "Dense node not represented as a table";
+    EXPECT_EQ(node->num_libcalls, 2 * PROGSTATE_TABLE_MIN_EDGES - 1) << "Invalid number of table entries";
+    EXPECT_EQ(PROGSTATE_TABLE_BASE(node), 100) << "Invalid base of the table";
+    alloc_node(1, 0, NULL, NULL);
+    alloc_node(2, 0, NULL, NULL);
+    finalize_graph();
+    ASSERT_EQ(verify_graph(), 1) << "Graph verification failed";
+
+    for (unsigned long libcall = 0; libcall < 200; libcall++) {
+        bool expected = std::find(libcall_list.begin(), libcall_list.end(), libcall) != libcall_list.end();
+        reset_progstate();
+        EXPECT_EQ(is_state_transition_valid(libcall), expected) << "Invalid lookup of libc ID " << libcall;
+        if (expected) {
+            EXPECT_EQ(transition_to_state(libcall), ((libcall - 100) / 2) % 3) << "Invalid transition on libc ID " << libcall;
+        }
+    }
+    destroy_graph ();
+}
+
+TEST(MemGraph_GraphCreation, SparseNodeList) {
+    initialize_graph(NULL, 0);
+    // As many edges as for a table, spread over the libc ID space
+    std::vector<unsigned long> node_list, libcall_list;
+    for (unsigned long i = 0; i < 8 * PROGSTATE_LIST_SCAN_MAX; i++) {
+        node_list.push_back(i % 2);
+        libcall_list.push_back(((i * 37) % (8 * PROGSTATE_LIST_SCAN_MAX)) * 10 + 5);
+    }
+    struct abstract_progstate *node = (struct abstract_progstate *)alloc_node(0, node_list.size(), node_list.data(), libcall_list.data());
+    ASSERT_NE(node, nullptr) << "Node not allocated";
+    EXPECT_EQ(node->repr, PROGSTATE_REPR_LIST) << "Sparse node not represented as a list";
+    EXPECT_TRUE(std::is_sorted(PROGSTATE_LIBCALLS(node), PROGSTATE_LIBCALLS(node) + node->num_libcalls)) << "Edges not sorted";
+    alloc_node(1, 0, NULL, NULL);
+    finalize_graph();
+    ASSERT_EQ(verify_graph(), 1) << "Graph verification failed";
+
+    reset_progstate();
+    for (unsigned long libcall = 0; libcall < 10 * 8 * PROGSTATE_LIST_SCAN_MAX + 10; libcall++) {
+        EXPECT_EQ(is_state_transition_valid(libcall), libcall % 10 == 5 && libcall < 10 * 8 * PROGSTATE_LIST_SCAN_MAX) << "Invalid lookup of libc ID " << libcall;
+    }
+    for (unsigned long i = 0; i < libcall_list.size(); i++) {
+        reset_progstate();
+        EXPECT_EQ(transition_to_state(libcall_list[i]), node_list[i]) << "Invalid transition on libc ID " << libcall_list[i];
+    }
+    destroy_graph ();
+}
+
+TEST(MemGraph_GraphCreation, NodeRepresentationPolicy) {
+    std::vector<unsigned long> node_list(PROGSTATE_TABLE_MIN_EDGES, 0), libcall_list;
+    for (unsigned long i = 0; i < PROGSTATE_TABLE_MIN_EDGES; i++) {
+        libcall_list.push_back(i + 1);
+    }
+
+    initialize_graph(NULL, 0);
+    set_progstate_repr_policy(0, 0);
+    struct abstract_progstate *node = (struct abstract_progstate *)alloc_node(0, node_list.size(), node_list.data(), libcall_list.data());
+    ASSERT_NE(node, nullptr) << "Node not allocated";
+    EXPECT_EQ(node->repr, PROGSTATE_REPR_LIST) << "Table used with the tables disabled";
+
+    set_progstate_repr_policy(PROGSTATE_TABLE_MIN_EDGES, PROGSTATE_TABLE_MAX_SPAN_RATIO);
+    node = (struct abstract_progstate *)alloc_node(1, node_list.size(), node_list.data(), libcall_list.data());
+    ASSERT_NE(node, nullptr) << "Node not allocated";
+    EXPECT_EQ(node->repr, PROGSTATE_REPR_TABLE) << "Table not used with the default policy";
+    EXPECT_LE(PROGSTATE_TABLE_SIZE(PROGSTATE_TABLE_MAX_SPAN_RATIO * PROGSTATE_TABLE_MIN_EDGES),
+              PROGSTATE_SIZE(PROGSTATE_TABLE_MIN_EDGES) + sizeof(unsigned int)) << "Table larger than the list";
+
+    node = (struct abstract_progstate *)alloc_node(2, node_list.size() - 1, node_list.data(), libcall_list.data());
+    ASSERT_NE(node, nullptr) << "Node not allocated";
+    EXPECT_EQ(node->repr, PROGSTATE_REPR_LIST) << "Table used below the minimum number of edges";
+    destroy_graph ();
+}
+
+
+TEST(MemGraph_GraphCreation, AllowsetMode) {
+    initialize_graph(NULL, 0);
+    EXPECT_EQ(get_policy_mode(), POLICY_MODE_AUTOMATON) << "Invalid default policy mode";
+    unsigned long libcall_list[4] = {200, 3, 64, 65};
+    ASSERT_NE(alloc_allowset(4, libcall_list), nullptr) << "Allow-set not allocated";
+    EXPECT_EQ(alloc_node(0, 1, libcall_list, libcall_list), nullptr) << "Node allocated in to an allow-set";
+    finalize_graph();
+    ASSERT_EQ(verify_graph(), 1) << "Graph verification failed";
+    EXPECT_EQ(get_policy_mode(), POLICY_MODE_ALLOWSET) << "Invalid policy mode";
+
+    struct memory_pool *pool = (struct memory_pool *)get_graph();
+    EXPECT_EQ(pool->metadata.nodes_table_size, ALLOWSET_SIZE(201)) << "Invalid size of the allow-set";
+    EXPECT_EQ(pool->metadata.num_nodes, 0) << "Nodes in an allow-set";
+
+    reset_progstate();
+    for (unsigned long libcall = 0; libcall < 300; libcall++) {
+        bool expected = std::find(libcall_list, libcall_list + 4, libcall) != libcall_list + 4;
+        EXPECT_EQ(is_libcall_allowed(libcall), expected) << "Invalid lookup of libc ID " << libcall;
+        EXPECT_EQ(is_state_transition_valid(libcall), expected) << "Invalid transition on libc ID " << libcall;
+    }
+    EXPECT_EQ(transition_to_state(64), 0) << "Allowed libc ID rejected";
+    EXPECT_EQ(transition_to_state(4), ERROR_INVALID_STATE) << "Libc ID outside the allow-set accepted";
+
+    unsigned long *bitmap = (unsigned long *)((char *)pool + pool->metadata.nodes_table_offset);
+    bitmap[0] ^= 1UL << 4;
+    EXPECT_EQ(verify_graph(), ERROR_INVALID_GRAPH) << "Corrupted allow-set not detected";
+    bitmap[0] ^= 1UL << 4;
+    pool->metadata.policy_mode = 0xFF;
+    EXPECT_EQ(verify_graph(), ERROR_INVALID_GRAPH) << "Unknown policy mode not detected";
+    pool->metadata.policy_mode = POLICY_MODE_ALLOWSET;
+
+    store_graph("test-allowset.graph");
+    destroy_graph ();
+    load_graph("test-allowset.graph");
+    EXPECT_EQ(get_policy_mode(), POLICY_MODE_ALLOWSET) << "Policy mode not stored";
+    EXPECT_TRUE(is_libcall_allowed(200)) << "Allow-set not stored";
+    EXPECT_EQ(remove("test-allowset.graph"), 0) << "Graph file not removed";
+    destroy_graph ();
+}
+
+TEST(MemGraph_GraphCreation, AllowsetNeedsEmptyGraph) {
+    initialize_graph(NULL, 0);
+    unsigned long node_list[1] = {0};
+    unsigned long libcall_list[1] = {10};
+    alloc_node(0, 1, node_list, libcall_list);
+    EXPECT_EQ(alloc_allowset(1, libcall_list), nullptr) << "Allow-set allocated in to a graph with nodes";
+    finalize_graph();
+    ASSERT_EQ(verify_graph(), 1) << "Graph verification failed";
+    EXPECT_FALSE(is_libcall_allowed(10)) << "Allow-set lookup on an automaton";
+
+    initialize_graph(NULL, 0);
+    libcall_list[0] = ~0UL;
+    EXPECT_EQ(alloc_allowset(1, libcall_list), nullptr) << "Allow-set allocated beyond the pool";
+    destroy_graph ();
+}
+
+
+/**
+ * Nodes of a pushdown graph as {id, {{libc ID, next state}, ...}}, replayed from the entry state
+ */
+typedef std::vector<std::pair<unsigned long, std::vector<std::pair<unsigned long, unsigned long>>>> PushdownNodes;
+
+static void build_pushdown_graph(const PushdownNodes &nodes) {
+    initialize_graph(NULL, 0);
+    for (const auto &node : nodes) {
+        std::vector<unsigned long> node_list, libcall_list;
+        for (const auto &edge : node.second) {
+            libcall_list.push_back(edge.first);
+            node_list.push_back(edge.second);
+        }
+        alloc_node(node.first, node_list.size(), node_list.data(), libcall_list.data());
+    }
+    finalize_graph();
+}
+
+static bool replay_pushdown(const std::vector<unsigned long> &trace) {
+    reset_progstate();
+    for (unsigned long libcall : trace) {
+        if (!is_state_transition_valid(libcall) || transition_to_state(libcall) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST(MemGraph_GraphCreation, PushdownCallString) {
+    // main calls f twice, f returns to the call site it was called from
+    build_pushdown_graph({
+        {0,  {{1, 1}}},
+        {1,  {{LIBCALL_CALL, 10}, {LIBCALL_CALL_RETURN, 2}}},
+        {2,  {{2, 3}}},
+        {3,  {{LIBCALL_CALL, 10}, {LIBCALL_CALL_RETURN, 4}}},
+        {4,  {{3, 5}}},
+        {5,  {}},
+        {10, {{7, 11}}},
+        {11, {{LIBCALL_RETURN, 2}, {LIBCALL_RETURN, 4}}},
+    });
+    ASSERT_EQ(verify_graph(), 1) << "Graph verification failed";
+    EXPECT_EQ(get_policy_mode(), POLICY_MODE_PUSHDOWN) << "Invalid policy mode";
+
+    EXPECT_TRUE(replay_pushdown({1, 7, 2, 7, 3})) << "Valid trace rejected";
+    EXPECT_FALSE(replay_pushdown({1, 7, 3})) << "Return to the other call site accepted";
+    EXPECT_FALSE(replay_pushdown({1, 7, 2, 7, 2})) << "Return to the other call site accepted";
+    EXPECT_FALSE(replay_pushdown({1, LIBCALL_CALL, 7})) << "Reserved libc ID accepted";
+    destroy_graph ();
+}
+
+TEST(MemGraph_GraphCreation, PushdownManyCallers) {
+    // main calls f from 4 sites, and f or g from the third one: enough edges on the exit of f and on the third
+    // call site for a table
+    build_pushdown_graph({
+        {0,  {{LIBCALL_CALL, 10}, {LIBCALL_CALL_RETURN, 1}}},
+        {1,  {{LIBCALL_CALL, 10}, {LIBCALL_CALL_RETURN, 2}}},
+        {2,  {{LIBCALL_CALL, 10}, {LIBCALL_CALL_RETURN, 3}, {LIBCALL_CALL, 20}, {LIBCALL_CALL_RETURN, 4}}},
+        {3,  {{LIBCALL_CALL, 10}, {LIBCALL_CALL_RETURN, 4}}},
+        {4,  {{7, 5}}},
+        {5,  {}},
+        {10, {{5, 11}}},
+        {11, {{LIBCALL_RETURN, 1}, {LIBCALL_RETURN, 2}, {LIBCALL_RETURN, 3}, {LIBCALL_RETURN, 4}}},
+        {20, {{6, 21}}},
+        {21, {{LIBCALL_RETURN, 4}}},
+    });
+    ASSERT_EQ(verify_graph(), 1) << "Graph verification failed";
+
+    EXPECT_TRUE(replay_pushdown({5, 5, 5, 5, 7})) << "Valid trace rejected";
+    EXPECT_TRUE(replay_pushdown({5, 5, 6, 7})) << "Valid trace rejected";
+    EXPECT_FALSE(replay_pushdown({5, 5, 7})) << "Return to a later call site accepted";
+    destroy_graph ();
+}
+
+TEST(MemGraph_GraphCreation, PushdownCallSites) {
+    // Two call sites of f on state 2, returning to 3 and to 4: both are followed
+    build_pushdown_graph({
+        {0,  {{LIBCALL_CALL, 10}, {LIBCALL_CALL_RETURN, 2}}},
+        {2,  {{LIBCALL_CALL, 10}, {LIBCALL_CALL_RETURN, 3}, {LIBCALL_CALL, 10}, {LIBCALL_CALL_RETURN, 4}}},
+        {3,  {{LIBCALL_CALL, 10}, {LIBCALL_CALL_RETURN, 4}}},
+        {4,  {{7, 5}}},
+        {5,  {}},
+        {10, {{5, 11}}},
+        {11, {{LIBCALL_RETURN, 2}, {LIBCALL_RETURN, 3}, {LIBCALL_RETURN, 4}}},
+    });
+    ASSERT_EQ(verify_graph(), 1) << "Graph verification failed";
+
+    EXPECT_TRUE(replay_pushdown({5, 5, 5, 7})) << "Valid trace rejected";
+    EXPECT_TRUE(replay_pushdown({5, 5, 7})) << "Valid trace rejected";
+    EXPECT_FALSE(replay_pushdown({5, 7})) << "Return to a later call site accepted";
+    EXPECT_FALSE(replay_pushdown({5, 5, 5, 5})) << "Call from the last return state accepted";
+    destroy_graph ();
+}
+
+TEST(MemGraph_GraphCreation, PushdownManyCallSites) {
+    // The call to f, the only one to reach 5, comes after many calls to d, a function without any libc call
+    PushdownNodes nodes = {{1, {}}, {10, {{5, 11}}}, {11, {}}, {20, {}}};
+    std::vector<std::pair<unsigned long, unsigned long>> edges;
+    for (unsigned long i = 0; i < 4 * PUSHDOWN_CONFIGS_MAX; i++) {
+        edges.push_back({LIBCALL_CALL, 20});
+    }
+    edges.push_back({LIBCALL_CALL, 10});
+    edges.insert(edges.end(), 4 * PUSHDOWN_CONFIGS_MAX + 1, {LIBCALL_CALL_RETURN, 1});
+    nodes.push_back({0, edges});
+    build_pushdown_graph(nodes);
+    ASSERT_EQ(verify_graph(), 1) << "Graph verification failed";
+
+    EXPECT_TRUE(replay_pushdown({5})) << "Valid trace rejected";
+    EXPECT_FALSE(replay_pushdown({5, 5})) << "Libc call past the end accepted";
+    destroy_graph ();
+}
+
+TEST(MemGraph_GraphCreation, PushdownCallStringExhausted) {
+    // main calls r, r recurses on 5 and returns on 6, then 8 for each return
+    build_pushdown_graph({
+        {0,  {{LIBCALL_CALL, 20}, {LIBCALL_CALL_RETURN, 1}}},
+        {1,  {{9, 2}}},
+        {2,  {}},
+        {20, {{5, 21}, {6, 23}}},
+        {21, {{LIBCALL_CALL, 20}, {LIBCALL_CALL_RETURN, 22}}},
+        {22, {{8, 23}}},
+        {23, {{LIBCALL_RETURN, 22}, {LIBCALL_RETURN, 1}}},
+    });
+    ASSERT_EQ(verify_graph(), 1) << "Graph verification failed";
+
+    auto trace = [](unsigned long calls, unsigned long returns) {
+        std::vector<unsigned long> libcalls(calls, 5);
+        libcalls.push_back(6);
+        libcalls.insert(libcalls.end(), returns, 8);
+        libcalls.push_back(9);
+        return libcalls;
+    };
+    // Within the call string the returns are exact
+    EXPECT_TRUE(replay_pushdown(trace(4, 4))) << "Valid trace rejected";
+    EXPECT_FALSE(replay_pushdown(trace(4, 3))) << "Early return from the recursion accepted";
+    // Beyond it, the dropped calls may return to any caller
+    EXPECT_TRUE(replay_pushdown(trace(CALL_STRING_MAX + 4, CALL_STRING_MAX + 4))) << "Valid trace rejected";
+    EXPECT_TRUE(replay_pushdown(trace(CALL_STRING_MAX + 4, CALL_STRING_MAX))) << "Exhausted call string not relaxed";
+    destroy_graph ();
+}
+
+TEST(MemGraph_GraphCreation, PerThreadCursors) {
+    // Two loops out of the entry state: 1 then 2, or 3 then 4
+    initialize_graph(NULL, 0);
+    unsigned long node_list[2] = {1, 2};
+    unsigned long libcall_list[2] = {1, 3};
+    alloc_node(0, 2, node_list, libcall_list);
+    node_list[0] = 0; libcall_list[0] = 2;
+    alloc_node(1, 1, node_list, libcall_list);
+    node_list[0] = 0; libcall_list[0] = 4;
+    alloc_node(2, 1, node_list, libcall_list);
+    finalize_graph();
+
+    // Each thread moves its own cursor over the shared graph, interleaved with the other thread
+    auto replay = [](unsigned long first, unsigned long second, int *rejected) {
+        struct progstate_cursor cursor;
+        attach_progstate_cursor(&cursor, get_graph());
+        for (int i = 0; i < 100000; i++) {
+            *rejected += (cursor_transition_to_state(&cursor, first) < 0);
+            *rejected += (cursor_transition_to_state(&cursor, second) != 0);
+        }
+    };
+    int rejected[2] = {0, 0};
+    std::thread thread1(replay, 1, 2, &rejected[0]);
+    std::thread thread2(replay, 3, 4, &rejected[1]);
+    thread1.join();
+    thread2.join();
+    EXPECT_EQ(rejected[0], 0) << "Transitions of the first thread rejected";
+    EXPECT_EQ(rejected[1], 0) << "Transitions of the second thread rejected";
+
+    // A copied cursor (a cloned task) continues on its own from the same state
+    struct progstate_cursor parent, child;
+    attach_progstate_cursor(&parent, get_graph());
+    ASSERT_EQ(cursor_transition_to_state(&parent, 1), 1);
+    child = parent;
+    EXPECT_EQ(cursor_transition_to_state(&parent, 2), 0);
+    EXPECT_EQ(is_cursor_transition_valid(&child, 1), 0) << "Copied cursor moved along with the original";
+    EXPECT_EQ(cursor_transition_to_state(&child, 2), 0);
+    destroy_graph ();
+}
+
+TEST(MemGraph_GraphCreation, ViolationMode) {
+    initialize_graph(NULL, 0);
+    EXPECT_EQ(get_violation_mode(), VIOLATION_MODE_ENFORCE) << "Graph does not enforce by default";
+    EXPECT_EQ(set_violation_mode(VIOLATION_MODE_LEARN + 1), ERROR_INVALID_ARG) << "Unknown violation mode set";
+    EXPECT_EQ(set_violation_mode(VIOLATION_MODE_AUDIT), 1) << "Violation mode not set";
+    finalize_graph();
+    EXPECT_EQ(set_violation_mode(VIOLATION_MODE_ENFORCE), ERROR_INVALID_STATE) << "Violation mode set once finalized";
+    EXPECT_EQ(verify_graph(), 1) << "Graph verification failed";
+    EXPECT_EQ(get_graph_violation_mode(get_graph()), VIOLATION_MODE_AUDIT) << "Violation mode not stored";
+
+    // Covered by the checksum, and limited to the known modes
+    struct memory_pool *pool = (struct memory_pool *)get_graph();
+    pool->metadata.violation_mode = VIOLATION_MODE_ENFORCE;
+    EXPECT_NE(verify_graph(), 1) << "Tampered violation mode not detected";
+    pool->metadata.violation_mode = VIOLATION_MODE_LEARN + 1;
+    EXPECT_NE(verify_graph(), 1) << "Unknown violation mode accepted";
+    destroy_graph ();
+}
+
+TEST(MemGraph_GraphCreation, CursorResync) {
+    // 0 -1-> 1 -2-> 2 -3-> 0, libc call 4 from none
+    initialize_graph(NULL, 0);
+    unsigned long node_list[1];
+    unsigned long libcall_list[1];
+    for (unsigned long id = 0; id < 3; id++) {
+        node_list[0] = (id + 1) % 3; libcall_list[0] = id + 1;
+        alloc_node(id, 1, node_list, libcall_list);
+    }
+    finalize_graph();
+
+    struct progstate_cursor cursor;
+    attach_progstate_cursor(&cursor, get_graph());
+    EXPECT_LT(cursor_transition_to_state(&cursor, 3), 0) << "Libc call not allowed from the entry accepted";
+    EXPECT_EQ(cursor_resync_to_state(&cursor, 3), 0) << "Not resynced past the libc call";
+    EXPECT_EQ(cursor_resync_to_state(&cursor, 2), 2) << "Not resynced past the libc call";
+    EXPECT_EQ(cursor_transition_to_state(&cursor, 3), 0) << "Resynced cursor does not continue";
+    EXPECT_EQ(cursor_resync_to_state(&cursor, 4), ERROR_INVALID_STATE) << "Resynced to a libc call of no state";
+    EXPECT_EQ(cursor.progstate, 0UL) << "Cursor moved without a state to resync to";
+    destroy_graph ();
+}
+
+
 /* ------------------------------------------------------------------------- */
 /* ------------------- GRAPH SAVE & LOAD TEST CASES ------------------------ */
 /* ------------------------------------------------------------------------- */
@@ -232,6 +813,8 @@ TEST(MemGraph_GraphSaveLoad, Verify1) {
   graph = get_graph();
   ASSERT_NE(graph, nullptr) << "Graph not loaded";
 
+  EXPECT_EQ(std::filesystem::file_size("test.graph"), get_graph_size()) << "Graph file not trimmed to the graph size";
+
   // Remove the file "test.graph"
   int result = remove("test.graph");
   EXPECT_EQ(result, 0) << "Graph file not removed";
@@ -239,6 +822,61 @@ TEST(MemGraph_GraphSaveLoad, Verify1) {
 }
 
 
+TEST(MemGraph_GraphSaveLoad, MapGraphLazy) {
+    initialize_graph(NULL, 0);
+    unsigned long node_list[3] = {1, 2, 0};
+    unsigned long libcall_list[3] = {10, 20, 30};
+    for (unsigned long i = 0; i < 3; i++) {
+        alloc_node(i, 1, node_list + i, libcall_list + i);
+    }
+    finalize_graph();
+    struct memory_pool *pool = (struct memory_pool *)get_graph();
+    unsigned long node2 = ((unsigned int *)((char *)pool + pool->metadata.node_index_offset))[2];
+    unsigned long size = get_graph_size();
+    store_graph("test-lazy.graph");
+    destroy_graph();
+
+    // Replaced by rename, no temporary file left behind
+    for (const auto &entry : std::filesystem::directory_iterator(".")) {
+        EXPECT_NE(entry.path().filename().string().rfind("test-lazy.graph.", 0), 0UL) << "Temporary file left";
+    }
+    EXPECT_EQ(std::filesystem::file_size("test-lazy.graph"), size) << "Graph file not of the graph size";
+    auto perms = std::filesystem::status("test-lazy.graph").permissions();
+    EXPECT_EQ(perms & std::filesystem::perms::all, std::filesystem::perms(0644)) << "Graph file not readable by all";
+
+    ASSERT_EQ(map_graph("test-lazy.graph"), 1) << "Graph not mapped";
+    EXPECT_EQ(alloc_node(3, 1, node_list, libcall_list), nullptr) << "Node allocated in to a mapped graph";
+    reset_progstate();
+    EXPECT_EQ(transition_to_state(10), 1) << "Invalid transition in the mapped graph";
+    EXPECT_EQ(transition_to_state(20), 2) << "Invalid transition in the mapped graph";
+    EXPECT_EQ(transition_to_state(30), 0) << "Invalid transition in the mapped graph";
+    EXPECT_EQ(verify_graph(), 1) << "Mapped graph verification failed";
+    destroy_graph();
+
+    // A corrupted node is only found on its lookup, or by the full verification
+    {
+        std::fstream file("test-lazy.graph", std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(node2 + offsetof(struct abstract_progstate, repr));
+        file.put(0x7F);
+    }
+    ASSERT_EQ(map_graph("test-lazy.graph"), 1) << "Graph with a corrupted node not mapped lazily";
+    reset_progstate();
+    EXPECT_EQ(transition_to_state(10), 1) << "Invalid transition before the corrupted node";
+    transition_to_state(20);
+    EXPECT_LT(transition_to_state(30), 0) << "Transition from a corrupted node";
+    struct progstate_cursor cursor;
+    attach_progstate_cursor(&cursor, get_graph());
+    EXPECT_EQ(cursor_resync_to_state(&cursor, 30), ERROR_INVALID_STATE) << "Resynced through a corrupted node";
+    EXPECT_NE(verify_graph(), 1) << "Corrupted node not detected";
+    destroy_graph();
+
+    std::filesystem::resize_file("test-lazy.graph", size - 1);
+    EXPECT_EQ(map_graph("test-lazy.graph"), ERROR_INVALID_GRAPH) << "Truncated graph mapped";
+    EXPECT_EQ(get_graph(), nullptr) << "Truncated graph left mapped";
+    EXPECT_EQ(remove("test-lazy.graph"), 0) << "Graph file not removed";
+    EXPECT_EQ(map_graph("test-lazy.graph"), ERROR_INVALID_ARG) << "Missing graph file mapped";
+}
+
 /* ------------------------------------------------------------------------- */
 /* -------------------- COMPREHENSIVE GRAPH TESTS -------------------------- */
 /* ------------------------------------------------------------------------- */
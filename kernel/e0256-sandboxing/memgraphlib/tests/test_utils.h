@@ -18,6 +18,7 @@ enum tc_data_type {
 void cleanup_test_data() {
     tc_data_size = 0;
     test_cases.clear();
+    test_cases_results.clear();
     tc_edge_listings.clear();
     tc_libcall_listings.clear();
 }
@@ -81,6 +82,12 @@ bool read_test_data(const char *filename) {
     }
 
     infile.close();
+
+    // Nodes without an edge listing (e.g. the exit node) have no edges
+    if (tc_edge_listings.size() < tc_data_size) {
+        tc_edge_listings.resize(tc_data_size);
+        tc_libcall_listings.resize(tc_data_size);
+    }
     return true;
 }
 
@@ -0,0 +1,310 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <memgraph.h>
+
+/* ------------------------------------------------------------------------- */
+/* ----------------------------- TRACE READING ----------------------------- */
+/* ------------------------------------------------------------------------- */
+
+/* Bytes read from a trace file at once, the traces themselves are never held in memory */
+#define TRACE_READ_CHUNK        (1 << 20)
+
+/**
+ * Buffered byte reader over a trace file
+ */
+class TraceReader {
+public:
+    explicit TraceReader(const std::string &path) : file(fopen(path.c_str(), "rb")), buffer(TRACE_READ_CHUNK) {}
+    ~TraceReader() {
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    bool ok() const { return file != nullptr; }
+
+    /* Next byte of the file, EOF at the end */
+    int next() {
+        if (pos == len) {
+            len = fread(buffer.data(), 1, buffer.size(), file);
+            pos = 0;
+            if (len == 0) {
+                return EOF;
+            }
+        }
+        return (unsigned char)buffer[pos++];
+    }
+
+private:
+    FILE *file;
+    std::vector<char> buffer;
+    size_t pos = 0;
+    size_t len = 0;
+};
+
+/**
+ * Libc ID of each function name, from the listing of LibcListGen (`<id>:<name>` per line)
+ */
+static bool read_libc_list(const std::string &path, std::unordered_map<std::string, unsigned long> &ids) {
+    std::ifstream infile(path);
+    if (!infile) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(infile, line)) {
+        size_t sep = line.find(':');
+        if (sep == std::string::npos || sep == 0) {
+            continue;
+        }
+        ids[line.substr(sep + 1)] = std::stoul(line.substr(0, sep));
+    }
+    return true;
+}
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------------ REPLAY ----------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+/**
+ * First libc call of a trace not accepted by the graph
+ */
+struct Divergence {
+    unsigned long trace;        // Trace number in the file, from 1 (always 1 for an ltrace output)
+    unsigned long event;        // Index of the libc call in the trace
+    unsigned long progstate;    // State the libc call was made from
+    unsigned long libcall;
+};
+
+struct ReplayResult {
+    bool opened = false;
+    unsigned long traces = 0;
+    unsigned long events = 0;
+    unsigned long unmapped = 0; // ltrace calls with no libc ID, not part of the policy
+    std::vector<Divergence> divergences;
+};
+
+/**
+ * Replay of a trace with a cursor of its own, the rest of a trace is skipped after its first divergence
+ */
+class TraceReplay {
+public:
+    TraceReplay(void *graph, ReplayResult &result) : graph(graph), result(result) { begin(); }
+
+    void begin() {
+        attach_progstate_cursor(&cursor, graph);
+        events = 0;
+        diverged = false;
+        result.traces++;
+    }
+
+    void libcall(unsigned long libcall) {
+        if (diverged) {
+            return;
+        }
+        unsigned long progstate = cursor.progstate;
+        if (cursor_transition_to_state(&cursor, libcall) < 0) {
+            result.divergences.push_back({result.traces, events, progstate, libcall});
+            diverged = true;
+        }
+        events++;
+        result.events++;
+    }
+
+private:
+    void *graph;
+    ReplayResult &result;
+    struct progstate_cursor cursor;
+    unsigned long events = 0;
+    bool diverged = false;
+};
+
+/**
+ * Whitespace separated libc IDs, one trace per line (as in tests/test_data), every trace from the entry state
+ */
+static void replay_ids(TraceReader &reader, void *graph, ReplayResult &result) {
+    TraceReplay replay(graph, result);
+    unsigned long libcall = 0;
+    bool inNumber = false, inTrace = false;
+    for (int c = reader.next();; c = reader.next()) {
+        if (c >= '0' && c <= '9') {
+            libcall = libcall * 10 + (c - '0');
+            inNumber = true;
+            continue;
+        }
+        if (inNumber) {
+            replay.libcall(libcall);
+            libcall = 0;
+            inNumber = false;
+            inTrace = true;
+        }
+        if (c == EOF) {
+            break;
+        }
+        if (c == '\n' && inTrace) {
+            replay.begin();
+            inTrace = false;
+        }
+    }
+    if (!inTrace) {
+        // No libc call after the last line break
+        result.traces--;
+    }
+}
+
+/**
+ * Output of ltrace for a single process, `name(args...) = ret` per libc call. Signal, exit and resumed lines, and
+ * the calls not in the libc listing, are skipped.
+ */
+static void replay_ltrace(TraceReader &reader, void *graph, const std::unordered_map<std::string, unsigned long> &ids,
+                          ReplayResult &result) {
+    TraceReplay replay(graph, result);
+    std::string name;
+    bool lineStart = true, inName = false;
+    for (int c = reader.next(); c != EOF; c = reader.next()) {
+        if (c == '\n') {
+            lineStart = true;
+            inName = false;
+            continue;
+        }
+        if (lineStart) {
+            lineStart = false;
+            inName = std::isalpha(c) || c == '_';
+            name.clear();
+        }
+        if (!inName) {
+            continue;
+        }
+        if (c == '(') {
+            auto it = ids.find(name);
+            if (it == ids.end()) {
+                result.unmapped++;
+            } else {
+                replay.libcall(it->second);
+            }
+            inName = false;
+        } else if (std::isalnum(c) || c == '_') {
+            name.push_back(c);
+        } else {
+            inName = false;
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------------- DRIVER ---------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+static void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [-j <threads>] [--libc-list=<file> --ltrace] <graph> <trace>...\n"
+              << "  Replays each trace file over a graph stored by store_graph(), and reports the first libc call\n"
+              << "  of each trace the graph does not accept. Trace files are replayed in parallel.\n"
+              << "  A trace file holds whitespace separated libc IDs, one trace per line, or with --ltrace the\n"
+              << "  output of ltrace for one process, mapped to libc IDs with the listing of LibcListGen.\n"
+              << "  Exits with 1 if any trace diverges.\n";
+}
+
+/**
+ * @example ./replay_memgraph -j 8 policy.graph run-1.ids run-2.ids
+ * @example ./replay_memgraph --libc-list=libc_listing.lst --ltrace policy.graph app.ltrace
+ */
+int main(int argc, char **argv) {
+    unsigned threads = std::max(1U, std::thread::hardware_concurrency());
+    std::string libcListFile, graphFile;
+    std::vector<std::string> traceFiles;
+    bool ltrace = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = std::max(1, atoi(argv[++i]));
+        } else if (strncmp(argv[i], "--libc-list=", 12) == 0) {
+            libcListFile = argv[i] + 12;
+        } else if (strcmp(argv[i], "--ltrace") == 0) {
+            ltrace = true;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 2;
+        } else if (graphFile.empty()) {
+            graphFile = argv[i];
+        } else {
+            traceFiles.push_back(argv[i]);
+        }
+    }
+    if (graphFile.empty() || traceFiles.empty() || (ltrace && libcListFile.empty())) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::unordered_map<std::string, unsigned long> ids;
+    if (!libcListFile.empty() && !read_libc_list(libcListFile, ids)) {
+        std::cerr << "Failed to read the libc listing " << libcListFile << "\n";
+        return 2;
+    }
+    std::unordered_map<unsigned long, std::string> names;
+    for (const auto &entry : ids) {
+        names[entry.second] = entry.first;
+    }
+
+    // Verified on load, then only read: every thread walks it with cursors of its own
+    load_graph(graphFile.c_str());
+    void *graph = get_graph();
+
+    std::vector<ReplayResult> results(traceFiles.size());
+    std::atomic<size_t> nextFile{0};
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < std::min<size_t>(threads, traceFiles.size()); t++) {
+        workers.emplace_back([&]() {
+            for (size_t i = nextFile++; i < traceFiles.size(); i = nextFile++) {
+                TraceReader reader(traceFiles[i]);
+                if (!reader.ok()) {
+                    continue;
+                }
+                results[i].opened = true;
+                if (ltrace) {
+                    replay_ltrace(reader, graph, ids, results[i]);
+                } else {
+                    replay_ids(reader, graph, results[i]);
+                }
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    int status = 0;
+    for (size_t i = 0; i < traceFiles.size(); i++) {
+        const ReplayResult &result = results[i];
+        if (!result.opened) {
+            std::cerr << traceFiles[i] << ": failed to open\n";
+            status = 2;
+            continue;
+        }
+        for (const Divergence &d : result.divergences) {
+            auto name = names.find(d.libcall);
+            std::cout << traceFiles[i] << ":" << d.trace << ": diverges at libc call " << d.event << ": "
+                      << d.libcall << (name != names.end() ? " (" + name->second + ")" : "")
+                      << " not allowed from state " << d.progstate << "\n";
+        }
+        std::cout << traceFiles[i] << ": " << result.traces << " traces, " << result.events << " libc calls, "
+                  << result.divergences.size() << " diverged";
+        if (ltrace) {
+            std::cout << ", " << result.unmapped << " calls not in the libc listing";
+        }
+        std::cout << "\n";
+        if (!result.divergences.empty() && status == 0) {
+            status = 1;
+        }
+    }
+
+    destroy_graph();
+    return status;
+}
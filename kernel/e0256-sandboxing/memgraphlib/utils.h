@@ -12,8 +12,9 @@
                     return; \
                 } while(0)
 
+/* Ratelimited, the query path reports each libc call not allowed (a flood in audit mode) */
 #define PRINT_ERROR(msg , ...) do { \
-                    printk(KERN_ERR msg "\n"  __VA_OPT__(,) __VA_ARGS__); \
+                    printk_ratelimited(KERN_ERR msg "\n"  __VA_OPT__(,) __VA_ARGS__); \
                 } while(0)
 
 #define PRINT_DEBUG(msg , ...) do { \
@@ -24,12 +25,14 @@
                     printk(KERN_INFO msg "\n"  __VA_OPT__(,) __VA_ARGS__); \
                 } while(0)
 
-#define MALLOC(size)                kzalloc(size, GFP_KERNEL)
-#define REALLOC(ptr, size)          krealloc(ptr, size, GFP_KERNEL)
+#define MALLOC(size)                kmalloc(size, GFP_KERNEL)
 #define FREE(ptr)                   kfree(ptr)
 #define MEMSET(ptr, val, size)      memset(ptr, val, size)
 #define MEMCPY(dst, src, size)      memcpy(dst, src, size)
 
+/* Each task moves its own cursor (task_struct::sandbox_cursor), the cursor-less API is not used */
+#define PROGSTATE_LOCAL
+
 #else
 
 #define PRINT_ERROR_AND_EXIT(msg , ...) do { \
@@ -50,11 +53,13 @@
                 } while(0)
 
 #define MALLOC(size)                malloc(size)
-#define REALLOC(ptr, size)          realloc(ptr, size)
 #define FREE(ptr)                   free(ptr)
 #define MEMSET(ptr, val, size)      memset(ptr, val, size)
 #define MEMCPY(dst, src, size)      memcpy(dst, src, size)
 
+/* Userspace threads (benchmarks) walk the shared graph, each with its own cursor */
+#define PROGSTATE_LOCAL             _Thread_local
+
 #endif // __KERNEL__
 
 /* ============================================================================ */
@@ -0,0 +1,39 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sandbox
+
+#if !defined(__SANDBOX_TRACE_H_INCLUDED__) || defined(TRACE_HEADER_MULTI_READ)
+#define __SANDBOX_TRACE_H_INCLUDED__
+
+#include <linux/tracepoint.h>
+
+/*
+ * Libc call not allowed by the graph of a process in VIOLATION_MODE_AUDIT or VIOLATION_MODE_LEARN
+ */
+TRACE_EVENT(sandbox_violation,
+
+    TP_PROTO(pid_t pid, unsigned long progstate, unsigned long libcall),
+
+    TP_ARGS(pid, progstate, libcall),
+
+    TP_STRUCT__entry(
+        __field(pid_t,          pid)
+        __field(unsigned long,  progstate)
+        __field(unsigned long,  libcall)
+    ),
+
+    TP_fast_assign(
+        __entry->pid        = pid;
+        __entry->progstate  = progstate;
+        __entry->libcall    = libcall;
+    ),
+
+    TP_printk("pid=%d state=%lu libcall=%lu", __entry->pid, __entry->progstate, __entry->libcall)
+);
+
+#endif // __SANDBOX_TRACE_H_INCLUDED__
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sandbox_trace
+#include <trace/define_trace.h>
@@ -1,53 +1,433 @@
 #include <linux/kernel.h>
 #include <linux/syscalls.h>
 #include <linux/sched.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/elf.h>
+#include <linux/fs.h>
+#include <linux/init.h>
+#include <linux/kref.h>
+#include <linux/workqueue.h>
+#include <linux/ratelimit.h>
+#include <linux/capability.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
 #include "memgraphlib/export/memgraph.h"
 
-unsigned char *kernel_buffer = NULL;
+#ifdef CONFIG_E0_256_SANDBOX_PROJECT
+#define CREATE_TRACE_POINTS
+#include "sandbox_trace.h"
+#endif // CONFIG_E0_256_SANDBOX_PROJECT
 
-SYSCALL_DEFINE2(sandbox_init, unsigned char*, data, unsigned long, size)
+#ifdef CONFIG_E0_256_SANDBOX_PROJECT
+/*
+ * Policy of a sandboxed process: the graph embedded in its executable, read in place. Its pages are pinned
+ * read-only and mapped in to the kernel, instead of being copied. The pinned pages have to be the page cache
+ * pages of the executable, so a write by the process to the section (after an mprotect) gets a copy-on-write
+ * page of its own and leaves the pinned pages unchanged.
+ *
+ * The policy is shared by refcount between the threads of the process and the processes forked from it,
+ * and dropped on exec. It is released from a work item, as the last reference may be put from free_task.
+ * It only holds the (read-only) graph, what sandbox_ctl changes is in the sandbox_process.
+ */
+struct sandbox_policy {
+    struct kref                 ref;
+    struct work_struct          release_work;
+    struct page                 **pages;
+    unsigned long               num_pages;
+    void                        *mapping;
+};
+
+/*
+ * Libc calls not allowed, recorded in VIOLATION_MODE_LEARN until drained by sandbox_ctl, the oldest
+ * records are overwritten once full
+ */
+#define SANDBOX_LEARN_RING_SIZE     (1024)
+#define SANDBOX_DRAIN_BATCH         (16)
+
+struct sandbox_learn_ring {
+    spinlock_t                  lock;
+    unsigned long               head;               // Records written
+    unsigned long               tail;               // Records drained (or overwritten)
+    struct sandbox_learn_record records[SANDBOX_LEARN_RING_SIZE];
+};
+
+/*
+ * Handling of the violations of a process, shared by the tasks sharing its mm (its threads) and copied for a
+ * process forked from it, so that sandbox_ctl leaves the other processes of the policy as they are. A copy
+ * keeps the violation mode, with a learn ring and a ratelimit of its own.
+ *
+ * The violation mode starts as the one of the graph, and is only read on a libc call not allowed.
+ */
+struct sandbox_process {
+    struct kref                 ref;
+    int                         mode;               // VIOLATION_MODE_*
+    struct ratelimit_state      audit_ratelimit;    // Of the violation tracepoint
+    struct sandbox_learn_ring   *learn;             // Set once, when first in VIOLATION_MODE_LEARN
+};
+
+/*
+ * Sandbox state of a task, pointed to by task_struct::sandbox_cursor through its cursor. Each thread moves
+ * its own cursor over the shared graph, so a transition writes only to the state of the current task and
+ * needs no locking. The states are cache line aligned, not to share a line between threads.
+ */
+struct sandbox_task {
+    struct progstate_cursor cursor;
+    struct sandbox_policy   *policy;
+    struct sandbox_process  *process;
+};
+
+static struct kmem_cache *sandbox_task_cache = NULL;
+
+static int __init sandbox_task_cache_init(void)
 {
-    unsigned long retval = 0;
-#ifndef CONFIG_E0_256_SANDBOX_PROJECT
-    printk(KERN_INFO "Sandbox Init Syscall:  NOT ENABLED\n");
-    retval = -ENOSYS;
-#else
-    printk(KERN_INFO "Sandbox Init Syscal with buffer size %ld\n", size);
-    if (size == 0 || !data) {
+    sandbox_task_cache = KMEM_CACHE(sandbox_task, SLAB_HWCACHE_ALIGN | SLAB_PANIC);
+    return 0;
+}
+core_initcall(sandbox_task_cache_init);
+
+static struct sandbox_task *sandbox_task_of(struct task_struct *tsk)
+{
+    return tsk->sandbox_cursor ? container_of(tsk->sandbox_cursor, struct sandbox_task, cursor) : NULL;
+}
+
+static void sandbox_policy_release_work(struct work_struct *work)
+{
+    struct sandbox_policy *policy = container_of(work, struct sandbox_policy, release_work);
+
+    if (policy->mapping) {
+        vunmap(policy->mapping);
+    }
+    if (policy->pages) {
+        unpin_user_pages(policy->pages, policy->num_pages);
+        kvfree(policy->pages);
+    }
+    kfree(policy);
+}
+
+static void sandbox_policy_release(struct kref *ref)
+{
+    struct sandbox_policy *policy = container_of(ref, struct sandbox_policy, ref);
+
+    INIT_WORK(&policy->release_work, sandbox_policy_release_work);
+    schedule_work(&policy->release_work);
+}
+
+static void sandbox_process_release(struct kref *ref)
+{
+    struct sandbox_process *process = container_of(ref, struct sandbox_process, ref);
+
+    kvfree(process->learn);
+    kfree(process);
+}
+
+static int sandbox_process_set_mode(struct sandbox_process *process, int mode)
+{
+    if (mode == VIOLATION_MODE_LEARN && !READ_ONCE(process->learn)) {
+        struct sandbox_learn_ring *ring = kvzalloc(sizeof(*ring), GFP_KERNEL);
+        if (!ring) {
+            return -ENOMEM;
+        }
+        spin_lock_init(&ring->lock);
+        // Published before the mode, a violation in VIOLATION_MODE_LEARN always finds the ring
+        if (cmpxchg(&process->learn, NULL, ring) != NULL) {
+            kvfree(ring);
+        }
+    }
+    WRITE_ONCE(process->mode, mode);
+    return 0;
+}
+
+/*
+ * New violation handling in the given mode, for a process attaching a graph or forked from another one
+ * @return the new sandbox_process, NULL if out of memory
+ */
+static struct sandbox_process *sandbox_process_create(int mode)
+{
+    struct sandbox_process *process = kzalloc(sizeof(*process), GFP_KERNEL);
+
+    if (!process) {
+        return NULL;
+    }
+    kref_init(&process->ref);
+    ratelimit_state_init(&process->audit_ratelimit, DEFAULT_RATELIMIT_INTERVAL, DEFAULT_RATELIMIT_BURST);
+    if (sandbox_process_set_mode(process, mode)) {
+        kfree(process);
+        return NULL;
+    }
+    return process;
+}
+
+static void sandbox_learn_record(struct sandbox_process *process, unsigned long progstate, unsigned long libcall)
+{
+    struct sandbox_learn_ring *ring = READ_ONCE(process->learn);
+    struct sandbox_learn_record *record;
+
+    if (!ring) {
+        return;
+    }
+    spin_lock(&ring->lock);
+    if (ring->head - ring->tail == SANDBOX_LEARN_RING_SIZE) {
+        ring->tail++;
+    }
+    record = &ring->records[ring->head % SANDBOX_LEARN_RING_SIZE];
+    record->progstate = progstate;
+    record->libcall = libcall;
+    ring->head++;
+    spin_unlock(&ring->lock);
+}
+
+/*
+ * Slow path of sandbox_dummycall, for a libc call not allowed from the state of the current task
+ */
+static noinline void sandbox_violation(struct sandbox_task *state, unsigned long number)
+{
+    struct sandbox_process *process = state->process;
+    unsigned long progstate = state->cursor.progstate;
+
+    switch (READ_ONCE(process->mode)) {
+    case VIOLATION_MODE_LEARN:
+        sandbox_learn_record(process, progstate, number);
+        fallthrough;
+    case VIOLATION_MODE_AUDIT:
+        if (__ratelimit(&process->audit_ratelimit)) {
+            trace_sandbox_violation(task_pid_nr(current), progstate, number);
+        }
+        // Continues after the libc call, or from the same state if the graph has no transition on it
+        cursor_resync_to_state(&state->cursor, number);
+        break;
+    default:
+        printk(KERN_INFO "Sandbox Dummy Syscall: invalid transition\n");
+        do_exit(SIGKILL);
+    }
+}
+
+static int sandbox_check_graph_pages(struct sandbox_policy *policy)
+{
+    struct file *exe_file = get_mm_exe_file(current->mm);
+    int ret = exe_file ? 0 : -EACCES;
+
+    // Anonymous pages (already written to) have no mapping
+    for (unsigned long i = 0; ret == 0 && i < policy->num_pages; i++) {
+        if (folio_mapping(page_folio(policy->pages[i])) != exe_file->f_mapping) {
+            ret = -EACCES;
+        }
+    }
+
+    if (exe_file) {
+        fput(exe_file);
+    }
+    return ret;
+}
+
+/*
+ * Called by copy_process on clone, the new thread (or process) shares the policy of its parent and continues
+ * from the state of its parent, in O(1) whatever the size of the graph. A task sharing the mm of its parent
+ * (CLONE_VM) shares its violation handling too, a forked process gets a copy.
+ * @return 0 on success, error code otherwise (failing the clone)
+ */
+int sandbox_task_clone(struct task_struct *p, unsigned long clone_flags)
+{
+    struct sandbox_task *parent = sandbox_task_of(current);
+    struct sandbox_task *child;
+
+    // Still the pointer of the parent, copied along with its task_struct
+    p->sandbox_cursor = NULL;
+    if (!parent) {
+        return 0;
+    }
+
+    child = kmem_cache_alloc(sandbox_task_cache, GFP_KERNEL);
+    if (!child) {
+        return -ENOMEM;
+    }
+    *child = *parent;
+    if (clone_flags & CLONE_VM) {
+        kref_get(&child->process->ref);
+    } else {
+        child->process = sandbox_process_create(READ_ONCE(parent->process->mode));
+        if (!child->process) {
+            kmem_cache_free(sandbox_task_cache, child);
+            return -ENOMEM;
+        }
+    }
+    kref_get(&child->policy->ref);
+    p->sandbox_cursor = &child->cursor;
+    return 0;
+}
+
+/*
+ * Called by free_task once the task has exited, and on exec or sandbox_cleanup for the current task
+ */
+void sandbox_task_free(struct task_struct *tsk)
+{
+    struct sandbox_task *state = sandbox_task_of(tsk);
+
+    if (state) {
+        tsk->sandbox_cursor = NULL;
+        kref_put(&state->process->ref, sandbox_process_release);
+        kref_put(&state->policy->ref, sandbox_policy_release);
+        kmem_cache_free(sandbox_task_cache, state);
+    }
+}
+
+/*
+ * Pins, maps and verifies the graph at the given user address of the current process, then makes it the
+ * policy of the current task (and of the tasks cloned from it from now on)
+ */
+static long sandbox_attach_user_graph(unsigned long start, unsigned long size)
+{
+    struct sandbox_policy *policy;
+    struct sandbox_process *process;
+    struct sandbox_task *state;
+    unsigned long num_pages;
+    long pinned, retval;
+
+    if (size == 0 || !start || start + size < start) {
         printk(KERN_WARNING "Invalid buffer or size\n");
         return -EINVAL;
     }
 
-    // Free up an existing allocation if it exists
-    if (kernel_buffer) {
-        kfree(kernel_buffer);
+    policy = kzalloc(sizeof(*policy), GFP_KERNEL);
+    if (!policy) {
+        printk(KERN_ERR "Failed to allocate memory\n");
+        return -ENOMEM;
     }
+    kref_init(&policy->ref);
 
-    // Allocate memory in kernel space
-    kernel_buffer = kmalloc(size, GFP_KERNEL);
-    if (!kernel_buffer) {
+    num_pages = DIV_ROUND_UP(offset_in_page(start) + size, PAGE_SIZE);
+    policy->pages = kvmalloc_array(num_pages, sizeof(struct page *), GFP_KERNEL);
+    if (!policy->pages) {
         printk(KERN_ERR "Failed to allocate memory\n");
-        return -ENOMEM;
+        retval = -ENOMEM;
+        goto out_put;
+    }
+
+    // Pin the pages read-only (no FOLL_WRITE), for the lifetime of the policy
+    pinned = pin_user_pages_fast(start & PAGE_MASK, num_pages, FOLL_LONGTERM, policy->pages);
+    if (pinned < 0) {
+        printk(KERN_ERR "Failed to pin the graph pages\n");
+        retval = pinned;
+        goto out_put;
+    }
+    policy->num_pages = pinned;
+    if ((unsigned long)pinned != num_pages) {
+        printk(KERN_ERR "Failed to pin the graph pages\n");
+        retval = -EFAULT;
+        goto out_put;
     }
 
-    // Copy data from user space to kernel space
-    if (copy_from_user(kernel_buffer, data, size)) {
-        printk(KERN_ERR "Failed to copy data from user space\n");
-        kfree(kernel_buffer);
-        return -EFAULT;
+    retval = sandbox_check_graph_pages(policy);
+    if (retval) {
+        printk(KERN_ERR "Graph is not in the page cache of the executable\n");
+        goto out_put;
     }
 
-    printk(KERN_INFO "Successfully copied data from user space\n");
+    policy->mapping = vmap(policy->pages, num_pages, VM_MAP, PAGE_KERNEL_RO);
+    if (!policy->mapping) {
+        printk(KERN_ERR "Failed to map the graph pages\n");
+        retval = -ENOMEM;
+        goto out_put;
+    }
 
-    //printk(KERN_INFO "Data: %s\n", kernel_buffer);
-    for (int i = 0; i < 20; i++) {
-        printk(KERN_INFO "Data[%d]: %d\n", i, kernel_buffer[i]);
+    printk(KERN_INFO "Verifying in-memory graph\n");
+    if (verify_graph_buffer(policy->mapping + offset_in_page(start), size) != 1) {
+        retval = -EINVAL;
+        goto out_put;
     }
 
-    printk(KERN_INFO "Initializing in-memory graph\n");
-    initialize_graph(kernel_buffer, size);
-    reset_progstate();
+    process = sandbox_process_create(get_graph_violation_mode(policy->mapping + offset_in_page(start)));
+    if (!process) {
+        retval = -ENOMEM;
+        goto out_put;
+    }
+
+    // Replaces the policy of the current task, if any
+    state = sandbox_task_of(current);
+    if (state) {
+        kref_put(&state->process->ref, sandbox_process_release);
+        kref_put(&state->policy->ref, sandbox_policy_release);
+    } else {
+        state = kmem_cache_alloc(sandbox_task_cache, GFP_KERNEL);
+        if (!state) {
+            kref_put(&process->ref, sandbox_process_release);
+            retval = -ENOMEM;
+            goto out_put;
+        }
+        current->sandbox_cursor = &state->cursor;
+    }
+    state->policy = policy;
+    state->process = process;
+    attach_progstate_cursor(&state->cursor, policy->mapping + offset_in_page(start));
+    return 0;
+
+out_put:
+    kref_put(&policy->ref, sandbox_policy_release);
+    return retval;
+}
 
+/*
+ * Attaches the graph of an executable, from the SANDBOX_NOTE_TYPE note of its PT_NOTE segments.
+ * Called by load_elf_binary once the image is mapped, before it runs; only the note headers are read from
+ * the file, the graph (the descriptor of the note) is read in place from the mapped image.
+ * @return 0 if the executable has no sandbox note or its graph is attached, error code otherwise
+ */
+int sandbox_elf_bootstrap(struct file *file, const struct elf64_phdr *phdrs, unsigned int phnum,
+                          unsigned long load_bias)
+{
+    char name[sizeof(SANDBOX_NOTE_NAME)];
+    struct elf64_note nhdr;
+
+    // The policy of the previous image is dropped, the new one (if any) comes from its own note
+    sandbox_task_free(current);
+
+    for (unsigned int i = 0; i < phnum; i++) {
+        const struct elf64_phdr *phdr = &phdrs[i];
+        unsigned long align = (phdr->p_align == 8) ? 8 : 4;
+        unsigned long offset = 0;
+
+        if (phdr->p_type != PT_NOTE) {
+            continue;
+        }
+        while (offset + sizeof(nhdr) <= phdr->p_filesz) {
+            loff_t pos = phdr->p_offset + offset;
+            unsigned long desc_offset, next_offset;
+
+            if (kernel_read(file, &nhdr, sizeof(nhdr), &pos) != sizeof(nhdr)) {
+                return -EIO;
+            }
+            desc_offset = ALIGN(offset + sizeof(nhdr) + nhdr.n_namesz, align);
+            next_offset = ALIGN(desc_offset + nhdr.n_descsz, align);
+            if (next_offset > phdr->p_filesz) {
+                break;
+            }
+
+            if (nhdr.n_type == SANDBOX_NOTE_TYPE && nhdr.n_namesz == sizeof(name)) {
+                if (kernel_read(file, name, sizeof(name), &pos) != sizeof(name)) {
+                    return -EIO;
+                }
+                if (memcmp(name, SANDBOX_NOTE_NAME, sizeof(name)) == 0) {
+                    printk(KERN_INFO "Sandbox note with graph size %u\n", nhdr.n_descsz);
+                    return sandbox_attach_user_graph(load_bias + phdr->p_vaddr + desc_offset, nhdr.n_descsz);
+                }
+            }
+            offset = next_offset;
+        }
+    }
+    return 0;
+}
+#endif // CONFIG_E0_256_SANDBOX_PROJECT
+
+SYSCALL_DEFINE2(sandbox_init, unsigned char*, data, unsigned long, size)
+{
+    unsigned long retval = 0;
+#ifndef CONFIG_E0_256_SANDBOX_PROJECT
+    printk(KERN_INFO "Sandbox Init Syscall:  NOT ENABLED\n");
+    retval = -ENOSYS;
+#else
+    printk(KERN_INFO "Sandbox Init Syscal with buffer size %ld\n", size);
+    retval = sandbox_attach_user_graph((unsigned long)data, size);
 #endif // CONFIG_E0_256_SANDBOX_PROJECT    
     return retval;
 }
@@ -62,8 +442,8 @@ SYSCALL_DEFINE0(sandbox_cleanup)
 #else
     printk(KERN_INFO "Sandbox Cleanup Syscall\n");
 
-    // Free the allocated memory after use
-    kfree(kernel_buffer);
+    // Drop the policy of the current task, its graph is unmapped and unpinned with the last reference
+    sandbox_task_free(current);
 #endif // CONFIG_E0_256_SANDBOX_PROJECT
     return retval;
 }
@@ -76,17 +456,81 @@ SYSCALL_DEFINE1(sandbox_dummycall, unsigned long, number)
     printk(KERN_INFO "Sandbox Dummy Syscall: %ld - NOT ENABLED\n", number);
 #else 
     printk(KERN_INFO "Sandbox Dummy Syscall: %ld\n", number);
-    retval = number;
 
-    if (is_state_transition_valid (number)) {
-        printk(KERN_INFO "Sandbox Dummy Syscall: valid transition\n");
-        retval = transition_to_state(number);
-    } else {
-        printk(KERN_INFO "Sandbox Dummy Syscall: invalid transition\n");
+    // Allow-set policy: a single bit test, no state to move. Automaton: a lookup from the state of the cursor.
+    // The violation mode is only looked at for the libc calls not allowed
+    if (!current->sandbox_cursor) {
+        printk(KERN_INFO "Sandbox Dummy Syscall: no policy\n");
         do_exit(SIGKILL);
+    } else if (unlikely(cursor_transition_to_state(current->sandbox_cursor, number) < 0)) {
+        sandbox_violation(sandbox_task_of(current), number);
+    } else {
+        printk(KERN_INFO "Sandbox Dummy Syscall: valid transition\n");
     }
+    retval = current->sandbox_cursor->progstate;
 #endif // CONFIG_E0_256_SANDBOX_PROJECT
 
     return retval;
 }
 
+
+
+SYSCALL_DEFINE3(sandbox_ctl, unsigned int, cmd, unsigned long, arg, void __user *, buf)
+{
+    long retval = 0;
+#ifndef CONFIG_E0_256_SANDBOX_PROJECT
+    printk(KERN_INFO "Sandbox Ctl Syscall: %u - NOT ENABLED\n", cmd);
+    retval = -ENOSYS;
+#else
+    struct sandbox_task *state = sandbox_task_of(current);
+    struct sandbox_process *process = state ? state->process : NULL;
+    struct sandbox_learn_ring *ring;
+
+    if (!process) {
+        return -ENOENT;
+    }
+
+    switch (cmd) {
+    case SANDBOX_CTL_GET_MODE:
+        retval = READ_ONCE(process->mode);
+        break;
+
+    case SANDBOX_CTL_SET_MODE:
+        // Enforce is the strictest mode, learn the least strict one
+        if (arg > VIOLATION_MODE_LEARN) {
+            return -EINVAL;
+        }
+        if (arg > READ_ONCE(process->mode) && !capable(CAP_SYS_ADMIN)) {
+            return -EPERM;
+        }
+        retval = sandbox_process_set_mode(process, arg);
+        break;
+
+    case SANDBOX_CTL_DRAIN:
+        ring = READ_ONCE(process->learn);
+        while (ring && retval < arg) {
+            struct sandbox_learn_record batch[SANDBOX_DRAIN_BATCH];
+            unsigned long count = 0;
+
+            spin_lock(&ring->lock);
+            while (count < SANDBOX_DRAIN_BATCH && retval + count < arg && ring->tail != ring->head) {
+                batch[count++] = ring->records[ring->tail++ % SANDBOX_LEARN_RING_SIZE];
+            }
+            spin_unlock(&ring->lock);
+
+            if (count == 0) {
+                break;
+            }
+            if (copy_to_user((struct sandbox_learn_record __user *)buf + retval, batch, count * sizeof(batch[0]))) {
+                return -EFAULT;
+            }
+            retval += count;
+        }
+        break;
+
+    default:
+        retval = -EINVAL;
+    }
+#endif // CONFIG_E0_256_SANDBOX_PROJECT
+    return retval;
+}